@@ -0,0 +1,593 @@
+#include "my_common.h"
+#include "my_page_cache.h"
+#include "my_concurrent_alloc.h"
+#include "my_central_cache.h"
+#include<iostream>
+#include<vector>
+#include<chrono>
+#include<unordered_map>
+#include<thread>
+#include<atomic>
+#include<unistd.h>
+#include<algorithm>
+#include<random>
+#include<cstring>
+#include<string>
+#include<linux/perf_event.h>
+#include<sys/syscall.h>
+#include<sys/ioctl.h>
+#include<sys/resource.h>
+
+using std::endl;
+using std::cout;
+
+static double NowNs()
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 比较 释放路径上 页号 -> Span 的查找开销
+// 旧实现: std::unordered_map<Page_ID, Span*>,  新实现: 三层基数树
+void BenchPageMapLookup(size_t n, size_t rounds)
+{
+	std::vector<void*> v;
+	for (size_t i = 0; i < n; ++i)
+	{
+		v.push_back(ConcurrentAlloc(8 + (i * 40) % 4096));
+	}
+
+	std::unordered_map<Page_ID, Span*> hash_map;
+	for (size_t i = 0; i < n; ++i)
+	{
+		Page_ID id = (Page_ID)v[i] >> PAGE_SHIFT;
+		hash_map[id] = PageCache::GetInstance()->MapObjectToSpan(v[i]);
+	}
+
+	size_t sink = 0;
+	double begin1 = NowNs();
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			sink += (size_t)hash_map.find((Page_ID)v[i] >> PAGE_SHIFT)->second;
+		}
+	}
+	double end1 = NowNs();
+
+	double begin2 = NowNs();
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			sink += (size_t)PageCache::GetInstance()->MapObjectToSpan(v[i]);
+		}
+	}
+	double end2 = NowNs();
+
+	cout << "lookup unordered_map : " << (end1 - begin1) / (n * rounds) << " ns/op" << endl;
+	cout << "lookup radix pagemap : " << (end2 - begin2) / (n * rounds) << " ns/op" << endl;
+
+	double begin3 = NowNs();
+	for (size_t i = 0; i < n; ++i)
+	{
+		ConcurrentDealloc(v[i]);
+	}
+	double end3 = NowNs();
+	cout << "ConcurrentDealloc    : " << (end3 - begin3) / n << " ns/op" << endl;
+
+	if (sink == 1)
+		cout << sink << endl;
+}
+
+// 比较 不带大小 和 带大小 的释放, 后者不需要查基数树
+// 对象个数不多, 释放的对象都留在线程缓存里, 只比较快速路径
+void BenchSizedDealloc(size_t n, size_t rounds)
+{
+	std::vector<void*> v(n);
+	std::vector<size_t> sizes(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		sizes[i] = 8 + (i * 40) % 1024;
+	}
+
+	double unsized = 0, sized = 0;
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = ConcurrentAlloc(sizes[i]);
+		}
+		double begin1 = NowNs();
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentDealloc(v[i]);
+		}
+		unsized += NowNs() - begin1;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = ConcurrentAlloc(sizes[i]);
+		}
+		double begin2 = NowNs();
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentDealloc(v[i], sizes[i]);
+		}
+		sized += NowNs() - begin2;
+	}
+
+	cout << "ConcurrentDealloc(p)       : " << unsized / (n * rounds) << " ns/op" << endl;
+	cout << "ConcurrentDealloc(p, size) : " << sized / (n * rounds) << " ns/op" << endl;
+}
+
+// 一次创建 n 个相同大小的节点再全部释放: 逐个调用 和 批量接口 的对比
+void BenchBatchAlloc(size_t size, size_t n, size_t rounds)
+{
+	std::vector<void*> v(n);
+	double single = 0, batch = 0;
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		double begin1 = NowNs();
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = ConcurrentAlloc(size);
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentDealloc(v[i]);
+		}
+		single += NowNs() - begin1;
+
+		double begin2 = NowNs();
+		ConcurrentAllocBatch(size, n, v.data());
+		ConcurrentDeallocBatch(v.data(), n);
+		batch += NowNs() - begin2;
+	}
+
+	cout << "alloc + free " << n << " x " << size << " bytes, single : " << single / (n * rounds)
+	     << " ns/op, batch : " << batch / (n * rounds) << " ns/op" << endl;
+}
+
+// 请求级别的对象: 每个请求分配 n 个大小不一的对象, 请求结束时全部释放
+// 逐个 ConcurrentAlloc / ConcurrentDealloc 和 显式的堆 (结束时整体销毁) 的对比
+void BenchHeap(size_t n, size_t requests)
+{
+	std::vector<void*> v(n);
+	double single = 0, heap = 0;
+	for (size_t r = 0; r < requests; ++r)
+	{
+		double begin1 = NowNs();
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = ConcurrentAlloc(16 + (i * 40) % 512);
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentDealloc(v[i]);
+		}
+		single += NowNs() - begin1;
+
+		double begin2 = NowNs();
+		Heap* h = HeapCreate();
+		for (size_t i = 0; i < n; ++i)
+		{
+			v[i] = HeapAlloc(h, 16 + (i * 40) % 512);
+		}
+		HeapDestroy(h);
+		heap += NowNs() - begin2;
+	}
+
+	cout << "request of " << n << " objects, alloc + free : " << single / (n * requests)
+	     << " ns/op, heap : " << heap / (n * requests) << " ns/op" << endl;
+}
+
+// 不断增大的缓冲区: 每次增大 step 字节 (step 为 0 时翻倍, 像 vector), 直到 max 字节
+// ConcurrentRealloc 和 分配新对象 + memcpy + 释放 的对比
+void BenchRealloc(size_t step, size_t max, size_t rounds)
+{
+	double copy = 0, realloc = 0;
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		double begin1 = NowNs();
+		size_t size = 4096;
+		char* buf = (char*)ConcurrentAlloc(size);
+		buf[size - 1] = 1;
+		while (size < max)
+		{
+			size_t next = step == 0 ? size * 2 : size + step;
+			char* new_buf = (char*)ConcurrentAlloc(next);
+			memcpy(new_buf, buf, size);
+			ConcurrentDealloc(buf);
+			buf = new_buf;
+			size = next;
+			buf[size - 1] = 1;
+		}
+		ConcurrentDealloc(buf);
+		copy += NowNs() - begin1;
+
+		double begin2 = NowNs();
+		size = 4096;
+		buf = (char*)ConcurrentAlloc(size);
+		buf[size - 1] = 1;
+		while (size < max)
+		{
+			size = step == 0 ? size * 2 : size + step;
+			buf = (char*)ConcurrentRealloc(buf, size);
+			buf[size - 1] = 1;
+		}
+		ConcurrentDealloc(buf);
+		realloc += NowNs() - begin2;
+	}
+
+	cout << "grow to " << (max >> 20) << "M by " << (step == 0 ? "doubling" : std::to_string(step >> 10) + "K")
+	     << ", alloc + memcpy : " << copy / rounds / 1000 << " us, realloc : " << realloc / rounds / 1000 << " us"
+	     << endl;
+}
+
+// 页堆的锁竞争: 每个线程反复申请 / 归还 1 ~ 8 页的 Span (CentralCache 的典型请求)
+// 比较 按 CPU 分片的小 Span 缓存 和 只有一把全局锁 的吞吐
+void BenchPageHeapContention(size_t ops)
+{
+	PageCache* page_cache = PageCache::GetInstance();
+	size_t thread_nums[] = { 1, 2, 4, 8, 16, 32, 64 };
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		page_cache->SetSpanCacheEnabled(mode == 0);
+		for (size_t n = 0; n < sizeof(thread_nums) / sizeof(thread_nums[0]); ++n)
+		{
+			std::vector<std::thread> threads;
+			double begin = NowNs();
+			for (size_t t = 0; t < thread_nums[n]; ++t)
+			{
+				threads.emplace_back([page_cache, ops, t]() {
+					Span* window[4] = {};
+					for (size_t i = 0; i < ops; ++i)
+					{
+						Span*& slot = window[i % 4];
+						if (slot != nullptr)
+							page_cache->ReleaseSpanToPageCache(slot);
+						slot = page_cache->NewSpan(1 + (i + t) % SPAN_CACHE_MAX_PAGES);
+					}
+					for (size_t i = 0; i < 4; ++i)
+						page_cache->ReleaseSpanToPageCache(window[i]);
+				});
+			}
+			for (size_t t = 0; t < threads.size(); ++t)
+				threads[t].join();
+			double end = NowNs();
+
+			cout << (mode == 0 ? "sharded span cache " : "global page lock   ") << thread_nums[n]
+			     << " threads : " << thread_nums[n] * ops / ((end - begin) / 1e9) / 1e6 << " Mops/s" << endl;
+		}
+	}
+	page_cache->SetSpanCacheEnabled(true);
+}
+
+// 打开本线程的 dTLB 读缺失计数器, 不支持 (如容器中没有 perf 权限) 时返回 -1
+static int OpenDtlbMissCounter()
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// /proc/self/smaps_rollup 中的 AnonHugePages, 单位 KB
+static long AnonHugePagesKB()
+{
+	FILE* file = fopen("/proc/self/smaps_rollup", "r");
+	if (file == nullptr)
+		return -1;
+	char line[256];
+	long kb = -1;
+	while (fgets(line, sizeof(line), file) != nullptr)
+	{
+		if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(file);
+	return kb;
+}
+
+// 指针追逐: 不同大小的节点按随机顺序连成一个环, 每一跳都是一次依赖的访存, TLB 缺失占主导
+// 比较 小 Span 散落在 4K 页上 和 开启 hugepage 填充器后 的每跳耗时与 dTLB 缺失
+void BenchPointerChase(size_t nodes, size_t hops)
+{
+	PageCache* page_cache = PageCache::GetInstance();
+	for (int mode = 0; mode < 2; ++mode)
+	{
+		page_cache->SetHugePageFiller(mode == 1);
+
+		std::vector<void**> v(nodes);
+		for (size_t i = 0; i < nodes; ++i)
+		{
+			v[i] = (void**)ConcurrentAlloc(16 + (i % 16) * 48);
+		}
+		std::vector<void**> order(v);
+		std::shuffle(order.begin(), order.end(), std::mt19937(12345));
+		for (size_t i = 0; i < nodes; ++i)
+		{
+			*order[i] = order[(i + 1) % nodes];
+		}
+
+		int fd = OpenDtlbMissCounter();
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		void** p = order[0];
+		double begin = NowNs();
+		for (size_t i = 0; i < hops; ++i)
+		{
+			p = (void**)*p;
+		}
+		double end = NowNs();
+		long long misses = -1;
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+				misses = -1;
+			close(fd);
+		}
+
+		cout << (mode == 1 ? "hugepage filler : " : "4K page heap    : ") << (end - begin) / hops << " ns/hop, dTLB misses/hop ";
+		if (misses >= 0)
+			cout << (double)misses / hops;
+		else
+			cout << "n/a";
+		cout << ", AnonHugePages " << AnonHugePagesKB() << " KB" << (p == nullptr ? "!" : "") << endl;
+
+		for (size_t i = 0; i < nodes; ++i)
+		{
+			ConcurrentDealloc(v[i]);
+		}
+	}
+	page_cache->SetHugePageFiller(false);
+}
+
+// 原来的尺寸类别计算, 每次都要走一串分支
+static size_t BranchIndex(size_t bytes)
+{
+	static int group_array[4] = { 16, 56, 56, 56 };
+	if (bytes <= 128)
+		return SizeClass::_Index(bytes, 3);
+	else if (bytes <= 1024)
+		return SizeClass::_Index(bytes - 128, 4) + group_array[0];
+	else if (bytes <= 8 * 1024)
+		return SizeClass::_Index(bytes - 1024, 7) + group_array[0] + group_array[1];
+	else
+		return SizeClass::_Index(bytes - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
+}
+
+// 比较 分支计算 和 查表 得到尺寸类别的开销, 请求大小随机, 分支难以预测
+void BenchSizeClassLookup(size_t n, size_t rounds)
+{
+	std::vector<size_t> sizes;
+	size_t seed = 12345;
+	for (size_t i = 0; i < n; ++i)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		size_t bits = (seed >> 33) % 4;
+		size_t limit[4] = { 128, 1024, 8 * 1024, MAX_BYTES };
+		sizes.push_back(1 + (seed >> 20) % limit[bits]);
+	}
+
+	size_t sink = 0;
+	double begin1 = NowNs();
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			sink += BranchIndex(sizes[i]);
+		}
+	}
+	double end1 = NowNs();
+
+	double begin2 = NowNs();
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			sink += SizeClass::Index(sizes[i]);
+		}
+	}
+	double end2 = NowNs();
+
+	cout << "size class branches  : " << (end1 - begin1) / (n * rounds) << " ns/op" << endl;
+	cout << "size class table     : " << (end2 - begin2) / (n * rounds) << " ns/op" << endl;
+	if (sink == 1)
+		cout << sink << endl;
+}
+
+// 中心缓存上长时间替换的对象群体: 大多数对象很快被释放, 少数长期存活
+// 短命对象全部释放后, 统计 Span 占用的字节数 和 长期对象字节数 之比, 越接近 1 碎片越少
+void BenchCentralFragmentation(size_t live, size_t churn)
+{
+	// 使用一个单独的分区, 页堆的统计只反映这里的 Span
+	CentralCache* central = CentralCache::GetInstance(MAX_NUMA_NODES - 1);
+	PageCache* page_cache = PageCache::GetInstance(MAX_NUMA_NODES - 1);
+	const size_t size = 256;
+	std::mt19937_64 rng(42);
+	std::vector<void*> short_objs, long_objs;
+	auto alloc = [&](std::vector<void*>& objs) {
+		void* start = nullptr;
+		void* end = nullptr;
+		central->FetchRangeObj(start, end, 1, size);
+		objs.push_back(start);
+	};
+	auto free_random = [&](std::vector<void*>& objs) {
+		size_t i = rng() % objs.size();
+		void* obj = objs[i];
+		objs[i] = objs.back();
+		objs.pop_back();
+		NextObj(obj) = nullptr;
+		central->ReleaseListToSpans(obj, size);
+	};
+
+	for (size_t i = 0; i < live; ++i)
+		alloc(short_objs);
+	double begin = NowNs();
+	for (size_t i = 0; i < churn; ++i)
+	{
+		// 5% 的分配是长期对象, 最多 live / 4 个
+		if (rng() % 100 < 5)
+		{
+			alloc(long_objs);
+			if (long_objs.size() > live / 4)
+				free_random(long_objs);
+		}
+		else
+		{
+			free_random(short_objs);
+			alloc(short_objs);
+		}
+	}
+	double end = NowNs();
+
+	while (!short_objs.empty())
+		free_random(short_objs);
+	size_t span_bytes = page_cache->SystemBytes() - page_cache->FreeBytes() - page_cache->ReturnedBytes()
+	                    - page_cache->SpanCacheBytes();
+	cout << "central churn " << live << " live : " << (end - begin) / churn << " ns/op, span/live bytes after shrink "
+	     << (double)span_bytes / (long_objs.size() * size) << endl;
+
+	while (!long_objs.empty())
+		free_random(long_objs);
+}
+
+// 进程刚启动时每个尺寸第一次从 CentralCache 取对象: 线程缓存慢启动, 一开始每次只要 batch 个
+// 统计所有尺寸第一次取对象的总耗时 和 其中发生的缺页次数, 使用一个还没用过的分区, Span 的页都是新映射的
+void BenchSpanRefill(size_t batch)
+{
+	CentralCache* central = CentralCache::GetInstance(MAX_NUMA_NODES - 2);
+	void* heads[NLIST];
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double begin = NowNs();
+	for (size_t i = 0; i < NLIST; ++i)
+	{
+		void* end = nullptr;
+		central->FetchRangeObj(heads[i], end, batch, SizeClass::Size(i));
+		NextObj(end) = nullptr;
+	}
+	double end = NowNs();
+	getrusage(RUSAGE_SELF, &after);
+	cout << "first refill of " << NLIST << " size classes, " << batch << " objs each : " << (end - begin) / 1000
+	     << " us, " << after.ru_minflt - before.ru_minflt << " page faults" << endl;
+
+	for (size_t i = 0; i < NLIST; ++i)
+		central->ReleaseListToSpans(heads[i], SizeClass::Size(i));
+}
+
+// 堆采样对分配 / 释放的开销, rate 为 0 时只有倒数的减法和分支
+void BenchHeapSampling(size_t rate, size_t rounds)
+{
+	HeapProfiler::GetInstance()->SetSampleRate(rate);
+	void* v[256];
+	double begin = NowNs();
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < 256; ++i)
+			v[i] = ConcurrentAlloc(16 + (i % 16) * 32);
+		for (size_t i = 0; i < 256; ++i)
+			ConcurrentDealloc(v[i], 16 + (i % 16) * 32);
+	}
+	double end = NowNs();
+	HeapProfiler::GetInstance()->SetSampleRate(0);
+	cout << "heap sampling rate " << rate << " : " << (end - begin) / (rounds * 256) << " ns/op" << endl;
+}
+
+// 每个线程反复分配 / 释放一组小对象, 全部线程做完后 (仍然存活时) 统计缓存占用的字节数
+// 比较 每线程缓存 和 每 CPU 缓存 在线程数超过核数时的吞吐和内存占用
+void BenchCacheMode(const char* mode, size_t threads_per_cpu, size_t ops)
+{
+	size_t num_cpus = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = num_cpus * threads_per_cpu;
+	std::atomic<size_t> done(0);
+	std::atomic<bool> exit(false);
+
+	std::vector<std::thread> threads;
+	double begin = NowNs();
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			void* v[64];
+			for (size_t i = 0; i < ops; i += 64)
+			{
+				for (size_t j = 0; j < 64; ++j)
+				{
+					v[j] = ConcurrentAlloc(8 + ((i + j) * 41 + t) % 1024);
+				}
+				for (size_t j = 0; j < 64; ++j)
+				{
+					ConcurrentDealloc(v[j]);
+				}
+			}
+			done++;
+			while (!exit)
+				std::this_thread::yield();
+		});
+	}
+	while (done != nthreads)
+		std::this_thread::yield();
+	double end = NowNs();
+
+	size_t cached = CpuCache::GetInstance()->Enabled() ? CpuCache::GetInstance()->TotalCachedBytes()
+	                                                    : ThreadCache::TotalCachedBytes();
+	exit = true;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads[t].join();
+	}
+
+	cout << mode << " " << threads_per_cpu << "x threads/cpu (" << nthreads << " threads) : "
+	     << (end - begin) / (nthreads * ops) << " ns/op, cached " << (cached >> 10) << " KB" << endl;
+}
+
+int main()
+{
+	BenchPageMapLookup(100000, 20);
+	BenchSizeClassLookup(100000, 20);
+	BenchSizedDealloc(1000, 2000);
+	BenchBatchAlloc(32, 64, 20000);
+	BenchBatchAlloc(32, 4096, 500);
+	BenchHeap(1000, 2000);
+	BenchRealloc(0, 256 << 20, 5);
+	BenchRealloc(64 << 10, 16 << 20, 2);
+	BenchPageHeapContention(100000);
+	BenchPointerChase(1 << 20, 1 << 24);
+	BenchCentralFragmentation(200000, 2000000);
+	BenchSpanRefill(2);
+	BenchHeapSampling(0, 20000);
+	BenchHeapSampling(512 << 10, 20000);
+
+	const size_t ops = 1 << 20;
+	size_t multiples[3] = { 1, 4, 16 };
+	for (size_t i = 0; i < 3; ++i)
+	{
+		BenchCacheMode("thread cache", multiples[i], ops);
+	}
+
+	// 每 CPU 缓存开启后不能关闭, 放在最后
+	AllocatorOptions options;
+	options.per_cpu_cache = true;
+	InitAllocator(options);
+	if (!CpuCache::GetInstance()->Enabled())
+	{
+		cout << "per-cpu cache : rseq is not available" << endl;
+		return 0;
+	}
+	for (size_t i = 0; i < 3; ++i)
+	{
+		BenchCacheMode("per-cpu cache", multiples[i], ops);
+	}
+	return 0;
+}
@@ -1,98 +1,157 @@
 #include "my_central_cache.h"
 
 #include "my_page_cache.h"
+#include "my_stats.h"
 
-std::mutex CentralCache::_mutex;
-CentralCache* CentralCache::_instance = nullptr;
+CentralCache::Partitions CentralCache::_partitions;
 
-Span *CentralCache::GetOneSpan(SpanList &spanlist, size_t byte_size) {
-    size_t index = SizeClass::Index(byte_size);
-    SpanList &_span_index_list = _span_list[index];
-    if (_span_index_list.Empty() == false) {
-        auto cur_span = _span_index_list.Begin();
-        while (cur_span != _span_index_list.End()) {
-            if (cur_span->list_ptr != nullptr)
-                return cur_span;
-            else
-                cur_span = cur_span->next;
-        }
+void CentralCache::Link(FreeList &list, Span *span, size_t bucket) {
+    list.lists[bucket].PushFront(span);
+    if (bucket < CENTRAL_SPAN_BUCKETS) list.nonempty |= 1u << bucket;
+}
+
+void CentralCache::Unlink(FreeList &list, Span *span, size_t bucket) {
+    list.lists[bucket].Erase(span);
+    if (bucket < CENTRAL_SPAN_BUCKETS && list.lists[bucket].Empty()) list.nonempty &= ~(1u << bucket);
+}
+
+Span *CentralCache::GetOneSpan(FreeList &list, size_t byte_size) {
+    // 位图中最高的置位就是最满的非空桶
+    if (list.nonempty != 0) {
+        list.hits++;
+        size_t bucket = 31 - __builtin_clz(list.nonempty);
+        return list.lists[bucket].Begin();
     }
 
-    // std::cout << "Now is entering Newspan" << std::endl;
     // 山穷水尽 再要一个Span
-    Span *new_span = PageCache::GetInstance()->NewSpan(SizeClass::NumMovePages(byte_size));
+    list.misses++;
+    size_t index = SizeClass::Index(byte_size);
+    Span *new_span = PageCache::GetInstance(Node())->NewSpan(SizeClass::NumMovePages(byte_size));
     new_span->obj_size = byte_size;
-    char *begin = (char *)(new_span->page_id << PAGE_SHIFT);
-    new_span->list_ptr = begin;
-    char *end = begin + new_span->obj_size;
-
-    while (end != (void *)((new_span->page_id + new_span->page_num) << PAGE_SHIFT)) {
-        NextObj(begin) = end;
-        begin = end;
-        end = end + new_span->obj_size;
-    }
-    NextObj(begin) = nullptr;
-
-    _span_list->PushFront(new_span);
+    new_span->size_class = index;
+    // 对象在 FetchRangeObj 中用到时才切出来, 不用一次写遍 (并触发缺页) 整个 Span
+    new_span->list_ptr = nullptr;
+    new_span->bump = (char *)(new_span->page_id << PAGE_SHIFT);
 
-    // std::cout << "Now is quitting Nes_span" << std::endl;
+    Link(list, new_span, 0);
     return new_span;
-
 }
 
 size_t CentralCache::FetchRangeObj(void *&start, void *&end, size_t n, size_t byte_size) {
     size_t index = SizeClass::Index(byte_size);
-    SpanList &_span_index_list = _span_list[index];
+    size_t capacity = SizeClass::SpanObjs(index);
+    FreeList &list = _free_list[index];
 
-    std::lock_guard<std::mutex> lock(_span_index_list.mutex);
+    std::lock_guard<std::mutex> lock(list.mutex);
 
-    // std::cout << "Now is entering GetOneSpan " << std::endl;
-    Span *new_span = GetOneSpan(_span_index_list, byte_size);
-    start = new_span->list_ptr;
+    Span *new_span = GetOneSpan(list, byte_size);
 
+    // 先拿还回来的对象, 它们可能还在 CPU 缓存中
     size_t batch_size = 0;
-    void *prev = nullptr;
     void *cur = new_span->list_ptr;
-    for (int i = 0; i < n; i++) {
+    start = cur;
+    end = nullptr;
+    while (batch_size < n && cur != nullptr) {
         ++batch_size;
-        prev = cur;
+        end = cur;
         cur = NextObj(cur);
-        if (cur == nullptr) break;
     }
-    end = prev;
-
     new_span->list_ptr = cur;
-    new_span->use_count += batch_size;
 
-    if (new_span->list_ptr == nullptr) {
-        _span_index_list.Erase(new_span);
-        _span_index_list.PushBack(new_span);
+    // 不够时从未分配过的部分切出剩下的, 只写这一批对象
+    // span 的大小不一定是 obj_size 的整数倍, 尾部不足一个对象的部分直接丢弃
+    char *limit = (char *)(new_span->page_id << PAGE_SHIFT) + capacity * byte_size;
+    while (batch_size < n && new_span->bump < limit) {
+        ++batch_size;
+        if (end == nullptr)
+            start = new_span->bump;
+        else
+            NextObj(end) = new_span->bump;
+        end = new_span->bump;
+        new_span->bump += byte_size;
     }
+    assert(batch_size > 0);
+    NextObj(end) = nullptr;
 
-    // std::cout << "Now is quitting FetchRangeObj !" << std::endl;
+    size_t old_bucket = Bucket(new_span->use_count, capacity);
+    new_span->use_count += batch_size;
+
+    size_t new_bucket = Bucket(new_span->use_count, capacity);
+    if (new_bucket != old_bucket) {
+        Unlink(list, new_span, old_bucket);
+        Link(list, new_span, new_bucket);
+    }
     return batch_size;
 }
 
 void CentralCache::ReleaseListToSpans(void *start, size_t byte_size) {
     size_t index = SizeClass::Index(byte_size);
-    SpanList &_cur_span_list = _span_list[index];
+    size_t capacity = SizeClass::SpanObjs(index);
+    FreeList &list = _free_list[index];
 
-    std::lock_guard<std::mutex> lock(_cur_span_list.mutex);
+    // 属于其他节点的对象先挑出来, 解锁后再交给它们的分区
+    void *remote[MAX_NUMA_NODES] = {};
+    bool has_remote = false;
+
+    std::unique_lock<std::mutex> lock(list.mutex);
 
     void *cur = start;
     while (cur != nullptr) {
         void *next = NextObj(cur);
 
         Span *_mapped_span = PageCache::GetInstance()->MapObjectToSpan(cur);
+        if (_mapped_span->node != Node()) {
+            NextObj(cur) = remote[_mapped_span->node];
+            remote[_mapped_span->node] = cur;
+            has_remote = true;
+            cur = next;
+            continue;
+        }
+
         void *_original_list_ptr = _mapped_span->list_ptr;
         NextObj(cur) = _original_list_ptr;
         _mapped_span->list_ptr = cur;
 
+        size_t old_bucket = Bucket(_mapped_span->use_count, capacity);
         if (--_mapped_span->use_count == 0) {
-            _cur_span_list.Erase(_mapped_span);
-            PageCache::GetInstance()->ReleaseSpanToPageCache(_mapped_span);
+            // 全空的 Span 立即还给 PageCache
+            Unlink(list, _mapped_span, old_bucket);
+            PageCache::GetInstance(Node())->ReleaseSpanToPageCache(_mapped_span);
+        } else {
+            size_t new_bucket = Bucket(_mapped_span->use_count, capacity);
+            if (new_bucket != old_bucket) {
+                Unlink(list, _mapped_span, old_bucket);
+                Link(list, _mapped_span, new_bucket);
+            }
         }
 
         cur = next;
     }
-}
\ No newline at end of file
+    lock.unlock();
+
+    if (has_remote) {
+        for (size_t node = 0; node < MAX_NUMA_NODES; node++) {
+            if (remote[node] != nullptr) GetInstance(node)->ReleaseListToSpans(remote[node], byte_size);
+        }
+    }
+}
+
+void CentralCache::AddStats(AllocatorStats *stats) {
+    for (size_t i = 0; i < NLIST; i++) {
+        FreeList &list = _free_list[i];
+        SizeClassStats &cls = stats->size_classes[i];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        for (size_t bucket = 0; bucket <= CENTRAL_SPAN_BUCKETS; bucket++) {
+            for (Span *span = list.lists[bucket].Begin(); span != list.lists[bucket].End(); span = span->next) {
+                size_t used = span->use_count * span->obj_size;
+                size_t free = (span->page_num << PAGE_SHIFT) - used;
+                cls.spans++;
+                cls.live_bytes += used;
+                cls.fragmented_bytes += free;
+                stats->central_cache_bytes += free;
+            }
+        }
+        stats->central_cache.hits += list.hits;
+        stats->central_cache.misses += list.misses;
+    }
+}
@@ -1,6 +1,12 @@
 #ifndef CENTRAL_CACHE_H
 #define CENTRAL_CACHE_H
 #include "my_common.h"
+#include "my_numa.h"
+
+struct AllocatorStats;
+
+// 每个类别的 Span 按使用率分成的桶数, 第 i 个桶的使用率在 [i / N, (i + 1) / N)
+const size_t CENTRAL_SPAN_BUCKETS = 8;
 
 class CentralCache{
 
@@ -8,26 +14,67 @@ public:
     CentralCache(const CentralCache&) = delete;
     CentralCache& operator=(const CentralCache&) = delete;
 
-    static CentralCache* GetInstance(){
-        std::lock_guard<std::mutex> lock(_mutex);
-        if(_instance == nullptr){
-            _instance = new CentralCache();
-        }
-        return _instance;
-    }
-    // 根据 byte_size  计算出
-    Span* GetOneSpan(SpanList& spanlist, size_t byte_size);
+    // 单例在编译期常量初始化, 获取时不需要加锁
+    // NUMA 模式下每个节点一个分区, 从同一节点的 PageCache 分区申请 Span
+    static CentralCache* GetInstance();
+    static CentralCache* GetInstance(size_t node);
+    size_t Node();
+
+    // 从最满的未满 Span 中取最多 n 个对象
     size_t FetchRangeObj(void*& start, void*& end, size_t n, size_t byte_size);
+    // 链表中属于其他节点的对象回到各自节点的分区
     void ReleaseListToSpans(void* start, size_t size);
 
+    // 把每个类别的 Span 数, 分出去的对象 (记在 live_bytes 中, 由调用者减去各级缓存) 和 Span 中的空闲部分加到 stats 中
+    void AddStats(AllocatorStats* stats);
+
 private :
-    CentralCache(){}
+    constexpr CentralCache() {}
+
+    // 一个类别的所有 Span: 还有空闲对象的按使用率分桶, 全部分配出去的单独放一个链表
+    // 总是从最满的桶取, 让其余的 Span 尽快变空, 变空的 Span 立即还给 PageCache
+    struct FreeList{
+        std::mutex mutex;
+        SpanList lists[CENTRAL_SPAN_BUCKETS + 1];   // 最后一个是已满的 Span
+        uint32_t nonempty = 0;                      // 非空的桶的位图, 不含已满的链表
+        uint64_t hits = 0;                          // 从已有的 Span 取 / 切分新 Span 的次数
+        uint64_t misses = 0;
+    };
+
+    // 所在的桶, 已满时为 CENTRAL_SPAN_BUCKETS
+    static size_t Bucket(size_t use_count, size_t capacity){
+        return use_count * CENTRAL_SPAN_BUCKETS / capacity;
+    }
+    static void Link(FreeList& list, Span* span, size_t bucket);
+    static void Unlink(FreeList& list, Span* span, size_t bucket);
+
+    // 最满的未满 Span, 没有时向 PageCache 申请一个新的
+    Span* GetOneSpan(FreeList& list, size_t byte_size);
 
-    SpanList _span_list[NLIST];
+    FreeList _free_list[NLIST];
+
+    struct Partitions;
+    static Partitions _partitions;
+};
 
-    static std::mutex _mutex;
-    static CentralCache* _instance;
+// 直接定义数组时 GCC 不做常量初始化, 见 PageCache::Partitions
+struct CentralCache::Partitions{
+    CentralCache nodes[MAX_NUMA_NODES];
+    constexpr Partitions() {}
 };
 
+inline CentralCache* CentralCache::GetInstance(){
+    return &_partitions.nodes[0];
+}
+
+inline CentralCache* CentralCache::GetInstance(size_t node){
+    assert(node < MAX_NUMA_NODES);
+    return &_partitions.nodes[node];
+}
+
+inline size_t CentralCache::Node(){
+    return this - _partitions.nodes;
+}
+
 
 #endif
\ No newline at end of file
@@ -4,12 +4,20 @@
 #include<assert.h>
 #include<mutex>
 #include<iostream>
+#include<chrono>
+#include<cstdint>
+
+#ifdef CONCURRENT_ALLOC_SIZE_CLASSES
+#include CONCURRENT_ALLOC_SIZE_CLASSES
+#else
+#include "my_size_classes.h"
+#endif
 
 // 该文件包含基本类 和 常量定义
 
 const size_t MAX_BYTES = 64 * 1024; // ThreadCache 负责分配的 小对象的最大内存
 const size_t PAGE_SHIFT = 12;  // 页面大小为4k
-const size_t NLIST = 184;  // 自由链表数组元素个数
+const size_t NLIST = sizeof(SIZE_CLASS_TABLE) / sizeof(SIZE_CLASS_TABLE[0]);  // 自由链表数组元素个数
 const size_t NPAGES = 129; // Span 的最大页面数
 
 // obj 即为自由链表中的节点
@@ -24,12 +32,29 @@ inline static void*& NextObj(void* obj){
     return *((void**)obj);
 }
 
+// 单调时钟, 单位为纳秒
+inline uint64_t NowNanos(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 统计计数器, 只由所属的线程 (或当前 CPU 上的线程) 增加, 其他线程随时读取汇总
+// 读改写分成两次 relaxed 访问, 没有 lock 前缀, 和普通的 ++ 一样便宜
+// 每 CPU 的计数在两次访问之间被抢占时可能丢失个别更新, 只是近似值
+inline void StatAdd(uint64_t& counter, uint64_t n = 1){
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+inline uint64_t StatRead(const uint64_t& counter){
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
 // 自由链表类
 class FreeList{
 private:
     void* _list = nullptr;
-    size_t _size;   // 自由链表中的节点个数
-    size_t _max_size;   //自由链表中最大节点个数
+    size_t _size = 0;   // 自由链表中的节点个数
+    size_t _max_size = 1;   //自由链表中最大节点个数
 
 public:
     // 插入头部
@@ -59,10 +84,26 @@ public:
         return front;
     }
 
+    // 取出前 n 个节点 [start, end], end 的下一节点置为 nullptr
+    void PopRange(void*& start, void*& end, size_t n){
+        assert(n > 0 && n <= _size);
+        start = _list;
+        end = start;
+        for(size_t i = 1; i < n; i++)
+            end = NextObj(end);
+        _list = NextObj(end);
+        NextObj(end) = nullptr;
+        _size -= n;
+    }
+
     bool Empty(){
         return _size == 0;
     }
 
+    void* Front(){
+        return _list;
+    }
+
     size_t Size(){
         return _size;
     }
@@ -76,13 +117,91 @@ public:
     }
 };
 
+// 尺寸类别的查找表, 编译期由 SIZE_CLASS_TABLE 生成
+// 小于等于 1024 的请求按 8 字节粒度直接索引, 更大的按 128 字节粒度索引,
+// 分配和释放时只需要一两次查表, 不再走一串分支
+const size_t SIZE_CLASS_SMALL_MAX = 1024;
+const size_t SIZE_CLASS_SMALL_SHIFT = 3;
+const size_t SIZE_CLASS_LARGE_SHIFT = 7;
+
+struct SizeClassTables{
+    size_t size[NLIST];          // 对象大小
+    size_t num_move[NLIST];      // ThreadCache 和 CentralCache 之间一次搬运的对象个数
+    size_t num_pages[NLIST];     // CentralCache 一次向 PageCache 申请的页数
+    size_t span_objs[NLIST];     // 一个 Span 能切出的对象个数
+    uint8_t small_index[(SIZE_CLASS_SMALL_MAX >> SIZE_CLASS_SMALL_SHIFT) + 1];
+    uint8_t large_index[(MAX_BYTES >> SIZE_CLASS_LARGE_SHIFT) + 1];
+};
+
+// 当 ThreadCache 中某size处没有可用对象, ThreadCache 向 CentralCache 请求分配的对象个数
+constexpr size_t ComputeNumMoveObjs(size_t size){
+    size_t num = MAX_BYTES / size;
+    if(num < 2)
+        num = 2;
+    if(num > 512)
+        num = 512;
+    return num;
+}
+
+// 当 CentralCache 中 某size处可用对象不能满足 ThreadCache 的响应时,
+// 向 PageCache 请求的span大小(单位为页)
+constexpr size_t ComputeNumMovePages(size_t size){
+    size_t npages = (ComputeNumMoveObjs(size) * size) >> PAGE_SHIFT;
+    if(npages == 0)
+        npages = 1;
+    return npages;
+}
+
+constexpr bool ValidSizeClassTable(){
+    if(NLIST == 0 || NLIST > 255 || SIZE_CLASS_TABLE[NLIST - 1] != MAX_BYTES)
+        return false;
+    for(size_t i = 0; i < NLIST; i++){
+        size_t size = SIZE_CLASS_TABLE[i];
+        if(size == 0 || size % 8 != 0)
+            return false;
+        if(i > 0 && size <= SIZE_CLASS_TABLE[i - 1])
+            return false;
+        if(size > SIZE_CLASS_SMALL_MAX && size % (1 << SIZE_CLASS_LARGE_SHIFT) != 0)
+            return false;
+    }
+    return true;
+}
+static_assert(ValidSizeClassTable(), "SIZE_CLASS_TABLE: 升序, 8 的倍数, 大于 1024 的是 128 的倍数, 以 MAX_BYTES 结尾, 最多 255 个");
+
+constexpr SizeClassTables MakeSizeClassTables(){
+    SizeClassTables tables{};
+    for(size_t i = 0; i < NLIST; i++){
+        tables.size[i] = SIZE_CLASS_TABLE[i];
+        tables.num_move[i] = ComputeNumMoveObjs(SIZE_CLASS_TABLE[i]);
+        tables.num_pages[i] = ComputeNumMovePages(SIZE_CLASS_TABLE[i]);
+        tables.span_objs[i] = (tables.num_pages[i] << PAGE_SHIFT) / SIZE_CLASS_TABLE[i];
+    }
+
+    // 每一格对应的请求大小, 映射到能放下它的最小类别
+    size_t cls = 0;
+    for(size_t i = 0; i < sizeof(tables.small_index); i++){
+        while(SIZE_CLASS_TABLE[cls] < (i << SIZE_CLASS_SMALL_SHIFT))
+            cls++;
+        tables.small_index[i] = (uint8_t)cls;
+    }
+    cls = 0;
+    for(size_t i = 0; i < sizeof(tables.large_index); i++){
+        while(SIZE_CLASS_TABLE[cls] < (i << SIZE_CLASS_LARGE_SHIFT))
+            cls++;
+        tables.large_index[i] = (uint8_t)cls;
+    }
+    return tables;
+}
+
+inline constexpr SizeClassTables SIZE_CLASS_TABLES = MakeSizeClassTables();
+
 class SizeClass{
 public:
     // 返回 大小为size 的内存块 对应的自由链表在数组中的index
     // size 最小为1 
     inline static size_t _Index(size_t size, size_t align){
         size_t alignnum = 1 << align;
-        return (size + alignnum - 1) >> align - 1; 
+        return ((size + alignnum - 1) >> align) - 1;
     }
 
     // 将 size 上调为 align 的倍数
@@ -95,63 +214,42 @@ public:
     }
 
 public:
-    // 我是一名复制粘贴怪! 
-    // 控制在12%左右的内碎片浪费
-	// [1,128]				8byte对齐 freelist[0,16)
-	// [129,1024]			16byte对齐 freelist[16,72)
-	// [1025,8*1024]		128byte对齐 freelist[72,128)
-	// [8*1024+1,64*1024]	1024byte对齐 freelist[128,184)
-
-    // 可以根据具体情况进行调整
+    // 类别的划分见 my_size_classes.h
     inline static size_t Index(size_t bytes){
-        assert(bytes <= 64 * 1024);
-        
-        static int group_array[4] = {16, 56, 56, 56};
-
-        if(bytes <= 128){
-            return _Index(bytes, 3);
-        }else if(bytes <= 1024){
-            return _Index(bytes - 128 , 4) + group_array[0];
-        }else if(bytes <= 8 * 1024){
-            return _Index(bytes - 1024, 7) + group_array[0] + group_array[1];
+        assert(bytes <= MAX_BYTES);
+
+        if(bytes <= SIZE_CLASS_SMALL_MAX){
+            return SIZE_CLASS_TABLES.small_index[(bytes + 7) >> SIZE_CLASS_SMALL_SHIFT];
         }else {
-            return _Index(bytes - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
+            return SIZE_CLASS_TABLES.large_index[(bytes + 127) >> SIZE_CLASS_LARGE_SHIFT];
         }
     }
 
+    // 第 index 个自由链表中对象的大小
+    inline static size_t Size(size_t index){
+        assert(index < NLIST);
+        return SIZE_CLASS_TABLES.size[index];
+    }
+
     inline static size_t RoundUp(size_t bytes){
-        assert(bytes <= 64 * 1024);
-
-        if(bytes <= 128){
-            return _RoundUp(bytes, 3);
-        }else if(bytes <= 1024){
-            return _RoundUp(bytes, 4);
-        }else if(bytes <= 8 * 1024){
-            return _RoundUp(bytes, 7);
-        }else {
-            return _RoundUp(bytes, 10);
-        }
+        return Size(Index(bytes));
     }
 
     // 当 ThreadCache 中某size处没有可用对象, ThreadCache 调用该函数 向 CentralCache 
     // 请求 分配  NumMoveObjs(size) 个对象
     inline static size_t NumMoveObjs(size_t size){
-        auto num = MAX_BYTES / size;
-        if(num < 2) 
-            num = 2;
-        if(num > 512)
-            num = 512;
-        return num;
+        return SIZE_CLASS_TABLES.num_move[Index(size)];
     }
 
     // 当 CentralCache 中 某size处可用对象不能满足 ThreadCache 的响应时, 
     // 向 PageCache 请求 大小为 NumMovePages 的span对象(单位为页)
     inline static size_t NumMovePages(size_t size){
-        auto num = NumMoveObjs(size);
-        size_t npages = (num * size) >> PAGE_SHIFT;
-        if(npages == 0) 
-            npages = 1;
-        return npages;
+        return SIZE_CLASS_TABLES.num_pages[Index(size)];
+    }
+
+    // 第 index 个类别的一个 Span 中的对象个数
+    inline static size_t SpanObjs(size_t index){
+        return SIZE_CLASS_TABLES.span_objs[index];
     }
 };
 
@@ -160,6 +258,9 @@ using Page_ID = unsigned long long;
 // 既可以分配内存出去 (Central Free List 中切分成若干个object, 向 Thread Cache 分配)
 // 也负责将内存回收到 PageCache 合并 (use_count 为 0)
 
+class ThreadCache;
+class Heap;
+
 struct Span{    
     Page_ID page_id = 0 ;  //页号
     size_t page_num = 0 ;  //页数
@@ -167,51 +268,61 @@ struct Span{
     Span* prev = nullptr ; 
     Span* next = nullptr ;
 
-    void* list_ptr = nullptr;  // Span下面挂着的object
+    Span* left = nullptr;    // 空闲的大 Span 在 SpanTree 中的左右子树
+    Span* right = nullptr;
+
+    void* list_ptr = nullptr;  // Span下面挂着的object, 只有还回来的对象才串在这里
+    char* bump = nullptr;      // 从未分配过的部分的起点, 按需切出对象, 不预先串成链表
     size_t obj_size = 0;   // object的大小
+    size_t size_class = 0;   // 小对象所属的尺寸类别, 释放时不用再根据 obj_size 计算
 
     size_t use_count = 0;  //分配出去的obj的数目
+
+    size_t node = 0;       // 所属的 NUMA 节点, 即 PageCache / CentralCache 的分区
+    uint32_t sampled = 0;  // 其中被堆分析器采样的存活对象个数, 见 HeapProfiler
+    ThreadCache* owner = nullptr;   // 最近一次从这个 Span 取走对象的线程, 其他线程释放的对象还给它
+    Heap* heap = nullptr;           // 属于显式的堆时, 其中的对象只能随堆一起释放, 见 my_heap.h
+
+    bool is_use = false;   // 是否已从 PageCache 分配出去, 合并时只能合并空闲的 Span
+    bool is_returned = false;   // 空闲时物理页是否已经还给系统
+    uint64_t idle_since = 0;    // 进入 PageCache 空闲链表的时间, 供后台回收线程判断是否闲置
 };
 
 // 双向循环列表, 插入删除效率高
+// 哨兵节点直接嵌在对象内部, 构造函数是 constexpr 的,
+// 这样 CentralCache / PageCache 的单例可以在编译期完成常量初始化
 class SpanList{
     
+private:
+    Span _head;
+
 public:
-    Span* head;
     std::mutex mutex;
     
 public: 
-    SpanList() : head(new Span()) {
-        head -> next = head;
-        head -> prev = head;
-    }
-
-    ~SpanList() {
-        Span* cur = head -> next;
-        while(cur != head){
-            Span* next = cur -> next;
-            // 因为整个内存池都销毁, 是不是这时候一定是进程销毁了?  是 
-            // 获得的内存由我们再分配
-            // 保存页面页号的数据结构被破坏, 而系统仍然认为这时候我们持有这块内存
-            delete cur; 
-            cur = next;
-        }
-        delete head;
-        head = nullptr;
+    constexpr SpanList() : _head(), mutex() {
+        _head.next = &_head;
+        _head.prev = &_head;
     }
 
+    SpanList(const SpanList&) = delete;
+    SpanList& operator=(const SpanList&) = delete;
+
+    // 不提供析构函数: 内存池的生命周期和进程相同,
+    // 进程退出时其他静态对象的析构函数仍可能释放内存
+
     // 返回第一个节点
     Span* Begin(){
-        return head -> next;
+        return _head.next;
     }
 
     // 返回最后一个节点的下一节点
     Span* End(){
-        return head;
+        return &_head;
     }
 
     bool Empty(){
-        return head -> next == head;
+        return _head.next == &_head;
     }
 
     // 在 pos前插入
@@ -260,4 +371,121 @@ public:
     }
 };
 
+// 按 (页数, 起始页号) 排序的空闲 Span 集合, 给 NPAGES 页以上的大 Span 做最佳适配
+// 侵入式的 treap: 节点就是 Span 本身, 优先级由页号散列得到, 插入删除不需要分配内存
+// 构造函数是 constexpr 的, 不加锁, 由使用者保护
+class SpanTree{
+private:
+    Span* _root = nullptr;
+    size_t _size = 0;
+
+    static bool Less(const Span* a, const Span* b){
+        return a -> page_num < b -> page_num || (a -> page_num == b -> page_num && a -> page_id < b -> page_id);
+    }
+
+    static uint64_t Priority(const Span* span){
+        return (uint64_t)span -> page_id * 0x9E3779B97F4A7C15ull;
+    }
+
+    // 把 tree 拆成 小于 key 的 left 和 不小于 key 的 right
+    static void Split(Span* tree, const Span* key, Span*& left, Span*& right){
+        if(tree == nullptr){
+            left = right = nullptr;
+        }else if(Less(tree, key)){
+            Split(tree -> right, key, tree -> right, right);
+            left = tree;
+        }else {
+            Split(tree -> left, key, left, tree -> left);
+            right = tree;
+        }
+    }
+
+    // left 中的节点全部小于 right 中的节点
+    static Span* Merge(Span* left, Span* right){
+        if(left == nullptr)
+            return right;
+        if(right == nullptr)
+            return left;
+        if(Priority(left) > Priority(right)){
+            left -> right = Merge(left -> right, right);
+            return left;
+        }
+        right -> left = Merge(left, right -> left);
+        return right;
+    }
+
+    static Span* Erase(Span* tree, Span* span){
+        assert(tree != nullptr);
+        if(tree == span)
+            return Merge(span -> left, span -> right);
+        if(Less(span, tree))
+            tree -> left = Erase(tree -> left, span);
+        else
+            tree -> right = Erase(tree -> right, span);
+        return tree;
+    }
+
+    // 从大到小中序遍历, 返回第一个满足 pred 的节点
+    template <class Pred>
+    static Span* FindLast(Span* tree, Pred& pred){
+        if(tree == nullptr)
+            return nullptr;
+        Span* found = FindLast(tree -> right, pred);
+        if(found != nullptr)
+            return found;
+        if(pred(tree))
+            return tree;
+        return FindLast(tree -> left, pred);
+    }
+
+public:
+    constexpr SpanTree() {}
+
+    SpanTree(const SpanTree&) = delete;
+    SpanTree& operator=(const SpanTree&) = delete;
+
+    bool Empty(){
+        return _root == nullptr;
+    }
+
+    size_t Size(){
+        return _size;
+    }
+
+    void Insert(Span* span){
+        span -> left = span -> right = nullptr;
+        Span* left;
+        Span* right;
+        Split(_root, span, left, right);
+        _root = Merge(Merge(left, span), right);
+        _size++;
+    }
+
+    void Erase(Span* span){
+        _root = Erase(_root, span);
+        span -> left = span -> right = nullptr;
+        _size--;
+    }
+
+    // 不少于 n 页的 Span 中最小的一个, 页数相同时取地址最低的, 没有时返回 nullptr
+    Span* BestFit(size_t n){
+        Span* best = nullptr;
+        for(Span* cur = _root; cur != nullptr;){
+            if(cur -> page_num >= n){
+                best = cur;
+                cur = cur -> left;
+            }else {
+                cur = cur -> right;
+            }
+        }
+        return best;
+    }
+
+    // 从最大的 Span 开始找第一个满足 pred 的
+    template <class Pred>
+    Span* FindLast(Pred pred){
+        return FindLast(_root, pred);
+    }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "my_concurrent_alloc.h"
+
+#include <string.h>
+
+void InitAllocator(const AllocatorOptions& options) {
+    if (options.numa) NumaTopology::GetInstance()->Init();
+    if (options.hugepage_filler) PageCache::GetInstance()->SetHugePageFiller(true);
+    for (size_t node = 0; node < NumaTopology::GetInstance()->NumNodes(); node++) {
+        PageCache::GetInstance(node)->SetReleaseOnFreeBytes(options.release_on_free_bytes);
+    }
+    if (!options.per_cpu_cache || !CpuCache::GetInstance()->Init()) {
+        ThreadCache::GetCache();
+    }
+    PageCache* page_cache = PageCache::GetInstance();
+    page_cache->ReleaseSpanToPageCache(page_cache->NewSpan(NPAGES - 1));
+}
+
+static inline void* Allocate(size_t size) {
+    if (size > MAX_BYTES) {
+        size_t node = NumaTopology::GetInstance()->CurrentNode();
+        Span* new_span = PageCache::GetInstance(node)->AllocBigPageObj(size);
+        return (void*)(new_span->page_id << PAGE_SHIFT);
+    } else {
+        // std::cout << "Now is entering " << "Allocate" << std::endl;
+        if (CpuCache::GetInstance()->Enabled()) {
+            void* ptr = CpuCache::GetInstance()->Allocate(size);
+            if (ptr != nullptr) return ptr;
+        }
+        return ThreadCache::GetCache()->Allocate(size);
+    }
+}
+
+void* ConcurrentAlloc(size_t size) {
+    void* ptr = Allocate(size);
+    if (__builtin_expect(HeapProfiler::ShouldSample(size), 0)) HeapProfiler::GetInstance()->RecordAlloc(ptr, size);
+    return ptr;
+}
+
+void* ConcurrentAllocAligned(size_t size, size_t align) {
+    assert(align != 0 && (align & (align - 1)) == 0);
+
+    const size_t page_size = (size_t)1 << PAGE_SHIFT;
+    if (align > page_size) {
+        size_t node = NumaTopology::GetInstance()->CurrentNode();
+        Span* new_span = PageCache::GetInstance(node)->AllocBigPageObj(size, align);
+        void* ptr = (void*)(new_span->page_id << PAGE_SHIFT);
+        if (__builtin_expect(HeapProfiler::ShouldSample(size), 0)) HeapProfiler::GetInstance()->RecordAlloc(ptr, size);
+        return ptr;
+    }
+
+    // Span 从页边界开始切分, 对象大小是 align 的倍数时每个对象都是对齐的
+    // MAX_BYTES 是页大小的倍数, 所以一定能找到这样的类别
+    size_t rounded = (size + align - 1) & ~(align - 1);
+    if (rounded <= MAX_BYTES) {
+        for (size_t index = SizeClass::Index(rounded); index < NLIST; index++) {
+            if (SizeClass::Size(index) % align == 0) return ConcurrentAlloc(SizeClass::Size(index));
+        }
+    }
+    // 大对象按页对齐
+    return ConcurrentAlloc(rounded > MAX_BYTES ? rounded : MAX_BYTES + 1);
+}
+
+// 释放 size_class 类别的小对象
+// 知道 span 时, 其他线程的对象压入所属线程的远程释放栈, 不进入本线程的缓存
+static void DeallocSmall(void* ptr, size_t size_class, Span* span = nullptr) {
+    if (CpuCache::GetInstance()->Enabled() &&
+        CpuCache::GetInstance()->Deallocate(ptr, size_class)) return;
+    ThreadCache* cache = ThreadCache::GetCache();
+    if (span != nullptr && cache->FreeToOwner(ptr, size_class, span)) return;
+    cache->Deallocate(ptr, size_class);
+}
+
+void ConcurrentDealloc(void* ptr) {
+    Span* mapped_span = PageCache::GetInstance()->FindSpan(ptr);
+    if (mapped_span == nullptr) {
+        // 作为 malloc 使用时, 动态链接器在内存池接管之前分配的内存也可能被释放到这里
+        return;
+    }
+    // 堆中的对象随堆一起释放
+    if (mapped_span->heap != nullptr) return;
+    // 记录要在对象被重新分配之前删除
+    if (__builtin_expect(HeapProfiler::MaybeSampled(mapped_span), 0)) HeapProfiler::GetInstance()->RecordFree(ptr, mapped_span);
+    if (mapped_span->obj_size > MAX_BYTES) {
+        PageCache::GetInstance()->FreeBigPageObj(mapped_span);
+    } else {
+        DeallocSmall(ptr, mapped_span->size_class, mapped_span);
+    }
+}
+
+void ConcurrentDealloc(void* ptr, size_t size) {
+    // 存在被采样的对象或者存活的堆时要查出 Span 才知道 ptr 是否被采样 / 属于堆
+    if (size > MAX_BYTES ||
+        __builtin_expect(HeapProfiler::GetInstance()->NumSamples() != 0 || Heap::NumHeaps() != 0, 0)) {
+        ConcurrentDealloc(ptr);
+        return;
+    }
+
+    size_t size_class = SizeClass::Index(size);
+#ifndef NDEBUG
+    Span* mapped_span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+    assert(mapped_span->obj_size <= MAX_BYTES && "ConcurrentDealloc: size hint 与实际对象不符");
+    assert(mapped_span->size_class == size_class && "ConcurrentDealloc: size hint 与实际对象不符");
+#endif
+    DeallocSmall(ptr, size_class);
+}
+
+void ConcurrentAllocBatch(size_t size, size_t n, void** out) {
+    // 大对象和每 CPU 缓存逐个分配
+    if (size > MAX_BYTES || CpuCache::GetInstance()->Enabled()) {
+        for (size_t i = 0; i < n; i++) out[i] = ConcurrentAlloc(size);
+        return;
+    }
+    ThreadCache::GetCache()->AllocateBatch(SizeClass::Index(size), n, out);
+    if (__builtin_expect(HeapProfiler::ShouldSampleBatch(size, n), 0)) {
+        for (size_t i = 0; i < n; i++) {
+            if (HeapProfiler::ShouldSample(size)) HeapProfiler::GetInstance()->RecordAlloc(out[i], size);
+        }
+    }
+}
+
+// 每次先查出一组指针所在的 Span, 再逐个释放
+// 释放可能把 Span 还给 PageCache, 所以查找的结果不能跨组使用
+static const size_t DEALLOC_BATCH_GROUP = 64;
+
+void ConcurrentDeallocBatch(void** ptrs, size_t n) {
+    Span* spans[DEALLOC_BATCH_GROUP];
+    for (size_t base = 0; base < n; base += DEALLOC_BATCH_GROUP) {
+        size_t count = std::min(n - base, DEALLOC_BATCH_GROUP);
+        Span* span = nullptr;
+        for (size_t i = 0; i < count; i++) {
+            Page_ID page = (Page_ID)ptrs[base + i] >> PAGE_SHIFT;
+            if (span == nullptr || page - span->page_id >= span->page_num) {
+                span = ptrs[base + i] == nullptr ? nullptr : PageCache::GetInstance()->FindSpan(ptrs[base + i]);
+            }
+            spans[i] = span;
+        }
+
+        // 属于同一个 Span 的一段, 由本线程缓存的对象整段放进自由链表
+        ThreadCache* cache = CpuCache::GetInstance()->Enabled() ? nullptr : ThreadCache::GetCache();
+        for (size_t i = 0, run; i < count; i += run) {
+            span = spans[i];
+            for (run = 1; i + run < count && spans[i + run] == span;) run++;
+            if (span == nullptr || span->heap != nullptr) continue;
+
+            void** begin = ptrs + base + i;
+            if (__builtin_expect(HeapProfiler::MaybeSampled(span), 0)) {
+                for (size_t k = 0; k < run; k++) HeapProfiler::GetInstance()->RecordFree(begin[k], span);
+            }
+            if (span->obj_size > MAX_BYTES) {
+                // 大对象的 Span 中只有一个对象
+                PageCache::GetInstance()->FreeBigPageObj(span);
+            } else if (cache != nullptr && !cache->OwnedByOther(span)) {
+                cache->DeallocateRange(begin, run, span->size_class);
+            } else {
+                for (size_t k = 0; k < run; k++) DeallocSmall(begin[k], span->size_class, span);
+            }
+        }
+    }
+}
+
+// 不能原地调整的大对象达到这个大小时用 mremap 移动物理页, 更小的拷贝比两次系统调用便宜
+static const size_t REALLOC_REMAP_BYTES = 1 << 20;
+
+static inline size_t UsableSize(Span* span) {
+    return span->obj_size > MAX_BYTES ? span->page_num << PAGE_SHIFT : span->obj_size;
+}
+
+void* ConcurrentRealloc(void* ptr, size_t size) {
+    if (ptr == nullptr) return ConcurrentAlloc(size);
+    Span* span = PageCache::GetInstance()->FindSpan(ptr);
+    if (span == nullptr) return nullptr;
+
+    size_t usable = UsableSize(span);
+    if (size <= usable && size >= usable / 2) return ptr;
+
+    // 被采样的大对象改变地址或大小后记录就失效了, 和堆中的对象一样只能拷贝
+    if (span->obj_size > MAX_BYTES && size > MAX_BYTES && span->heap == nullptr &&
+        !HeapProfiler::MaybeSampled(span)) {
+        PageCache* page_cache = PageCache::GetInstance(span->node);
+        if (page_cache->ResizeBigPageObj(span, size)) return ptr;
+        if (size > usable && usable >= REALLOC_REMAP_BYTES) {
+            Span* new_span = page_cache->RemapBigPageObj(span, size);
+            if (new_span != nullptr) return (void*)(new_span->page_id << PAGE_SHIFT);
+        }
+    }
+
+    void* new_ptr = span->heap != nullptr ? span->heap->Alloc(size) : ConcurrentAlloc(size);
+    memcpy(new_ptr, ptr, std::min(size, usable));
+    ConcurrentDealloc(ptr);
+    return new_ptr;
+}
+
+size_t ConcurrentUsableSize(void* ptr) {
+    Span* mapped_span = PageCache::GetInstance()->FindSpan(ptr);
+    if (mapped_span == nullptr) return 0;
+    return UsableSize(mapped_span);
+}
@@ -3,29 +3,112 @@
 
 #include "my_central_cache.h"
 #include "my_common.h"
+#include "my_cpu_cache.h"
+#include "my_heap.h"
+#include "my_heap_profiler.h"
 #include "my_page_cache.h"
+#include "my_scavenger.h"
+#include "my_stats.h"
 #include "my_thread_cache.h"
 
-void* ConcurrentAlloc(size_t size) {
-    if (size > MAX_BYTES) {
-        Span* new_span = PageCache::GetInstance()->AllocBigPageObj(size);
-        return (void*)(new_span->page_id << PAGE_SHIFT);
-    } else {
-        if (thread_local_cache == nullptr) {
-            thread_local_cache = new ThreadCache();
-        }
-        // std::cout << "Now is entering " << "Allocate" << std::endl;
-        return thread_local_cache->Allocate(size);
-    }
-}
-
-void ConcurrentDealloc(void* ptr) {
-    Span* mapped_span = PageCache::GetInstance()->MapObjectToSpan(ptr);
-    if (mapped_span->obj_size > MAX_BYTES) {
-        PageCache::GetInstance()->FreeBigPageObj(ptr, mapped_span);
-    } else {
-        thread_local_cache->Deallocate(mapped_span->obj_size, ptr);
-    }
-}
+struct AllocatorOptions {
+    // 小对象使用每 CPU 缓存代替每线程缓存, 适合线程数远多于核数的场景
+    // 需要内核和 glibc 支持 rseq, 不支持时仍然使用 ThreadCache
+    bool per_cpu_cache = false;
+    // 小 Span 紧凑地放进 2M 对齐的透明大页中, 减少 TLB 缺失, 见 my_huge_page_filler.h
+    bool hugepage_filler = false;
+    // 按 /sys/devices/system/node 中的 NUMA 节点划分页堆和中心缓存, 只有一个节点时不起作用
+    bool numa = false;
+    // 没有运行后台回收线程时, 释放后合并出的空闲 Span 不小于这个大小才立即还给系统, 0 表示从不立即归还
+    // 更小的空闲页保留物理内存, 由 ReleaseToSystem 或后台回收线程归还
+    size_t release_on_free_bytes = RELEASE_ON_FREE_BYTES;
+};
+
+// 可选的显式初始化入口
+// CentralCache / PageCache 在编译期完成初始化, 这里只做预热:
+// 创建调用线程的 ThreadCache, 并提前向系统申请一块页面 (同时建好基数树的节点),
+// 避免首次分配的开销落在对延迟敏感的请求上. 工作线程也可以各自调用一次
+// 每 CPU 缓存需要在分配任何对象之前, 由主线程通过 options 开启, 开启后不能关闭
+void InitAllocator(const AllocatorOptions& options = AllocatorOptions());
+
+void* ConcurrentAlloc(size_t size);
+
+// 返回按 align 对齐的内存, align 必须是 2 的幂
+// 不超过一页的对齐从对象大小是 align 倍数的尺寸类别中分配, 更大的对齐直接向系统映射
+void* ConcurrentAllocAligned(size_t size, size_t align);
+
+// 未被内存池管理的指针和堆中的对象直接忽略
+void ConcurrentDealloc(void* ptr);
+
+// 调用者知道对象大小时使用, size 必须与分配时传给 ConcurrentAlloc 的大小相同
+// 小对象直接由 size 查出尺寸类别, 不需要查基数树; 大对象仍然要通过 Span 释放页面
+// 存在存活的堆或者被采样的对象时退回不带 size 的释放, 堆中的对象同样被忽略
+void ConcurrentDealloc(void* ptr, size_t size);
+
+// 把 ptr 调整为 size 字节, 返回调整后的指针, 前 min(原大小, size) 字节保持不变; ptr 为空时等同于 ConcurrentAlloc
+// 放得下且浪费不到一半时原地返回. 大对象先尝试原地伸缩 (吞并后面空闲的页 / 把尾部还回页堆),
+// 再大的用 mremap 把物理页移到新地址, 都不行时才分配新对象并拷贝. 堆中的对象从同一个堆中重新分配
+// 未被内存池管理的指针不知道原来的大小, 返回 nullptr
+void* ConcurrentRealloc(void* ptr, size_t size);
+
+// 一次分配 n 个 size 字节的对象写进 out, 用于批量创建大小相同的节点
+// 小对象只计算一次尺寸类别, 线程缓存不够时整批地从中心缓存取, 不经过自由链表
+void ConcurrentAllocBatch(size_t size, size_t n, void** out);
+
+// 一次释放 n 个对象, 对象大小可以不同, 空指针, 未被内存池管理的指针和堆中的对象直接忽略
+// 相邻的属于同一个 Span 的指针只查一次基数树
+void ConcurrentDeallocBatch(void** ptrs, size_t n);
+
+// ptr 实际可用的字节数, 未被内存池管理的指针返回 0
+size_t ConcurrentUsableSize(void* ptr);
+
+// 继承它的类用内存池分配对象
+// delete 时编译器会调用带大小的 operator delete (C++14), 释放时不需要查基数树
+// 对于有虚析构函数的基类, 传入的是实际对象的大小
+struct ConcurrentAllocated {
+    static void* operator new(size_t size) {
+        return ConcurrentAlloc(size);
+    }
+
+    static void operator delete(void* ptr, size_t size) {
+        ConcurrentDealloc(ptr, size);
+    }
+
+    static void* operator new[](size_t size) {
+        return ConcurrentAlloc(size);
+    }
+
+    static void operator delete[](void* ptr, size_t size) {
+        ConcurrentDealloc(ptr, size);
+    }
+};
+
+// 标准容器的分配器, 容器释放时总是带着元素个数, 走带大小的释放路径
+template <class T>
+struct ConcurrentAllocator {
+    typedef T value_type;
+
+    ConcurrentAllocator() noexcept {}
+    template <class U>
+    ConcurrentAllocator(const ConcurrentAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return (T*)ConcurrentAlloc(n * sizeof(T));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        ConcurrentDealloc(ptr, n * sizeof(T));
+    }
+
+    template <class U>
+    bool operator==(const ConcurrentAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(const ConcurrentAllocator<U>&) const noexcept {
+        return false;
+    }
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,307 @@
+#include "my_cpu_cache.h"
+
+#include <unistd.h>
+#include <algorithm>
+
+#include "my_central_cache.h"
+#include "my_page_cache.h"
+#include "my_stats.h"
+#include "my_transfer_cache.h"
+
+#if defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define CPU_CACHE_HAS_RSEQ 1
+#else
+#define CPU_CACHE_HAS_RSEQ 0
+#endif
+
+CpuCache CpuCache::_instance;
+
+#if CPU_CACHE_HAS_RSEQ
+
+#define CPU_CACHE_STR_(x) #x
+#define CPU_CACHE_STR(x) CPU_CACHE_STR_(x)
+
+enum RseqResult { RSEQ_OK, RSEQ_EMPTY_OR_FULL, RSEQ_ABORT };
+
+static inline struct rseq* CurrentRseq() {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// 以下两个临界区的结构相同:
+//   3: 描述临界区的 rseq_cs 结构 (起始地址, 提交点偏移, 中止处理地址)
+//   进入时把 3 的地址写入 rseq->rseq_cs, 然后检查 CPU 号是否仍是 cpu,
+//   1 到 2 之间被抢占 / 迁移 / 收到信号时, 内核跳到 4 (前面是注册时约定的签名)
+//   最后一条写 count 的指令是提交点
+static inline RseqResult RseqPop(struct rseq* rs, int cpu, CpuCache::FreeArray* array, void** out) {
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[abort]\n\t"
+        "movq %[count], %%rax\n\t"
+        "testq %%rax, %%rax\n\t"
+        "jz %l[empty]\n\t"
+        "movq -8(%[items], %%rax, 8), %%rdx\n\t"
+        "movq %%rdx, (%[out])\n\t"
+        "decq %%rax\n\t"
+        "movq %%rax, %[count]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " CPU_CACHE_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [count] "m"(array->count), [items] "r"(array->items), [out] "r"(out)
+        : "memory", "cc", "rax", "rdx"
+        : abort, empty);
+    return RSEQ_OK;
+abort:
+    return RSEQ_ABORT;
+empty:
+    return RSEQ_EMPTY_OR_FULL;
+}
+
+static inline RseqResult RseqPush(struct rseq* rs, int cpu, CpuCache::FreeArray* array, void* obj) {
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[abort]\n\t"
+        "movq %[count], %%rax\n\t"
+        "cmpq %[capacity], %%rax\n\t"
+        "jae %l[full]\n\t"
+        "movq %[obj], (%[items], %%rax, 8)\n\t"
+        "incq %%rax\n\t"
+        "movq %%rax, %[count]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " CPU_CACHE_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [count] "m"(array->count), [capacity] "m"(array->capacity),
+          [items] "r"(array->items), [obj] "r"(obj)
+        : "memory", "cc", "rax"
+        : abort, full);
+    return RSEQ_OK;
+abort:
+    return RSEQ_ABORT;
+full:
+    return RSEQ_EMPTY_OR_FULL;
+}
+
+// glibc 2.35 起 (即提供 <sys/rseq.h> 的版本) 由 glibc 为每个线程注册 rseq, 这里只使用它注册好的区域
+// 内核不支持或者设置了 glibc.pthread.rseq=0 时 __rseq_size 为 0
+static bool RseqAvailable() {
+    return __rseq_size != 0;
+}
+
+// 当前线程所在的 CPU, 线程没有注册 rseq 时返回 -1
+static inline int RseqCpu(struct rseq* rs) {
+    return (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+}
+
+#endif
+
+size_t CpuCache::Capacity(size_t obj_size) {
+    return std::max<size_t>(1, std::min(2 * SizeClass::NumMoveObjs(obj_size), CPU_CACHE_CLASS_BYTES / obj_size));
+}
+
+// 一次 Refill / Drain 搬运的对象个数, 不超过容量的一半,
+// 这样 Refill 之后马上释放, 或者 Drain 之后马上分配, 都不会再次落到慢速路径上
+size_t CpuCache::BatchSize(size_t obj_size) {
+    return std::max<size_t>(1, std::min(SizeClass::NumMoveObjs(obj_size), Capacity(obj_size) / 2));
+}
+
+bool CpuCache::Init() {
+#if CPU_CACHE_HAS_RSEQ
+    if (_enabled) return true;
+    if (!RseqAvailable() || RseqCpu(CurrentRseq()) < 0) return false;
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus <= 0) return false;
+
+    // 数组头和对象槽位都从元数据区申请 (这么大的请求会直接映射), 没有用到的槽位不会占用物理内存
+    size_t slots_per_cpu = 0;
+    for (size_t i = 0; i < NLIST; i++) {
+        slots_per_cpu += Capacity(SizeClass::Size(i));
+    }
+    size_t header_bytes = SizeClass::_RoundUp(num_cpus * NLIST * sizeof(FreeArray), PAGE_SHIFT);
+    size_t slot_bytes = SizeClass::_RoundUp(num_cpus * slots_per_cpu * sizeof(void*), PAGE_SHIFT);
+    char* memory = (char*)PageCache::MetadataAlloc(header_bytes + slot_bytes);
+    if (memory == nullptr) return false;
+
+    FreeArray* arrays = (FreeArray*)memory;
+    void** items = (void**)(memory + header_bytes);
+    for (long cpu = 0; cpu < num_cpus; cpu++) {
+        for (size_t i = 0; i < NLIST; i++) {
+            FreeArray& array = arrays[cpu * NLIST + i];
+            array.capacity = Capacity(SizeClass::Size(i));
+            array.items = items;
+            items += array.capacity;
+        }
+    }
+
+    _arrays = arrays;
+    _num_cpus = num_cpus;
+    _enabled = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void* CpuCache::Allocate(size_t bytes) {
+#if CPU_CACHE_HAS_RSEQ
+    size_t index = SizeClass::Index(bytes);
+    struct rseq* rs = CurrentRseq();
+    while (true) {
+        int cpu = RseqCpu(rs);
+        if (cpu < 0 || (size_t)cpu >= _num_cpus) return nullptr;
+
+        void* obj = nullptr;
+        FreeArray* array = &_arrays[cpu * NLIST + index];
+        RseqResult result = RseqPop(rs, cpu, array, &obj);
+        // 被中止, 在新的 CPU 上重试
+        if (result == RSEQ_ABORT) continue;
+
+        // 计数在 rseq 临界区之外, 同一 CPU 上的线程交替执行时可能丢失个别计数
+        StatAdd(array->allocs);
+        if (result == RSEQ_OK) return obj;
+        StatAdd(array->misses);
+        return Refill(index, SizeClass::Size(index));
+    }
+#else
+    return nullptr;
+#endif
+}
+
+bool CpuCache::Deallocate(void* ptr, size_t index) {
+#if CPU_CACHE_HAS_RSEQ
+    struct rseq* rs = CurrentRseq();
+    while (true) {
+        int cpu = RseqCpu(rs);
+        if (cpu < 0 || (size_t)cpu >= _num_cpus) return false;
+
+        RseqResult result = RseqPush(rs, cpu, &_arrays[cpu * NLIST + index], ptr);
+        if (result == RSEQ_OK) return true;
+        if (result == RSEQ_EMPTY_OR_FULL) {
+            Drain(index, SizeClass::Size(index), ptr);
+            return true;
+        }
+    }
+#else
+    return false;
+#endif
+}
+
+void* CpuCache::Refill(size_t index, size_t obj_size) {
+#if CPU_CACHE_HAS_RSEQ
+    size_t n = BatchSize(obj_size);
+
+    void *begin = nullptr, *end = nullptr;
+    size_t node = NumaTopology::GetInstance()->CurrentNode();
+    size_t batch_size = TransferCache::GetInstance(node)->RemoveRange(obj_size, begin, end, n);
+    if (batch_size == 0) {
+        batch_size = CentralCache::GetInstance(node)->FetchRangeObj(begin, end, n, obj_size);
+    }
+    NextObj(end) = nullptr;
+
+    // 第一个对象直接返回, 其余的放进当前 CPU 的数组, 放不下的还回去
+    struct rseq* rs = CurrentRseq();
+    void* cur = NextObj(begin);
+    while (cur != nullptr) {
+        int cpu = RseqCpu(rs);
+        if (cpu < 0 || (size_t)cpu >= _num_cpus) break;
+
+        // 压入后 cur 可能马上被同一 CPU 上的其他线程取走并改写, 先读出下一个
+        void* next = NextObj(cur);
+        RseqResult result = RseqPush(rs, cpu, &_arrays[cpu * NLIST + index], cur);
+        if (result == RSEQ_EMPTY_OR_FULL) break;
+        if (result == RSEQ_OK) cur = next;
+    }
+    if (cur != nullptr) {
+        CentralCache::GetInstance(node)->ReleaseListToSpans(cur, obj_size);
+    }
+    return begin;
+#else
+    return nullptr;
+#endif
+}
+
+void CpuCache::Drain(size_t index, size_t obj_size, void* ptr) {
+#if CPU_CACHE_HAS_RSEQ
+    // 取出当前 CPU 上的一批对象, 和 ptr 一起凑成一批还回去
+    size_t batch_size = BatchSize(obj_size);
+    struct rseq* rs = CurrentRseq();
+
+    void* start = ptr;
+    void* end = ptr;
+    NextObj(ptr) = nullptr;
+    size_t num = 1;
+    while (num < batch_size) {
+        int cpu = RseqCpu(rs);
+        if (cpu < 0 || (size_t)cpu >= _num_cpus) break;
+
+        void* obj = nullptr;
+        RseqResult result = RseqPop(rs, cpu, &_arrays[cpu * NLIST + index], &obj);
+        if (result == RSEQ_EMPTY_OR_FULL) break;
+        if (result == RSEQ_OK) {
+            NextObj(obj) = start;
+            start = obj;
+            num++;
+        }
+    }
+
+    size_t node = PageCache::GetInstance()->MapObjectToSpan(start)->node;
+    if (num == SizeClass::NumMoveObjs(obj_size) && TransferCache::GetInstance(node)->InsertRange(obj_size, start, end, num)) return;
+    CentralCache::GetInstance(node)->ReleaseListToSpans(start, obj_size);
+#endif
+}
+
+size_t CpuCache::TotalCachedBytes() {
+    size_t total = 0;
+    for (size_t cpu = 0; cpu < _num_cpus; cpu++) {
+        for (size_t i = 0; i < NLIST; i++) {
+            total += _arrays[cpu * NLIST + i].count * SizeClass::Size(i);
+        }
+    }
+    return total;
+}
+
+void CpuCache::AddStats(AllocatorStats* stats) {
+    for (size_t cpu = 0; cpu < _num_cpus; cpu++) {
+        for (size_t i = 0; i < NLIST; i++) {
+            FreeArray& array = _arrays[cpu * NLIST + i];
+            uint64_t allocs = StatRead(array.allocs);
+            uint64_t misses = std::min(StatRead(array.misses), allocs);
+            size_t cached = array.count * SizeClass::Size(i);
+            stats->size_classes[i].allocs += allocs;
+            stats->size_classes[i].cached_bytes += cached;
+            stats->front_end.hits += allocs - misses;
+            stats->front_end.misses += misses;
+            stats->cpu_cache_bytes += cached;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef CPU_CACHE_H
+#define CPU_CACHE_H
+#include "my_common.h"
+
+struct AllocatorStats;
+
+// 每个 CPU 上每个尺寸最多缓存的字节数
+const size_t CPU_CACHE_CLASS_BYTES = 32 << 10;
+
+// 可选的每 CPU 缓存, 代替每线程的 ThreadCache
+// 线程数远多于核数时, 缓存的内存只和核数成正比.
+// 快速路径基于 Linux 的 rseq (restartable sequences): 在当前 CPU 的对象数组上 push / pop,
+// 不加锁也没有原子操作, 被抢占或迁移到其他 CPU 时由内核中止并重试.
+// rseq 不可用时 Init 失败, 调用者继续使用 ThreadCache
+class CpuCache{
+public:
+    CpuCache(const CpuCache&) = delete;
+    CpuCache& operator=(const CpuCache&) = delete;
+
+    static CpuCache* GetInstance(){
+        return &_instance;
+    }
+
+    // 检测 rseq 并为每个 CPU 分配对象数组, 成功后 Enabled() 返回 true
+    bool Init();
+
+    bool Enabled(){
+        return _enabled;
+    }
+
+    // 当前线程无法使用 rseq 时返回 nullptr, 调用者改用 ThreadCache
+    void* Allocate(size_t bytes);
+    // 当前线程无法使用 rseq 时返回 false, 调用者改用 ThreadCache
+    // index 为对象所在 Span 记录的尺寸类别
+    bool Deallocate(void* ptr, size_t index);
+
+    // 所有 CPU 上缓存的对象总字节数 (不加锁读取, 只是近似值)
+    size_t TotalCachedBytes();
+    // 把所有 CPU 的分配计数和缓存的对象加到 stats 中
+    void AddStats(AllocatorStats* stats);
+
+    // 只由当前 CPU 上的 rseq 临界区修改
+    struct FreeArray{
+        size_t count = 0;          // 当前缓存的对象个数
+        size_t capacity = 0;
+        void** items = nullptr;
+        uint64_t allocs = 0;       // 分配次数 和 其中数组为空的次数, 见 StatAdd
+        uint64_t misses = 0;
+    };
+
+private:
+    constexpr CpuCache() {}
+
+    static size_t Capacity(size_t obj_size);
+    static size_t BatchSize(size_t obj_size);
+
+    // 数组空了, 从 TransferCache / CentralCache 取一批
+    void* Refill(size_t index, size_t obj_size);
+    // 数组满了, 把 ptr 连同当前 CPU 上的一批对象还回去
+    void Drain(size_t index, size_t obj_size, void* ptr);
+
+    bool _enabled = false;
+    size_t _num_cpus = 0;
+    FreeArray* _arrays = nullptr;   // _num_cpus * NLIST 个数组
+
+    static CpuCache _instance;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "my_heap.h"
+
+#include <atomic>
+
+#include "my_numa.h"
+#include "my_object_pool.h"
+#include "my_page_cache.h"
+#include "my_stats.h"
+
+static ObjectPool<Heap> heap_pool(PageCache::MetadataAlloc);
+// 所有堆持有的 Span 的字节数, 只在取得 / 归还 Span 时修改
+static std::atomic<size_t> total_heap_bytes(0);
+
+std::atomic<size_t> Heap::_num_heaps(0);
+
+Span* Heap::NewSpan(size_t n) {
+    size_t node = NumaTopology::GetInstance()->CurrentNode();
+    Span* span = PageCache::GetInstance(node)->NewSpan(n);
+    span->heap = this;
+    _spans.PushFront(span);
+    _span_bytes += span->page_num << PAGE_SHIFT;
+    total_heap_bytes.fetch_add(span->page_num << PAGE_SHIFT, std::memory_order_relaxed);
+    return span;
+}
+
+void* Heap::Alloc(size_t size) {
+    if (size > MAX_BYTES) {
+        size_t node = NumaTopology::GetInstance()->CurrentNode();
+        Span* span = PageCache::GetInstance(node)->AllocBigPageObj(size);
+        span->heap = this;
+        _spans.PushFront(span);
+        _span_bytes += span->page_num << PAGE_SHIFT;
+        total_heap_bytes.fetch_add(span->page_num << PAGE_SHIFT, std::memory_order_relaxed);
+        return (void*)(span->page_id << PAGE_SHIFT);
+    }
+
+    size_t index = SizeClass::Index(size);
+    size_t obj_size = SizeClass::Size(index);
+    BumpRange& range = _ranges[index];
+    if (range.limit - range.bump < (ptrdiff_t)obj_size) {
+        // 上一个 Span 切完了, 和 CentralCache 一样每次取 NumMovePages 页
+        Span* span = NewSpan(SizeClass::NumMovePages(obj_size));
+        span->obj_size = obj_size;
+        span->size_class = index;
+        range.bump = (char*)(span->page_id << PAGE_SHIFT);
+        range.limit = range.bump + SizeClass::SpanObjs(index) * obj_size;
+    }
+    void* ptr = range.bump;
+    range.bump += obj_size;
+    return ptr;
+}
+
+void Heap::Release() {
+    while (!_spans.Empty()) {
+        Span* span = _spans.PopFront();
+        span->heap = nullptr;
+        if (span->obj_size > MAX_BYTES) {
+            PageCache::GetInstance(span->node)->FreeBigPageObj(span);
+        } else {
+            PageCache::GetInstance(span->node)->ReleaseSpanToPageCache(span);
+        }
+    }
+    total_heap_bytes.fetch_sub(_span_bytes, std::memory_order_relaxed);
+    _span_bytes = 0;
+    for (size_t i = 0; i < NLIST; i++) _ranges[i] = BumpRange();
+}
+
+void Heap::AddStats(AllocatorStats* stats) {
+    stats->heap_bytes += total_heap_bytes.load(std::memory_order_relaxed);
+}
+
+Heap* HeapCreate() {
+    Heap* heap = heap_pool.New();
+    Heap::_num_heaps.fetch_add(1, std::memory_order_relaxed);
+    return heap;
+}
+
+void* HeapAlloc(Heap* heap, size_t size) {
+    return heap->Alloc(size);
+}
+
+void HeapDestroy(Heap* heap) {
+    Heap::_num_heaps.fetch_sub(1, std::memory_order_relaxed);
+    heap->Release();
+    heap_pool.Delete(heap);
+}
@@ -0,0 +1,67 @@
+#ifndef HEAP_H
+#define HEAP_H
+#include "my_common.h"
+#include <atomic>
+
+struct AllocatorStats;
+
+// 显式的堆: 同一个请求中分配的对象在请求结束时一起释放
+// 每个尺寸类别从自己的 Span 中按顺序切出对象, 这些 Span 直接从 PageCache 取, 挂在堆私有的链表上,
+// 不经过 ThreadCache / TransferCache / CentralCache, 全局的缓存不受堆的影响.
+// 销毁时把链表上的 Span 依次还给 PageCache, 不访问其中的对象
+//
+// 一个堆同一时刻只能由一个线程使用, 不同的堆之间互不影响.
+// 堆中的对象不能单独释放: ConcurrentDealloc 遇到它们直接忽略, 内存在 HeapDestroy 时回收
+class Heap{
+public:
+    Heap() {}
+
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    void* Alloc(size_t size);
+
+    // 把所有 Span 还给 PageCache, 之后堆回到刚创建时的状态
+    void Release();
+
+    // 堆当前持有的 Span 的字节数
+    size_t SpanBytes() {
+        return _span_bytes;
+    }
+
+    // 所有堆持有的 Span 的字节数之和
+    static void AddStats(AllocatorStats* stats);
+
+    // 当前存活的堆的个数, 不为 0 时 ConcurrentDealloc(ptr, size) 要查出 Span 才知道 ptr 是否属于堆
+    static size_t NumHeaps(){
+        return _num_heaps.load(std::memory_order_relaxed);
+    }
+
+private:
+    // 从 PageCache 取 n 页挂在链表上
+    Span* NewSpan(size_t n);
+
+private:
+    // 每个尺寸类别正在切分的 Span 中, 还没有分出去的部分 [bump, limit)
+    struct BumpRange {
+        char* bump = nullptr;
+        char* limit = nullptr;
+    };
+    BumpRange _ranges[NLIST];
+    SpanList _spans;
+    size_t _span_bytes = 0;
+
+    static std::atomic<size_t> _num_heaps;
+    friend Heap* HeapCreate();
+    friend void HeapDestroy(Heap* heap);
+};
+
+Heap* HeapCreate();
+
+// 从 heap 中分配 size 字节, 大对象也按页从 PageCache 取, 一起挂在 heap 上
+void* HeapAlloc(Heap* heap, size_t size);
+
+// 一次释放 heap 中的所有对象并销毁 heap
+void HeapDestroy(Heap* heap);
+
+#endif
@@ -0,0 +1,169 @@
+#include "my_heap_profiler.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <unwind.h>
+#include <algorithm>
+
+#include "my_stats.h"
+#include "my_system_alloc.h"
+
+HeapProfiler HeapProfiler::_instance;
+
+// 初始为 0, 每个线程的第一次分配进入 RecordAlloc 抽取采样间隔
+__thread int64_t tls_bytes_until_sample __attribute__((tls_model("initial-exec"))) = 0;
+// 抽取采样间隔的随机数状态, 0 表示还没有初始化
+static __thread uint64_t tls_sample_rng __attribute__((tls_model("initial-exec"))) = 0;
+// 正在记录采样, 期间 (如展开调用栈时) 发生的分配不再采样
+static __thread bool tls_in_profiler __attribute__((tls_model("initial-exec"))) = false;
+
+void HeapProfiler::SetSampleRate(size_t bytes) {
+    __atomic_store_n(&_sample_rate, bytes, __ATOMIC_RELAXED);
+    // 当前线程立即生效
+    tls_bytes_until_sample = NextSampleInterval();
+}
+
+int64_t HeapProfiler::NextSampleInterval() {
+    size_t rate = SampleRate();
+    if (rate == 0) return HEAP_PROFILE_RECHECK_BYTES;
+
+    if (tls_sample_rng == 0) tls_sample_rng = ((uintptr_t)&tls_sample_rng ^ NowNanos()) | 1;
+    // xorshift64*, 取高 53 位得到 (0, 1] 上的均匀分布
+    uint64_t x = tls_sample_rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    tls_sample_rng = x;
+    double u = (double)(((x * 0x2545F4914F6CDD1DULL) >> 11) + 1) / (double)(1ULL << 53);
+
+    // 指数分布的间隔, 均值为 rate
+    double interval = -log(u) * (double)rate;
+    return (int64_t)std::min(interval, 1e18) + 1;
+}
+
+struct UnwindState {
+    void** stack;
+    int depth;
+    int skip;
+};
+
+static _Unwind_Reason_Code UnwindFrame(struct _Unwind_Context* context, void* arg) {
+    UnwindState* state = (UnwindState*)arg;
+    void* ip = (void*)_Unwind_GetIP(context);
+    if (ip == nullptr) return _URC_END_OF_STACK;
+    if (state->skip > 0) {
+        state->skip--;
+        return _URC_NO_REASON;
+    }
+    state->stack[state->depth++] = ip;
+    return state->depth < HEAP_PROFILE_MAX_DEPTH ? _URC_NO_REASON : _URC_END_OF_STACK;
+}
+
+void HeapProfiler::RecordAlloc(void* ptr, size_t size) {
+    tls_bytes_until_sample = NextSampleInterval();
+    if (SampleRate() == 0 || ptr == nullptr || tls_in_profiler) return;
+    tls_in_profiler = true;
+
+    Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+    SampleRecord* record = _pool.New();
+    record->ptr = ptr;
+    record->requested = size;
+    record->allocated = span->obj_size > MAX_BYTES ? span->page_num << PAGE_SHIFT : span->obj_size;
+
+    // 直接使用 libgcc 的展开器, glibc 的 backtrace 第一次调用时会 dlopen, 可能调用 malloc
+    // 跳过 RecordAlloc 和 ConcurrentAlloc 两层
+    UnwindState state = { record->stack, 0, 2 };
+    _Unwind_Backtrace(UnwindFrame, &state);
+    record->depth = state.depth;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        SampleRecord*& head = _table[Hash(ptr)];
+        record->next = head;
+        head = record;
+        __atomic_store_n(&span->sampled, span->sampled + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&_num_samples, _num_samples + 1, __ATOMIC_RELAXED);
+    }
+    tls_in_profiler = false;
+}
+
+void HeapProfiler::RecordFree(void* ptr, Span* span) {
+    SampleRecord* record = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        SampleRecord** link = &_table[Hash(ptr)];
+        while (*link != nullptr && (*link)->ptr != ptr) link = &(*link)->next;
+        // 同一个 Span 中其他对象被采样了, ptr 本身没有
+        if (*link == nullptr) return;
+
+        record = *link;
+        *link = record->next;
+        __atomic_store_n(&span->sampled, span->sampled - 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&_num_samples, _num_samples - 1, __ATOMIC_RELAXED);
+    }
+    _pool.Delete(record);
+}
+
+static bool SameStack(const SampleRecord& a, const SampleRecord& b) {
+    return a.depth == b.depth && memcmp(a.stack, b.stack, a.depth * sizeof(void*)) == 0;
+}
+
+void HeapProfiler::DumpProfile(int fd) {
+    // 在锁内把记录复制到临时映射的数组中, 锁外排序汇总
+    SampleRecord* records = nullptr;
+    size_t count = 0;
+    size_t bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_num_samples > 0) {
+            bytes = SizeClass::_RoundUp(_num_samples * sizeof(SampleRecord), PAGE_SHIFT);
+            records = (SampleRecord*)SystemAlloc(bytes);
+        }
+        for (size_t i = 0; i < HEAP_PROFILE_TABLE_SIZE && records != nullptr; i++) {
+            for (SampleRecord* record = _table[i]; record != nullptr; record = record->next) {
+                records[count++] = *record;
+            }
+        }
+    }
+
+    std::sort(records, records + count, [](const SampleRecord& a, const SampleRecord& b) {
+        if (a.depth != b.depth) return a.depth < b.depth;
+        return memcmp(a.stack, b.stack, a.depth * sizeof(void*)) < 0;
+    });
+
+    // heap_v2 格式中的数值是采样到的对象, pprof 按采样率还原实际的大小
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < count; i++) total_bytes += records[i].requested;
+    FdPrint(fd, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n", count, total_bytes, count, total_bytes,
+            SampleRate());
+    for (size_t i = 0; i < count;) {
+        size_t objs = 0, obj_bytes = 0;
+        size_t j = i;
+        for (; j < count && SameStack(records[i], records[j]); j++) {
+            objs++;
+            obj_bytes += records[j].requested;
+        }
+        FdPrint(fd, "%6zu: %8zu [%6zu: %8zu] @", objs, obj_bytes, objs, obj_bytes);
+        for (int k = 0; k < records[i].depth; k++) FdPrint(fd, " %p", records[i].stack[k]);
+        FdPrint(fd, "\n");
+        i = j;
+    }
+    if (records != nullptr) SystemFree(records, bytes);
+
+    // 地址到共享库的映射, pprof 用于符号化
+    FdPrint(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps < 0) return;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(maps, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < len;) {
+            ssize_t n = write(fd, buf + done, len - done);
+            if (n <= 0) break;
+            done += n;
+        }
+    }
+    close(maps);
+}
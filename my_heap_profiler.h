@@ -0,0 +1,101 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+#include "my_common.h"
+#include "my_object_pool.h"
+#include "my_page_cache.h"
+
+// 记录的调用栈的最大深度
+const int HEAP_PROFILE_MAX_DEPTH = 32;
+// 以指针为键的哈希表的桶数
+const size_t HEAP_PROFILE_TABLE_BITS = 14;
+const size_t HEAP_PROFILE_TABLE_SIZE = (size_t)1 << HEAP_PROFILE_TABLE_BITS;
+// 没有开启采样时, 每个线程每分配这么多字节重新检查一次采样率
+const int64_t HEAP_PROFILE_RECHECK_BYTES = 64 << 20;
+
+// 距离下一次采样还要分配的字节数, 每个线程独立倒数
+extern __thread int64_t tls_bytes_until_sample __attribute__((tls_model("initial-exec")));
+
+// 一个被采样的存活对象
+struct SampleRecord{
+    void* ptr = nullptr;
+    size_t requested = 0;      // 申请的字节数
+    size_t allocated = 0;      // 实际占用的字节数
+    int depth = 0;
+    void* stack[HEAP_PROFILE_MAX_DEPTH];
+    SampleRecord* next = nullptr;
+};
+
+// 采样堆分析器
+// 每个线程按几何分布随机抽取下一次采样的位置, 平均每分配 SampleRate 字节采样一次,
+// 采样到的对象记录调用栈, 释放时删除记录. 导出存活对象按调用栈汇总的 pprof 文本格式 (heap_v2)
+//
+// 没有被采样的分配只做一次减法和分支. 释放时:
+//   不带大小的释放已经查到了 Span, 只多检查 Span 上被采样的对象个数;
+//   带大小的释放不查基数树, 存在被采样的对象时改走不带大小的路径
+class HeapProfiler{
+public:
+    HeapProfiler(const HeapProfiler&) = delete;
+    HeapProfiler& operator=(const HeapProfiler&) = delete;
+
+    static HeapProfiler* GetInstance(){
+        return &_instance;
+    }
+
+    // 平均每分配 bytes 字节采样一次, 0 表示关闭 (默认). 其他线程最迟在
+    // 下一次采样或者再分配 HEAP_PROFILE_RECHECK_BYTES 字节后按新的采样率倒数
+    void SetSampleRate(size_t bytes);
+    size_t SampleRate(){
+        return __atomic_load_n(&_sample_rate, __ATOMIC_RELAXED);
+    }
+
+    // 在 ConcurrentAlloc 中调用, 倒数到 0 时返回 true, 调用者再调用 RecordAlloc
+    static bool ShouldSample(size_t size){
+        return (tls_bytes_until_sample -= (int64_t)size) < 0;
+    }
+    // 批量分配 n 个 size 字节的对象, 整批没有倒数到 0 时只做一次减法返回 false;
+    // 否则撤销这次减法返回 true, 调用者再对每个对象调用 ShouldSample
+    static bool ShouldSampleBatch(size_t size, size_t n){
+        if(!ShouldSample(size * n))
+            return false;
+        tls_bytes_until_sample += (int64_t)(size * n);
+        return true;
+    }
+    // 重新抽取下一次采样的位置, 采样率不为 0 时记录 ptr 和调用栈
+    void RecordAlloc(void* ptr, size_t size);
+
+    // 释放 span 中的对象之前调用, ptr 被采样过时删除记录
+    static bool MaybeSampled(Span* span){
+        return __atomic_load_n(&span -> sampled, __ATOMIC_RELAXED) != 0;
+    }
+    void RecordFree(void* ptr, Span* span);
+
+    // 当前存活的被采样对象个数
+    size_t NumSamples(){
+        return __atomic_load_n(&_num_samples, __ATOMIC_RELAXED);
+    }
+
+    // 把存活的被采样对象按调用栈汇总, 以 pprof 的 heap_v2 文本格式写到 fd,
+    // 末尾附上 /proc/self/maps 用于符号化. 不经过 malloc
+    void DumpProfile(int fd);
+
+private:
+    constexpr HeapProfiler() : _pool(PageCache::MetadataAlloc) {}
+
+    static size_t Hash(void* ptr){
+        return ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15 >> (64 - HEAP_PROFILE_TABLE_BITS);
+    }
+    // 几何分布的采样间隔
+    int64_t NextSampleInterval();
+
+    size_t _sample_rate = 0;
+    size_t _num_samples = 0;
+
+    // 以下由 _mutex 保护
+    std::mutex _mutex;
+    SampleRecord* _table[HEAP_PROFILE_TABLE_SIZE] = {};
+    ObjectPool<SampleRecord> _pool;
+
+    static HeapProfiler _instance;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include "my_huge_page_filler.h"
+#include "my_system_alloc.h"
+
+Page_ID HugePageFiller::Alloc(size_t n){
+    assert(n > 0 && n <= HUGEPAGE_PAGES);
+
+    // 从最满的开始找, 已用页数超过 HUGEPAGE_PAGES - n 的一定放不下
+    // 全空的 hugepage 在第 0 个桶, 已经归还的最后才用
+    HugePage* hugepage = nullptr;
+    for(size_t used = HUGEPAGE_PAGES - n + 1; used-- > 0 && hugepage == nullptr;){
+        for(HugePage* cur = _lists[used]; cur != nullptr; cur = cur -> next){
+            if(cur -> longest_free >= n){
+                hugepage = cur;
+                break;
+            }
+        }
+    }
+    if(hugepage == nullptr)
+        hugepage = _released;
+    if(hugepage == nullptr)
+        return 0;
+
+    Unlink(hugepage);
+    if(hugepage -> released){
+        // 重新访问时内核会重新分配物理页
+        hugepage -> released = false;
+        _returned_pages -= HUGEPAGE_PAGES;
+        _free_pages += HUGEPAGE_PAGES;
+    }
+    size_t start = FindFree(hugepage, n);
+    SetBits(hugepage, start, n, true);
+    hugepage -> used_pages += n;
+    hugepage -> longest_free = LongestFree(hugepage);
+    _free_pages -= n;
+    Link(hugepage);
+    return hugepage -> first_page + start;
+}
+
+bool HugePageFiller::AddHugePage(Page_ID first_page){
+    assert(first_page % HUGEPAGE_PAGES == 0);
+    Page_ID index = first_page / HUGEPAGE_PAGES;
+    if(!_map.Ensure(index, 1))
+        return false;
+
+    HugePage* hugepage = _pool.New();
+    hugepage -> first_page = first_page;
+    hugepage -> idle_since = NowNanos();
+    _map.Set(index, hugepage);
+    _num_hugepages++;
+    _free_pages += HUGEPAGE_PAGES;
+    Link(hugepage);
+    return true;
+}
+
+HugePage* HugePageFiller::Free(Page_ID page, size_t n){
+    HugePage* hugepage = _map.Get(page / HUGEPAGE_PAGES);
+    assert(hugepage != nullptr && !hugepage -> released);
+    assert(page + n <= hugepage -> first_page + HUGEPAGE_PAGES);
+
+    Unlink(hugepage);
+    SetBits(hugepage, page - hugepage -> first_page, n, false);
+    hugepage -> used_pages -= n;
+    hugepage -> longest_free = LongestFree(hugepage);
+    if(hugepage -> used_pages == 0)
+        hugepage -> idle_since = NowNanos();
+    _free_pages += n;
+    Link(hugepage);
+    return hugepage;
+}
+
+void HugePageFiller::Release(HugePage* hugepage){
+    BeginRelease(hugepage);
+    SystemRelease((void*)(hugepage -> first_page << PAGE_SHIFT), (size_t)1 << HUGEPAGE_SHIFT);
+    FinishRelease(hugepage);
+}
+
+void HugePageFiller::BeginRelease(HugePage* hugepage){
+    assert(hugepage -> used_pages == 0 && !hugepage -> released);
+    // 从链表上摘下, 归还期间既不会被分配, 也不会出现在占用报告中
+    Unlink(hugepage);
+    _free_pages -= HUGEPAGE_PAGES;
+}
+
+void HugePageFiller::FinishRelease(HugePage* hugepage){
+    hugepage -> released = true;
+    _returned_pages += HUGEPAGE_PAGES;
+    Link(hugepage);
+}
+
+HugePage* HugePageFiller::FindIdleEmpty(uint64_t idle_before){
+    for(HugePage* cur = _lists[0]; cur != nullptr; cur = cur -> next){
+        if(cur -> idle_since <= idle_before)
+            return cur;
+    }
+    return nullptr;
+}
+
+HugePage* HugePageFiller::OldestEmpty(){
+    // 新变空的插在头部, 最后一个闲置最久
+    HugePage* oldest = _lists[0];
+    while(oldest != nullptr && oldest -> next != nullptr)
+        oldest = oldest -> next;
+    return oldest;
+}
+
+size_t HugePageFiller::Occupancy(HugePageInfo* out, size_t max){
+    size_t count = 0;
+    auto report = [&](HugePage* list){
+        for(HugePage* cur = list; cur != nullptr; cur = cur -> next, count++){
+            if(count < max)
+                out[count] = { (void*)(cur -> first_page << PAGE_SHIFT), cur -> used_pages, cur -> longest_free, cur -> released };
+        }
+    };
+    // 从最满的开始
+    for(size_t used = HUGEPAGE_PAGES + 1; used-- > 0;)
+        report(_lists[used]);
+    report(_released);
+    return count;
+}
+
+void HugePageFiller::Link(HugePage* hugepage){
+    HugePage*& head = ListOf(hugepage);
+    if(&head == &_lists[0])
+        _empty_hugepages++;
+    hugepage -> prev = nullptr;
+    hugepage -> next = head;
+    if(head != nullptr)
+        head -> prev = hugepage;
+    head = hugepage;
+}
+
+void HugePageFiller::Unlink(HugePage* hugepage){
+    if(&ListOf(hugepage) == &_lists[0])
+        _empty_hugepages--;
+    if(hugepage -> prev != nullptr)
+        hugepage -> prev -> next = hugepage -> next;
+    else
+        ListOf(hugepage) = hugepage -> next;
+    if(hugepage -> next != nullptr)
+        hugepage -> next -> prev = hugepage -> prev;
+    hugepage -> prev = hugepage -> next = nullptr;
+}
+
+void HugePageFiller::SetBits(HugePage* hugepage, size_t start, size_t n, bool used){
+    for(size_t i = start; i < start + n; i++){
+        uint64_t bit = (uint64_t)1 << (i % 64);
+        assert(((hugepage -> used[i / 64] & bit) != 0) != used);
+        if(used)
+            hugepage -> used[i / 64] |= bit;
+        else
+            hugepage -> used[i / 64] &= ~bit;
+    }
+}
+
+size_t HugePageFiller::FindFree(HugePage* hugepage, size_t n){
+    size_t run = 0;
+    for(size_t i = 0; i < HUGEPAGE_PAGES; i++){
+        // 整个字都被占用时直接跳过
+        if(i % 64 == 0 && hugepage -> used[i / 64] == ~(uint64_t)0){
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if(hugepage -> used[i / 64] & ((uint64_t)1 << (i % 64))){
+            run = 0;
+        }else if(++run == n){
+            return i + 1 - n;
+        }
+    }
+    assert(false && "FindFree: longest_free 与位图不一致");
+    return 0;
+}
+
+size_t HugePageFiller::LongestFree(HugePage* hugepage){
+    size_t longest = 0, run = 0;
+    for(size_t i = 0; i < HUGEPAGE_PAGES; i++){
+        if(i % 64 == 0 && hugepage -> used[i / 64] == ~(uint64_t)0){
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if(hugepage -> used[i / 64] & ((uint64_t)1 << (i % 64))){
+            run = 0;
+        }else if(++run > longest){
+            longest = run;
+        }
+    }
+    return longest;
+}
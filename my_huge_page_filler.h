@@ -0,0 +1,112 @@
+#ifndef HUGE_PAGE_FILLER_H
+#define HUGE_PAGE_FILLER_H
+#include "my_common.h"
+#include "my_page_map.h"
+#include "my_object_pool.h"
+
+// 透明大页 (THP) 的大小, 2M = 512 个 4K 页
+const size_t HUGEPAGE_SHIFT = 21;
+const size_t HUGEPAGE_PAGES = (size_t)1 << (HUGEPAGE_SHIFT - PAGE_SHIFT);
+
+// 一个 2M 对齐的 hugepage 的占用情况
+struct HugePage{
+    Page_ID first_page = 0;
+    uint64_t used[HUGEPAGE_PAGES / 64] = {};   // 每页一位, 已经分配出去的页
+    size_t used_pages = 0;
+    size_t longest_free = HUGEPAGE_PAGES;      // 最长的连续空闲页数
+    bool released = false;                     // 物理页是否已经整体还给系统
+    uint64_t idle_since = 0;                   // 变成全空的时间
+
+    HugePage* prev = nullptr;
+    HugePage* next = nullptr;
+};
+
+// 对外报告的单个 hugepage 的占用
+struct HugePageInfo{
+    void* address;
+    size_t used_pages;
+    size_t longest_free_pages;
+    bool released;
+};
+
+// hugepage 填充器: 把小 Span 紧凑地放进部分使用的 hugepage 中, 减少页表项和 TLB 缺失
+// 新的 Span 总是放进放得下的 最满的 hugepage, 使其余的 hugepage 尽快变空
+// 只有整个 hugepage 都空闲时才把它还给系统, 部分使用的 hugepage 不会被 madvise 拆成小页
+//
+// 只管理页的占用, 不创建 Span; 所有函数由 PageCache 在持有 _mutex 时调用
+class HugePageFiller{
+public:
+    constexpr explicit HugePageFiller(void* (*allocator)(size_t))
+        : _map(allocator), _pool(allocator) {}
+
+    HugePageFiller(const HugePageFiller&) = delete;
+    HugePageFiller& operator=(const HugePageFiller&) = delete;
+
+    // 从最满的放得下 n 页的 hugepage 中分配连续的 n 页, 返回起始页号. 都放不下时返回 0
+    Page_ID Alloc(size_t n);
+
+    // 加入一个新映射的 2M 对齐的 hugepage
+    bool AddHugePage(Page_ID first_page);
+
+    // 归还 [page, page + n), 返回所在的 hugepage
+    HugePage* Free(Page_ID page, size_t n);
+
+    // page 是否由填充器管理
+    bool Contains(Page_ID page){
+        return _map.Get(page >> (HUGEPAGE_SHIFT - PAGE_SHIFT)) != nullptr;
+    }
+
+    // 把全空的 hugepage 还给系统
+    void Release(HugePage* hugepage);
+    // 分成两步, madvise 可以在锁外执行: BeginRelease 之后 hugepage 不会再被分配
+    void BeginRelease(HugePage* hugepage);
+    void FinishRelease(HugePage* hugepage);
+    // 找一个闲置时间早于 idle_before 的全空 hugepage
+    HugePage* FindIdleEmpty(uint64_t idle_before);
+    // 闲置最久的全空且仍占用物理内存的 hugepage, 没有时返回 nullptr
+    HugePage* OldestEmpty();
+
+    size_t EmptyHugePages(){    // 全空且仍占用物理内存的 hugepage 个数
+        return _empty_hugepages;
+    }
+
+    size_t FreePages(){         // 空闲且仍占用物理内存的页数
+        return _free_pages;
+    }
+    size_t ReturnedPages(){     // 已经还给系统的页数
+        return _returned_pages;
+    }
+    size_t SystemBytes(){
+        return _num_hugepages << HUGEPAGE_SHIFT;
+    }
+
+    // 把每个 hugepage 的占用写进 out (最多 max 个), 返回 hugepage 的总数
+    size_t Occupancy(HugePageInfo* out, size_t max);
+
+private:
+    // 按已用页数分桶, 全空且已经归还的单独放在 _released 中
+    void Link(HugePage* hugepage);
+    void Unlink(HugePage* hugepage);
+    HugePage*& ListOf(HugePage* hugepage){
+        return hugepage -> released ? _released : _lists[hugepage -> used_pages];
+    }
+
+    static void SetBits(HugePage* hugepage, size_t start, size_t n, bool used);
+    static size_t FindFree(HugePage* hugepage, size_t n);   // 最低的连续 n 个空闲页
+    static size_t LongestFree(HugePage* hugepage);
+
+private:
+    // hugepage 序号 -> HugePage
+    PageMap3<48 - HUGEPAGE_SHIFT, HugePage> _map;
+    ObjectPool<HugePage> _pool;
+
+    HugePage* _lists[HUGEPAGE_PAGES + 1] = {};
+    HugePage* _released = nullptr;
+
+    size_t _num_hugepages = 0;
+    size_t _empty_hugepages = 0;    // _lists[0] 的长度
+    size_t _free_pages = 0;
+    size_t _returned_pages = 0;
+};
+
+#endif
@@ -0,0 +1,320 @@
+// 用内存池替换 malloc / free / operator new / operator delete
+// 编译成 libconcurrentalloc.so, 通过 LD_PRELOAD 加载即可替换未修改的程序的分配器:
+//   LD_PRELOAD=./libconcurrentalloc.so ./your_program
+// 设置环境变量 CONCURRENT_ALLOC_PER_CPU=1 时使用每 CPU 缓存, CONCURRENT_ALLOC_HUGEPAGE=1 时开启 hugepage 填充器,
+// CONCURRENT_ALLOC_NUMA=1 时按 NUMA 节点分区
+//
+// 自举: 内存池内部的元数据 (Span, ThreadCache, 基数树节点) 都直接向系统申请, 单例在编译期常量初始化,
+// 锁是 pthread 互斥量, TLS 使用 initial-exec 模型, 所以第一次 malloc 不会递归进入自身
+// 库用 -fvisibility=hidden 编译, 只导出本文件中的符号, 内部函数不会被主程序的同名符号替换
+#include "my_concurrent_alloc.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <new>
+
+#define CONCURRENT_ALLOC_EXPORT __attribute__((visibility("default")))
+
+// malloc 返回的内存必须满足 alignof(max_align_t) = 16 字节对齐
+const size_t MALLOC_ALIGNMENT = 16;
+
+// 地址空间只有 48 位, 更大的请求一定失败, 提前拒绝, 避免按页取整时溢出
+const size_t MALLOC_MAX_BYTES = (size_t)1 << 47;
+
+// 不超过 8 字节的请求放进 8 字节的类别, 其余的向上取整到 16 的倍数
+static inline size_t MallocSize(size_t size) {
+    return size <= 8 ? size : (size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+}
+
+// 取整之后的请求落到的类别, 大小都必须是 16 的倍数
+constexpr bool MallocClassesAligned() {
+    for (size_t size = 2 * MALLOC_ALIGNMENT; size <= MAX_BYTES; size += MALLOC_ALIGNMENT) {
+        size_t index = size <= SIZE_CLASS_SMALL_MAX
+                       ? SIZE_CLASS_TABLES.small_index[(size + 7) >> SIZE_CLASS_SMALL_SHIFT]
+                       : SIZE_CLASS_TABLES.large_index[(size + 127) >> SIZE_CLASS_LARGE_SHIFT];
+        if (SIZE_CLASS_TABLES.size[index] % MALLOC_ALIGNMENT != 0) return false;
+    }
+    return true;
+}
+static_assert(MallocClassesAligned(), "SIZE_CLASS_TABLE: 16 字节以上的类别必须是 16 的倍数");
+
+static void* Malloc(size_t size) {
+    if (size >= MALLOC_MAX_BYTES) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        return ConcurrentAlloc(MallocSize(size));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+static void* MallocAligned(size_t align, size_t size) {
+    if (align <= MALLOC_ALIGNMENT) return Malloc(size);
+    if (size >= MALLOC_MAX_BYTES || align >= MALLOC_MAX_BYTES) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        return ConcurrentAllocAligned(size, align);
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+static inline bool IsPowerOfTwo(size_t align) {
+    return align != 0 && (align & (align - 1)) == 0;
+}
+
+// 按标准的要求: 分配失败时调用 new_handler, 没有 new_handler 时抛出 bad_alloc
+static void* OperatorNew(size_t size, size_t align) {
+    while (true) {
+        void* ptr = MallocAligned(align, size);
+        if (ptr != nullptr) return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
+}
+
+static void* OperatorNewNothrow(size_t size, size_t align) noexcept {
+    try {
+        return OperatorNew(size, align);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+// 不属于内存池的指针 (如以 dlopen 加载本库之前分配的内存) 交给下一个分配器 (通常是 glibc)
+// 第一次调用时才用 dlsym 查找, 此时内存池已经可以使用, dlsym 内部分配内存不会递归到这里
+static bool IsForeign(void* ptr) {
+    return PageCache::GetInstance()->FindSpan(ptr) == nullptr;
+}
+
+static void NextFree(void* ptr) {
+    static void (*next_free)(void*) = (void (*)(void*))dlsym(RTLD_NEXT, "free");
+    if (next_free != nullptr) next_free(ptr);
+}
+
+static void* NextRealloc(void* ptr, size_t size) {
+    static void* (*next_realloc)(void*, size_t) = (void* (*)(void*, size_t))dlsym(RTLD_NEXT, "realloc");
+    if (next_realloc == nullptr) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return next_realloc(ptr, size);
+}
+
+static size_t NextUsableSize(void* ptr) {
+    static size_t (*next_usable_size)(void*) = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+    return next_usable_size != nullptr ? next_usable_size(ptr) : 0;
+}
+
+// 只有 operator new (非对齐版本) 分配的对象才能按大小释放: 对齐分配可能换到更大的类别
+// 和 free 一样先确认指针属于内存池, 多一次基数树查找
+static inline void SizedDelete(void* ptr, size_t size) {
+    if (ptr == nullptr) return;
+    if (__builtin_expect(IsForeign(ptr), 0)) {
+        NextFree(ptr);
+        return;
+    }
+    ConcurrentDealloc(ptr, MallocSize(size));
+}
+
+// 模块加载时按环境变量完成初始化, 早于主程序的全局构造函数
+static bool EnvEnabled(const char* name) {
+    const char* value = getenv(name);
+    return value != nullptr && strcmp(value, "0") != 0;
+}
+
+__attribute__((constructor)) static void InitMallocOverride() {
+    AllocatorOptions options;
+    options.per_cpu_cache = EnvEnabled("CONCURRENT_ALLOC_PER_CPU");
+    options.hugepage_filler = EnvEnabled("CONCURRENT_ALLOC_HUGEPAGE");
+    options.numa = EnvEnabled("CONCURRENT_ALLOC_NUMA");
+    InitAllocator(options);
+
+    // 堆采样的平均间隔 (字节), 不设置时不采样
+    const char* sample_rate = getenv("CONCURRENT_ALLOC_SAMPLE_RATE");
+    if (sample_rate != nullptr) HeapProfiler::GetInstance()->SetSampleRate(strtoull(sample_rate, nullptr, 10));
+}
+
+extern "C" {
+
+CONCURRENT_ALLOC_EXPORT void* malloc(size_t size) {
+    return Malloc(size);
+}
+
+CONCURRENT_ALLOC_EXPORT void free(void* ptr) {
+    if (ptr == nullptr) return;
+    if (__builtin_expect(IsForeign(ptr), 0)) {
+        NextFree(ptr);
+        return;
+    }
+    ConcurrentDealloc(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void cfree(void* ptr) {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void* calloc(size_t num, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(num, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void* ptr = Malloc(bytes);
+    // 缓存中的对象可能被用过, 不能假设是零页
+    if (ptr != nullptr) memset(ptr, 0, bytes);
+    return ptr;
+}
+
+CONCURRENT_ALLOC_EXPORT void* realloc(void* ptr, size_t size) {
+    if (ptr == nullptr) return Malloc(size);
+    // 不属于内存池的指针不知道原来的大小, 由分配它的分配器调整, 之后释放时同样交还给它
+    if (__builtin_expect(IsForeign(ptr), 0)) return NextRealloc(ptr, size);
+    if (size == 0) {
+        free(ptr);
+        return nullptr;
+    }
+
+    if (size >= MALLOC_MAX_BYTES) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        void* new_ptr = ConcurrentRealloc(ptr, MallocSize(size));
+        if (new_ptr == nullptr) errno = ENOMEM;
+        return new_ptr;
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+CONCURRENT_ALLOC_EXPORT int posix_memalign(void** result, size_t align, size_t size) {
+    if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0) return EINVAL;
+    void* ptr = MallocAligned(align, size);
+    if (ptr == nullptr) return ENOMEM;
+    *result = ptr;
+    return 0;
+}
+
+CONCURRENT_ALLOC_EXPORT void* aligned_alloc(size_t align, size_t size) {
+    if (!IsPowerOfTwo(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return MallocAligned(align, size);
+}
+
+CONCURRENT_ALLOC_EXPORT void* memalign(size_t align, size_t size) {
+    return aligned_alloc(align, size);
+}
+
+CONCURRENT_ALLOC_EXPORT void* valloc(size_t size) {
+    return MallocAligned((size_t)1 << PAGE_SHIFT, size);
+}
+
+CONCURRENT_ALLOC_EXPORT void* pvalloc(size_t size) {
+    size_t page_size = (size_t)1 << PAGE_SHIFT;
+    return MallocAligned(page_size, size == 0 ? page_size : SizeClass::_RoundUp(size, PAGE_SHIFT));
+}
+
+CONCURRENT_ALLOC_EXPORT size_t malloc_usable_size(void* ptr) {
+    if (ptr == nullptr) return 0;
+    if (__builtin_expect(IsForeign(ptr), 0)) return NextUsableSize(ptr);
+    return ConcurrentUsableSize(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void malloc_stats(void) {
+    DumpStats(2);
+}
+
+}  // extern "C"
+
+CONCURRENT_ALLOC_EXPORT void* operator new(size_t size) {
+    return OperatorNew(size, MALLOC_ALIGNMENT);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new[](size_t size) {
+    return OperatorNew(size, MALLOC_ALIGNMENT);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return OperatorNewNothrow(size, MALLOC_ALIGNMENT);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return OperatorNewNothrow(size, MALLOC_ALIGNMENT);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new(size_t size, std::align_val_t align) {
+    return OperatorNew(size, (size_t)align);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new[](size_t size, std::align_val_t align) {
+    return OperatorNew(size, (size_t)align);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return OperatorNewNothrow(size, (size_t)align);
+}
+
+CONCURRENT_ALLOC_EXPORT void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return OperatorNewNothrow(size, (size_t)align);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete(void* ptr, size_t size) noexcept {
+    SizedDelete(ptr, size);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete[](void* ptr, size_t size) noexcept {
+    SizedDelete(ptr, size);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+CONCURRENT_ALLOC_EXPORT void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
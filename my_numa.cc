@@ -0,0 +1,92 @@
+#include "my_numa.h"
+
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+NumaTopology NumaTopology::_instance;
+
+// 固定的节点, -1 表示按所在的 CPU 判断
+static __thread int tls_numa_node __attribute__((tls_model("initial-exec"))) = -1;
+
+// 读取整个文件, 不使用 stdio, 作为 malloc 使用时也可以在初始化阶段调用
+static bool ReadFile(const char* path, char* buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0) return false;
+    buf[len] = '\0';
+    return true;
+}
+
+// 解析 "0-3,8,10-11" 形式的列表, 对其中每个数调用 fn
+template <class F>
+static bool ParseList(const char* s, F fn) {
+    while (*s != '\0' && *s != '\n') {
+        if (*s < '0' || *s > '9') return false;
+        size_t first = 0, last;
+        while (*s >= '0' && *s <= '9') first = first * 10 + (*s++ - '0');
+        last = first;
+        if (*s == '-') {
+            s++;
+            last = 0;
+            while (*s >= '0' && *s <= '9') last = last * 10 + (*s++ - '0');
+        }
+        for (size_t i = first; i <= last; i++) {
+            if (!fn(i)) return false;
+        }
+        if (*s == ',') s++;
+    }
+    return true;
+}
+
+bool NumaTopology::Init(const char* root) {
+    if (Enabled()) return false;
+
+    char path[256], buf[4096];
+    snprintf(path, sizeof(path), "%s/online", root);
+    if (!ReadFile(path, buf, sizeof(buf))) return false;
+
+    size_t num_nodes = 0;
+    uint8_t cpu_to_node[MAX_NUMA_CPUS] = {};
+    bool ok = ParseList(buf, [&](size_t node) {
+        if (node >= MAX_NUMA_NODES) return false;
+        char list[4096];
+        snprintf(path, sizeof(path), "%s/node%zu/cpulist", root, node);
+        // 没有 CPU 的节点 (如只有内存的节点) cpulist 为空
+        if (ReadFile(path, list, sizeof(list))) {
+            ParseList(list, [&](size_t cpu) {
+                if (cpu < MAX_NUMA_CPUS) cpu_to_node[cpu] = (uint8_t)node;
+                return true;
+            });
+        }
+        if (node + 1 > num_nodes) num_nodes = node + 1;
+        return true;
+    });
+    if (!ok || num_nodes == 0) return false;
+
+    for (size_t i = 0; i < MAX_NUMA_CPUS; i++) _cpu_to_node[i] = cpu_to_node[i];
+    _num_nodes = num_nodes;
+    return true;
+}
+
+size_t NumaTopology::CurrentNode() {
+    if (!Enabled()) return 0;
+    if (tls_numa_node >= 0) return (size_t)tls_numa_node % _num_nodes;
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (size_t)cpu >= MAX_NUMA_CPUS) return 0;
+    return _cpu_to_node[cpu];
+}
+
+void NumaTopology::SetThreadNode(int node) {
+    tls_numa_node = node;
+}
+
+bool NumaTopology::BindToNode(void* ptr, size_t bytes, size_t node) {
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == 0;
+}
@@ -0,0 +1,52 @@
+#ifndef NUMA_H
+#define NUMA_H
+#include "my_common.h"
+
+// PageCache / CentralCache / TransferCache 按 NUMA 节点分区的最大个数
+const size_t MAX_NUMA_NODES = 8;
+const size_t MAX_NUMA_CPUS = 1024;
+
+// NUMA 拓扑: 节点个数 和 CPU -> 节点 的映射, 从 /sys/devices/system/node 读取
+// 开启后每个节点有独立的页堆和中心缓存, 线程总是从当前所在节点的分区取内存,
+// 释放的对象和 Span 回到它所属的节点. 没有开启时只有节点 0
+class NumaTopology{
+public:
+    NumaTopology(const NumaTopology&) = delete;
+    NumaTopology& operator=(const NumaTopology&) = delete;
+
+    static NumaTopology* GetInstance(){
+        return &_instance;
+    }
+
+    // 读取 root 下的 online 和 node<N>/cpulist 开启 NUMA 模式, 只能开启一次, 且应在多线程运行之前
+    // root 可以指向伪造的目录树, 在单节点的机器上测试. 读取失败或者超过 MAX_NUMA_NODES 时返回 false
+    bool Init(const char* root = "/sys/devices/system/node");
+
+    bool Enabled(){
+        return _num_nodes > 1;
+    }
+
+    size_t NumNodes(){
+        return _num_nodes;
+    }
+
+    // 当前线程所在的节点
+    size_t CurrentNode();
+
+    // 把当前线程固定到 node (不改变 CPU 亲和性, 只决定从哪个分区分配), node < 0 时恢复按 CPU 判断
+    static void SetThreadNode(int node);
+
+    // 建议内核在 node 上分配这段内存的物理页 (mbind MPOL_PREFERRED)
+    // 节点不存在 (伪造的拓扑) 时失败, 退化为首次访问时就近分配
+    bool BindToNode(void* ptr, size_t bytes, size_t node);
+
+private:
+    constexpr NumaTopology() {}
+
+    size_t _num_nodes = 1;
+    uint8_t _cpu_to_node[MAX_NUMA_CPUS] = {};
+
+    static NumaTopology _instance;
+};
+
+#endif
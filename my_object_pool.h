@@ -0,0 +1,85 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+#include "my_common.h"
+#include <new>
+
+// 定长对象池, 给分配器内部的元数据对象 (Span, ThreadCache) 使用
+// 内存按块向 PageCache 的元数据区申请, 回收的对象挂在内嵌的自由链表上, 从不归还
+// 不经过 malloc / new, 因此不会递归进入分配器本身
+template <class T>
+class ObjectPool{
+private:
+    static constexpr size_t Align(){
+        return alignof(T) < alignof(void*) ? alignof(void*) : alignof(T);
+    }
+
+    // 每个对象至少要能放下一个指针, 并满足对齐要求
+    static constexpr size_t ObjSize(){
+        return ((sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T)) + Align() - 1) & ~(Align() - 1);
+    }
+
+    static constexpr size_t ChunkSize(){
+        // 至少 64K, 且至少能放下 16 个对象
+        return ((ObjSize() * 16 > (64 << 10) ? ObjSize() * 16 : (64 << 10)) + (1 << PAGE_SHIFT) - 1)
+               & ~(((size_t)1 << PAGE_SHIFT) - 1);
+    }
+
+    char* _memory = nullptr;      // 当前块中尚未切分的内存
+    size_t _remain = 0;           // 当前块剩余的字节数
+    void* _free_list = nullptr;   // 回收的对象
+    size_t _in_use = 0;           // 正在使用的对象个数
+    size_t _reserved_bytes = 0;   // 已经申请的块的总字节数
+    std::mutex _mutex;
+    // 分配清零的内存块, 不能调用 malloc
+    void* (*_allocator)(size_t);
+
+public:
+    constexpr explicit ObjectPool(void* (*allocator)(size_t)) : _allocator(allocator) {}
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    T* New(){
+        void* obj = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(_free_list != nullptr){
+                obj = _free_list;
+                _free_list = NextObj(obj);
+            }else {
+                if(_remain < ObjSize()){
+                    _memory = (char*)_allocator(ChunkSize());
+                    if(_memory == nullptr)
+                        throw std::bad_alloc();
+                    _remain = ChunkSize();
+                    _reserved_bytes += ChunkSize();
+                }
+                obj = _memory;
+                _memory += ObjSize();
+                _remain -= ObjSize();
+            }
+            _in_use++;
+        }
+        return new(obj) T();
+    }
+
+    void Delete(T* obj){
+        obj -> ~T();
+        std::lock_guard<std::mutex> lock(_mutex);
+        NextObj(obj) = _free_list;
+        _free_list = obj;
+        _in_use--;
+    }
+
+    size_t InUse(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _in_use;
+    }
+
+    size_t ReservedBytes(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _reserved_bytes;
+    }
+};
+
+#endif
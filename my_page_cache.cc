@@ -1,185 +1,772 @@
 #include "my_page_cache.h"
+#include "my_system_alloc.h"
+#include "my_stats.h"
 #include <new>
+#include <algorithm>
+#include <sched.h>
+
+PageCache::Partitions PageCache::_partitions;
+PageMap3<48 - PAGE_SHIFT> PageCache::_page_map(PageCache::MetadataAlloc);
+std::mutex PageCache::_page_map_mutex;
+
+// 元数据区每次向系统申请的大小, 更大的请求直接映射
+const size_t METADATA_CHUNK_SIZE = 1 << 20;
+const size_t METADATA_ALIGN_SHIFT = 6;    // 按缓存行对齐
+
+void* PageCache::MetadataAlloc(size_t bytes){
+    PageCache& cache = _partitions.nodes[0];
+    bytes = SizeClass::_RoundUp(bytes, METADATA_ALIGN_SHIFT);
+
+    std::lock_guard<std::mutex> lock(cache._metadata_mutex);
+    if(bytes > METADATA_CHUNK_SIZE / 4){
+        bytes = SizeClass::_RoundUp(bytes, PAGE_SHIFT);
+        void* ptr = SystemAlloc(bytes);
+        if(ptr != nullptr)
+            cache._metadata_bytes += bytes;
+        return ptr;
+    }
 
-PageCache* PageCache::_instance = nullptr;
-std::mutex PageCache::_mutex;
+    // 当前块剩下的部分不够就丢弃, 最多浪费 1/4
+    if(cache._metadata_remain < bytes){
+        char* chunk = (char*)SystemAlloc(METADATA_CHUNK_SIZE);
+        if(chunk == nullptr)
+            return nullptr;
+        cache._metadata_free = chunk;
+        cache._metadata_remain = METADATA_CHUNK_SIZE;
+        cache._metadata_bytes += METADATA_CHUNK_SIZE;
+    }
+    void* ptr = cache._metadata_free;
+    cache._metadata_free += bytes;
+    cache._metadata_remain -= bytes;
+    return ptr;
+}
 
 
-Span* PageCache::AllocBigPageObj(size_t size){
-    assert(size > MAX_BYTES);
+Span* PageCache::AllocBigPageObj(size_t size, size_t align){
+    assert(size > MAX_BYTES || align > ((size_t)1 << PAGE_SHIFT));
 
     size = SizeClass::_RoundUp(size, PAGE_SHIFT);
     size_t num_of_pages = size >> PAGE_SHIFT ;
 
-    if(num_of_pages < NPAGES){
-        Span* new_span = NewSpan(num_of_pages);
+    if(align <= ((size_t)1 << PAGE_SHIFT)){
+        Span* new_span;
+        if(num_of_pages < NPAGES){
+            new_span = NewSpan(num_of_pages);
+        }else {
+            std::lock_guard<std::mutex> lock(_mutex);
+            new_span = _NewSpan(num_of_pages);
+        }
         new_span -> obj_size = size;
         return new_span;
     }else {
-        void* ptr = malloc(size);
+        // 对齐要求超过一页时直接向系统映射对齐的内存, 释放后和其他 Span 一样进入页堆
+        std::lock_guard<std::mutex> lock(_mutex);
+        void* ptr = _SystemAlloc(size, align);
 
-        if(ptr == (void*) -1) {
-            throw std::bad_alloc();
-        }
-        
-        Span* new_span = new Span();
-        new_span -> obj_size = size;
+        Span* new_span = _NewSpanObject();
+        // 小对象也按大对象记录, 释放时整个 Span 还给页堆, 可用大小按页数计算
+        new_span -> obj_size = std::max(size, MAX_BYTES + 1);
         new_span -> page_id = (Page_ID)ptr >> PAGE_SHIFT;
         new_span -> page_num = num_of_pages;
-
-        _map_id_to_span[new_span -> page_id] = new_span;
+        new_span -> is_use = true;
+        _page_map.SetRange(new_span -> page_id, num_of_pages, new_span);
+        _heap_spans++;
+        _heap_grows++;
         return new_span;
     }
 }
 
-void PageCache::FreeBigPageObj(void* ptr, Span* span){
-    if(span -> page_num < NPAGES){
-        span -> obj_size = 0;
-        ReleaseSpanToPageCache(span);
-    }else {
-        free(ptr);
-        _map_id_to_span.erase(span -> page_id);
-        delete span;
+void* PageCache::_SystemAlloc(size_t bytes, size_t align){
+    void* ptr = SystemAlloc(bytes, align);
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+
+    // NUMA 模式下物理页放在本分区的节点上
+    NumaTopology* numa = NumaTopology::GetInstance();
+    if(numa -> Enabled())
+        numa -> BindToNode(ptr, bytes, Node());
+
+    {
+        // 基数树由所有分区共享, 分配中间节点时要互斥
+        std::lock_guard<std::mutex> lock(_page_map_mutex);
+        if(!_page_map.Ensure((Page_ID)ptr >> PAGE_SHIFT, bytes >> PAGE_SHIFT))
+            throw std::bad_alloc();
     }
+    _system_bytes += bytes;
+    return ptr;
 }
 
-Span* PageCache::MapObjectToSpan(void* obj){
-    Page_ID page_id = (Page_ID)obj >> PAGE_SHIFT;
-    auto span = _map_id_to_span.find(page_id);
-    if(span != _map_id_to_span.end()){
-        return span -> second;
-    }else {
-        assert(false);
+Span* PageCache::_NewSpanObject(){
+    Span* span = _span_pool.New();
+    span -> node = Node();
+    return span;
+}
+
+void PageCache::FreeBigPageObj(Span* span){
+    _partitions.nodes[span -> node].ReleaseSpanToPageCache(span);
+}
+
+bool PageCache::ResizeBigPageObj(Span* span, size_t size){
+    assert(span -> node == Node() && span -> obj_size > MAX_BYTES && size > MAX_BYTES);
+    size_t pages_num = SizeClass::_RoundUp(size, PAGE_SHIFT) >> PAGE_SHIFT;
+
+    Span* tail = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // hugepage 中的页由填充器的位图管理
+        if(_filler.Contains(span -> page_id))
+            return false;
+
+        if(pages_num > span -> page_num){
+            // 和 _Coalesce 向后合并的条件相同, 但只取走需要的页数
+            size_t extra = pages_num - span -> page_num;
+            Span* next = _page_map.Get(span -> page_id + span -> page_num);
+            if(next == nullptr || next -> node != span -> node || next -> is_use || next -> page_num < extra)
+                return false;
+
+            _EraseFreeSpan(next);
+            _page_map.SetRange(next -> page_id, extra, span);
+            if(next -> page_num > extra){
+                next -> page_id += extra;
+                next -> page_num -= extra;
+                _InsertFreeSpan(next);
+            }else {
+                _span_pool.Delete(next);
+            }
+        }else if(pages_num < span -> page_num){
+            tail = _NewSpanObject();
+            tail -> page_id = span -> page_id + pages_num;
+            tail -> page_num = span -> page_num - pages_num;
+            tail -> is_use = true;
+            _page_map.SetRange(tail -> page_id, tail -> page_num, tail);
+        }
+        span -> page_num = pages_num;
+        span -> obj_size = pages_num << PAGE_SHIFT;
+    }
+
+    if(tail != nullptr)
+        ReleaseSpanToPageCache(tail);
+    return true;
+}
+
+Span* PageCache::RemapBigPageObj(Span* span, size_t size){
+    assert(span -> node == Node() && span -> obj_size > MAX_BYTES && size > MAX_BYTES);
+    size_t bytes = SizeClass::_RoundUp(size, PAGE_SHIFT);
+    size_t old_bytes = span -> page_num << PAGE_SHIFT;
+    assert(bytes > old_bytes);
+
+    void* ptr;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_filler.Contains(span -> page_id))
+            return nullptr;
+        ptr = _SystemAlloc(bytes, (size_t)1 << PAGE_SHIFT);
+        _heap_grows++;
+    }
+
+    // 新地址还不属于任何 Span, span 在使用者手里, 系统调用不用持锁
+    bool moved = SystemRemap((void*)(span -> page_id << PAGE_SHIFT), old_bytes, ptr);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    Span* new_span = _NewSpanObject();
+    new_span -> page_id = (Page_ID)ptr >> PAGE_SHIFT;
+    new_span -> page_num = bytes >> PAGE_SHIFT;
+    _page_map.SetRange(new_span -> page_id, new_span -> page_num, new_span);
+    if(!moved){
+        // 新映射的内存和 _Grow 一样留在页堆中
+        new_span -> idle_since = NowNanos();
+        _InsertFreeSpan(new_span);
         return nullptr;
     }
+    new_span -> is_use = true;
+    new_span -> obj_size = bytes;
+    _heap_spans++;
+
+    span -> is_use = false;
+    span -> is_returned = true;
+    span -> obj_size = 0;
+    span -> idle_since = NowNanos();
+    _InsertFreeSpan(_Coalesce(span));
+    return new_span;
 }
 
 Span* PageCache::NewSpan(size_t pages_num){
-    std::lock_guard<std::mutex> lock(_mutex);
+    if(pages_num <= SPAN_CACHE_MAX_PAGES && _span_cache_enabled.load(std::memory_order_relaxed)){
+        SpanCacheShard& shard = _span_cache[CurrentShard()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if(shard.lists[pages_num].Empty()){
+            shard.misses++;
+            _RefillSpanCache(shard, pages_num);
+        }else {
+            shard.hits++;
+        }
+        shard.pages -= pages_num;
+        return shard.lists[pages_num].PopFront();
+    }
 
+    std::lock_guard<std::mutex> lock(_mutex);
     return _NewSpan(pages_num);
 }
 
-Span* PageCache::_NewSpan(size_t pages_num){
-    assert(pages_num < NPAGES);
+size_t PageCache::CurrentShard(){
+    // glibc 2.35 起 sched_getcpu 直接读取 rseq 区域, 不需要系统调用
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (size_t)cpu % SPAN_CACHE_SHARDS;
+}
 
-    if(_span_list[pages_num].Empty() == false) 
-        return _span_list[pages_num].PopFront();
+void PageCache::_RefillSpanCache(SpanCacheShard& shard, size_t n){
+    // 一次切出一整段再拆开, 只加一次全局锁
+    size_t count = std::max<size_t>(1, SPAN_CACHE_BATCH_PAGES / n);
+    if(shard.pages + count * n > SPAN_CACHE_SHARD_PAGES)
+        count = std::max<size_t>(1, (SPAN_CACHE_SHARD_PAGES - std::min(shard.pages, SPAN_CACHE_SHARD_PAGES)) / n);
 
-    for(int i = pages_num + 1; i < NPAGES; i++){
-        if(_span_list[i].Empty() == false){
-            // 将较大的 Span 拆成较小的 Span
-            Span* left = _span_list[i].PopFront();
-            Span* ret_span = new Span();
-            
-            ret_span ->page_id = left -> page_id;
-            ret_span ->page_num = pages_num;
+    std::lock_guard<std::mutex> lock(_mutex);
+    Span* span = _NewSpan(count * n);
+    uint64_t now = NowNanos();
+    for(size_t i = 1; i < count; i++){
+        Span* piece = _NewSpanObject();
+        piece -> page_id = span -> page_id + i * n;
+        piece -> page_num = n;
+        piece -> is_use = true;
+        piece -> idle_since = now;
+        _page_map.SetRange(piece -> page_id, n, piece);
+        shard.lists[n].PushBack(piece);
+    }
+    span -> page_num = n;
+    span -> idle_since = now;
+    shard.lists[n].PushFront(span);
+    shard.pages += count * n;
+}
 
-            left -> page_num = i - pages_num;
-            left -> page_id += pages_num;
+size_t PageCache::_FlushSpanCache(SpanCacheShard& shard, size_t pages, uint64_t idle_before){
+    std::lock_guard<std::mutex> lock(_mutex);
 
-            for(size_t i = ret_span ->page_id; i != left ->page_id; i++)
-                _map_id_to_span[i] = ret_span;
+    size_t flushed = 0;
+    // 刚放回来的 Span 在头部, 从尾部开始还
+    for(size_t n = SPAN_CACHE_MAX_PAGES; n > 0 && flushed < pages; n--){
+        SpanList& list = shard.lists[n];
+        while(!list.Empty() && flushed < pages){
+            Span* span = list.End() -> prev;
+            if(span -> idle_since > idle_before)
+                break;
+            list.Erase(span);
+            shard.pages -= n;
+            flushed += n;
+            _ReleaseSpanToHeap(span);
+        }
+    }
+    return flushed;
+}
 
-            // 将 left 插入合适的桶
-            _span_list[left -> page_num].PushFront(left);
+size_t PageCache::DrainSpanCaches(uint64_t idle_before){
+    size_t drained = 0;
+    for(size_t i = 0; i < SPAN_CACHE_SHARDS; i++){
+        std::lock_guard<std::mutex> lock(_span_cache[i].mutex);
+        if(_span_cache[i].pages > 0)
+            drained += _FlushSpanCache(_span_cache[i], (size_t)-1, idle_before);
+    }
+    return drained;
+}
 
-            return ret_span;
-        }
+void PageCache::SetSpanCacheEnabled(bool enable){
+    _span_cache_enabled.store(enable, std::memory_order_relaxed);
+    if(!enable)
+        DrainSpanCaches((uint64_t)-1);
+}
+
+size_t PageCache::SpanCacheBytes(){
+    size_t pages = 0;
+    for(size_t i = 0; i < SPAN_CACHE_SHARDS; i++){
+        std::lock_guard<std::mutex> lock(_span_cache[i].mutex);
+        pages += _span_cache[i].pages;
+    }
+    return pages << PAGE_SHIFT;
+}
+
+Span* PageCache::_NewSpan(size_t pages_num){
+    assert(pages_num > 0);
+    if(_filler_enabled && pages_num < NPAGES)
+        return _FillerNewSpan(pages_num);
+
+    // 同样大小的桶里, 优先使用仍有物理内存的 Span, 避免重新缺页
+    for(size_t i = pages_num; i < NPAGES; i++){
+        if(_span_list[i].Empty() == false)
+            return _Carve(_span_list[i].Begin(), pages_num);
+        if(_returned_list[i].Empty() == false)
+            return _Carve(_returned_list[i].Begin(), pages_num);
+    }
+
+    Span* span = _BestFitLargeSpan(pages_num);
+    if(span != nullptr)
+        return _Carve(span, pages_num);
+
+    // 空闲页的总数够用, 但仍有物理内存的和已经归还的 Span 即使相邻也不合并, 可能正是它们把空间切碎了
+    // 找一段连起来够用的相邻空闲 Span, 只归还其中仍有物理内存的部分, 合并之后再找一次
+    // 两次向系统申请内存之间最多做一次, 后台回收线程运行时由它负责归还, 分配路径上不做系统调用
+    if(_release_on_free && _coalesce_grows != _heap_grows && _free_pages > 0 && _free_pages + _returned_pages >= pages_num){
+        _coalesce_grows = _heap_grows;
+        if(_ReleaseRunFor(pages_num))
+            return _NewSpan(pages_num);
     }
 
-    // std::cout << "Now is preparing to apply memory!" << std::endl;
     // 山穷水尽  向系统要空间
-    void* ptr = malloc((NPAGES - 1) << PAGE_SHIFT);
-    if(ptr == nullptr)
+    _Grow(pages_num);
+    return _NewSpan(pages_num);
+}
+
+Span* PageCache::_BestFitLargeSpan(size_t pages_num){
+    // 两棵树各取最佳适配, 页数相同时优先使用仍有物理内存的
+    Span* backed = _large_spans.BestFit(pages_num);
+    Span* returned = _large_returned.BestFit(pages_num);
+    if(backed == nullptr)
+        return returned;
+    if(returned == nullptr || backed -> page_num <= returned -> page_num)
+        return backed;
+    return returned;
+}
+
+void PageCache::_Grow(size_t pages_num){
+    // 至少申请一个 chunk (NPAGES - 1 页), 更大的按 chunk 的整数倍申请, 零头留给小 Span
+    // 开启 hugepage 填充器时按 2M 对齐, 使大 Span 也能用大页映射
+    const size_t chunk = _filler_enabled ? HUGEPAGE_PAGES : NPAGES - 1;
+    if(pages_num > ((size_t)-1 >> PAGE_SHIFT) - chunk)
         throw std::bad_alloc();
-    Span* new_span = new Span();
-    new_span ->page_num = NPAGES - 1;
+    size_t pages = (pages_num + chunk - 1) / chunk * chunk;
+
+    void* ptr = _SystemAlloc(pages << PAGE_SHIFT, chunk << PAGE_SHIFT);
+    _heap_grows++;
+    if(_filler_enabled)
+        SystemHugePage(ptr, pages << PAGE_SHIFT);
+    Span* new_span = _NewSpanObject();
+    new_span ->page_num = pages;
     new_span ->page_id = (Page_ID)ptr >> PAGE_SHIFT;
+    _page_map.SetRange(new_span -> page_id, new_span -> page_num, new_span);
+    new_span ->idle_since = NowNanos();
+
+    _InsertFreeSpan(new_span);
+}
 
-    // std::cout << "Before for range !" << std::endl;
-    for(size_t i = new_span ->page_id; i != new_span ->page_id + new_span -> page_num; i++){
-        // std::cout << i << std::endl;
-        _map_id_to_span[i] = new_span;
+Span* PageCache::_FillerNewSpan(size_t pages_num){
+    Page_ID page_id = _filler.Alloc(pages_num);
+    if(page_id == 0){
+        // 所有 hugepage 都放不下, 映射一个新的
+        void* ptr = _SystemAlloc((size_t)1 << HUGEPAGE_SHIFT, (size_t)1 << HUGEPAGE_SHIFT);
+        SystemHugePage(ptr, (size_t)1 << HUGEPAGE_SHIFT);
+        if(!_filler.AddHugePage((Page_ID)ptr >> PAGE_SHIFT))
+            throw std::bad_alloc();
+        page_id = _filler.Alloc(pages_num);
+        _heap_grows++;
     }
-    
-    _span_list[NPAGES - 1].PushFront(new_span);
+    _heap_spans++;
+
+    Span* span = _NewSpanObject();
+    span -> page_id = page_id;
+    span -> page_num = pages_num;
+    span -> is_use = true;
+    _page_map.SetRange(page_id, pages_num, span);
+    return span;
+}
 
-    // std::cout << "Now is quiting NewSpan!" << std::endl; 
-    return _NewSpan(pages_num);
+void PageCache::_FillerReleaseSpan(Span* span){
+    // 空闲的页不再映射到任何 Span, 普通 Span 合并时不会越过 hugepage 的边界
+    _page_map.SetRange(span -> page_id, span -> page_num, nullptr);
+    HugePage* hugepage = _filler.Free(span -> page_id, span -> page_num);
+    _span_pool.Delete(span);
+
+    // 只有整个 hugepage 都空闲时才还给系统. 和大 Span 一样, 全空的 hugepage 先保留物理内存,
+    // 超过 _release_on_free_pages 时才从闲置最久的开始归还, 反复申请释放同一个小 Span 不会每次都 madvise
+    if(_release_on_free && _release_on_free_pages != 0 && hugepage -> used_pages == 0){
+        while(_filler.EmptyHugePages() * HUGEPAGE_PAGES > _release_on_free_pages)
+            _filler.Release(_filler.OldestEmpty());
+    }
 }
 
+void PageCache::SetHugePageFiller(bool enable){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _filler_enabled = enable;
+}
 
-void PageCache::ReleaseSpanToPageCache(Span* cur){
-    // 有可能多个线程同时归还span, 要加全局锁
+size_t PageCache::HugePageOccupancy(HugePageInfo* out, size_t max){
     std::lock_guard<std::mutex> lock(_mutex);
+    return _filler.Occupancy(out, max);
+}
+
+Span* PageCache::_Carve(Span* span, size_t pages_num){
+    _EraseFreeSpan(span);
 
-    if(cur -> page_num >= NPAGES){
-        free((void*)(cur ->page_id << PAGE_SHIFT));
-        _map_id_to_span.erase(cur -> page_id);
-        delete cur;
+    if(span -> page_num > pages_num){
+        // 将较大的 Span 拆成较小的 Span, 剩下的部分保持原来的状态放回桶中
+        Span* left = _NewSpanObject();
+        left -> page_id = span -> page_id + pages_num;
+        left -> page_num = span -> page_num - pages_num;
+        left -> is_returned = span -> is_returned;
+        left -> idle_since = span -> idle_since;
+        _page_map.SetRange(left -> page_id, left -> page_num, left);
+        _InsertFreeSpan(left);
+
+        span -> page_num = pages_num;
     }
 
+    // 已经归还的页不需要做任何操作, 下次访问时内核会重新分配物理页 (MADV_FREE 下可能还是原来的页)
+    span -> is_use = true;
+    span -> is_returned = false;
+    _heap_spans++;
+    return span;
+}
 
+void PageCache::_InsertFreeSpan(Span* span){
+    if(span -> is_returned){
+        if(span -> page_num >= NPAGES)
+            _large_returned.Insert(span);
+        else
+            _returned_list[span -> page_num].PushFront(span);
+        _returned_pages += span -> page_num;
+    }else {
+        if(span -> page_num >= NPAGES){
+            _large_spans.Insert(span);
+            // 一般是刚释放的, 插在头部; 切分或者部分归还剩下的 Span 保留原来的时间, 往后找到它的位置
+            Span* pos = _large_idle.Begin();
+            while(pos != _large_idle.End() && pos -> idle_since > span -> idle_since)
+                pos = pos -> next;
+            _large_idle.Insert(pos, span);
+        }else {
+            _span_list[span -> page_num].PushFront(span);
+        }
+        _free_pages += span -> page_num;
+    }
+}
+
+void PageCache::_EraseFreeSpan(Span* span){
+    if(span -> is_returned){
+        if(span -> page_num >= NPAGES)
+            _large_returned.Erase(span);
+        else
+            _returned_list[span -> page_num].Erase(span);
+        _returned_pages -= span -> page_num;
+    }else {
+        if(span -> page_num >= NPAGES){
+            _large_spans.Erase(span);
+            _large_idle.Erase(span);
+        }else {
+            _span_list[span -> page_num].Erase(span);
+        }
+        _free_pages -= span -> page_num;
+    }
+}
+
+// 合并后超过 NPAGES - 1 页的 Span 进入大 Span 层
+Span* PageCache::_Coalesce(Span* cur){
     // 向前合并
     while(1){
-        
-        Page_ID prev_id = --cur ->page_id;
-
         // 该页面必须已经被我们所管理
-        if(_map_id_to_span.find(prev_id) == _map_id_to_span.end())
+        auto prev = _page_map.Get(cur -> page_id - 1);
+        if(prev == nullptr)
+            break;
+
+        // 属于其他 NUMA 分区的 Span 由那个分区的锁保护, 不能合并
+        // Span 对象只在所属分区的对象池中复用, node 不会改变, 不加锁读取是安全的
+        if(prev -> node != cur -> node)
             break;
-        
-        auto prev = _map_id_to_span[prev_id];
 
         // 必须是完整的空白Span, 不能有分出去的Object
-        if(prev -> use_count != 0)
+        if(prev -> is_use)
             break;
 
-        // 页面数量不能超过 NPAGES - 1
-        if(cur -> page_num + prev -> page_num > NPAGES - 1)
+        // 只合并状态相同的 Span, 否则合并时就要在释放路径上调用 madvise
+        if(prev -> is_returned != cur -> is_returned)
             break;
 
-        for(size_t i = prev -> page_id; i != prev -> page_id + prev -> page_num; i++){
-            _map_id_to_span[i] = cur;
-        }
+        _EraseFreeSpan(prev);
+        _page_map.SetRange(prev -> page_id, prev -> page_num, cur);
 
         cur -> page_num += prev -> page_num;
         cur ->page_id = prev ->page_id;
 
-        _span_list[prev -> page_num].Erase(prev);
-        
-        delete(prev);
+        _span_pool.Delete(prev);
     }
 
     //向后合并
     while(1){
-        Page_ID next_id = cur ->page_id + cur -> page_num;
-
         // 该页面必须已经被我们所管理
-        if(_map_id_to_span.find(next_id) == _map_id_to_span.end())
+        auto next = _page_map.Get(cur -> page_id + cur -> page_num);
+        if(next == nullptr)
+            break;
+
+        if(next -> node != cur -> node)
             break;
-        
-        auto next = _map_id_to_span[next_id];
 
         // 必须是完整的空白Span, 不能有分出去的Object
-        if(next -> use_count != 0)
+        if(next -> is_use)
             break;
 
-        // 页面数量不能超过 NPAGES - 1
-        if(cur -> page_num + next -> page_num > NPAGES - 1)
+        if(next -> is_returned != cur -> is_returned)
             break;
 
-        for(size_t i = next -> page_id; i != next -> page_id + next -> page_num; i++){
-            _map_id_to_span[i] = cur;
-        }
+        _EraseFreeSpan(next);
+        _page_map.SetRange(next -> page_id, next -> page_num, cur);
 
         cur -> page_num += next -> page_num;
 
-        _span_list[next -> page_num].Erase(next);
+        _span_pool.Delete(next);
+    }
+
+    return cur;
+}
+
+void PageCache::_ReleaseSpan(Span* span){
+    _EraseFreeSpan(span);
+    SystemRelease((void*)(span -> page_id << PAGE_SHIFT), span -> page_num << PAGE_SHIFT);
+    span -> is_returned = true;
+    // 归还之后可能和相邻的已归还 Span 连成一片
+    _InsertFreeSpan(_Coalesce(span));
+}
+
+bool PageCache::_ReleaseRunFor(size_t pages_num){
+    auto is_free = [this](Span* span){
+        return span != nullptr && span -> node == Node() && !span -> is_use;
+    };
+    // 从每个仍有物理内存的空闲 Span 向两边找出相邻的空闲页, 够用时归还其中仍有物理内存的 Span
+    // 只由物理内存状态相同的 Span 组成的一段已经合并成一个, 放得下的话前面的最佳适配就能找到
+    auto try_run = [&](Span* seed){
+        Page_ID start = seed -> page_id;
+        for(Span* prev = _page_map.Get(start - 1); is_free(prev); prev = _page_map.Get(start - 1))
+            start = prev -> page_id;
+        Page_ID end = seed -> page_id + seed -> page_num;
+        for(Span* next = _page_map.Get(end); is_free(next); next = _page_map.Get(end))
+            end += next -> page_num;
+        if(end - start < pages_num)
+            return false;
+
+        for(Page_ID page = start; page < end;){
+            Span* span = _page_map.Get(page);
+            page = span -> page_id + span -> page_num;
+            if(!span -> is_returned)
+                _ReleaseSpan(span);
+        }
+        return true;
+    };
+
+    for(Span* span = _large_idle.Begin(); span != _large_idle.End(); span = span -> next){
+        if(try_run(span))
+            return true;
+    }
+    for(size_t i = 1; i < NPAGES; i++){
+        for(Span* span = _span_list[i].Begin(); span != _span_list[i].End(); span = span -> next){
+            if(try_run(span))
+                return true;
+        }
+    }
+    return false;
+}
+
+size_t PageCache::_ReleaseFreeSpans(size_t num_pages){
+    size_t released = 0;
+    // 从大的 Span 开始归还, 一次 madvise 能还回更多的页
+    while(!_large_spans.Empty() && released < num_pages){
+        Span* span = _large_spans.FindLast([](Span*){ return true; });
+        released += span -> page_num;
+        _ReleaseSpan(span);
+    }
+    for(size_t i = NPAGES - 1; i > 0 && released < num_pages; i--){
+        while(_span_list[i].Empty() == false && released < num_pages){
+            _ReleaseSpan(_span_list[i].Begin());
+            released += i;
+        }
+    }
+    return released;
+}
+
+size_t PageCache::ReleaseToSystem(size_t num_pages){
+    DrainSpanCaches((uint64_t)-1);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    size_t released = _ReleaseFreeSpans(num_pages);
+    // 填充器只归还全空的 hugepage
+    while(released < num_pages){
+        HugePage* hugepage = _filler.FindIdleEmpty((uint64_t)-1);
+        if(hugepage == nullptr)
+            break;
+        _filler.Release(hugepage);
+        released += HUGEPAGE_PAGES;
+    }
+    return released;
+}
+
+void PageCache::ReleaseSpanToPageCache(Span* cur){
+    // 在其他节点上释放的 Span 回到它所属的分区
+    if(cur -> node != Node()){
+        _partitions.nodes[cur -> node].ReleaseSpanToPageCache(cur);
+        return;
+    }
+
+    // 清掉上一个使用者留下的对象信息, 无论进入分片缓存还是全局页堆, 空闲的 Span 都不再像是在使用中的小对象 Span
+    _ResetSpan(cur);
+
+    if(cur -> page_num <= SPAN_CACHE_MAX_PAGES && _span_cache_enabled.load(std::memory_order_relaxed)){
+        SpanCacheShard& shard = _span_cache[CurrentShard()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        cur -> idle_since = NowNanos();
+        shard.lists[cur -> page_num].PushFront(cur);
+        shard.pages += cur -> page_num;
+        if(shard.pages > SPAN_CACHE_SHARD_PAGES)
+            _FlushSpanCache(shard, shard.pages - SPAN_CACHE_SHARD_PAGES / 2, (uint64_t)-1);
+        return;
+    }
+
+    // 有可能多个线程同时归还span, 要加全局锁
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ReleaseSpanToHeap(cur);
+}
+
+void PageCache::_ResetSpan(Span* span){
+    span -> list_ptr = nullptr;
+    span -> bump = nullptr;
+    span -> obj_size = 0;
+    span -> size_class = 0;
+    span -> use_count = 0;
+    span -> sampled = 0;
+    __atomic_store_n(&span -> owner, (ThreadCache*)nullptr, __ATOMIC_RELAXED);
+    span -> heap = nullptr;
+}
+
+void PageCache::_ReleaseSpanToHeap(Span* cur){
+    if(_filler.Contains(cur -> page_id)){
+        _FillerReleaseSpan(cur);
+        return;
+    }
+
+    cur -> is_use = false;
+    cur = _Coalesce(cur);
+    cur -> idle_since = NowNanos();
+    _InsertFreeSpan(cur);
 
-        delete(next);
+    // 合并出了足够大的空闲 Span, 把物理页还给系统; 更小的保留物理内存, 下次分配不用重新缺页
+    // 后台回收线程运行时由它按速率归还, 释放路径上不做系统调用
+    if(_release_on_free && _release_on_free_pages != 0 && cur -> page_num >= _release_on_free_pages && !cur -> is_returned)
+        _ReleaseSpan(cur);
+}
+
+Span* PageCache::_FindIdleSpan(uint64_t idle_before){
+    // 大 Span 层按闲置时间排好了序, 只需看最旧的一个
+    if(!_large_idle.Empty() && _large_idle.End() -> prev -> idle_since <= idle_before)
+        return _large_idle.End() -> prev;
+
+    for(size_t i = NPAGES - 1; i > 0; i--){
+        // 新释放的 Span 插在头部, 越靠后的闲置越久
+        for(Span* span = _span_list[i].End() -> prev; span != _span_list[i].End(); span = span -> prev){
+            if(span -> idle_since <= idle_before)
+                return span;
+        }
+    }
+    return nullptr;
+}
+
+size_t PageCache::ReleaseIdleSpans(uint64_t idle_before, size_t max_pages, size_t keep_pages){
+    // 小 Span 缓存中闲置的 Span 先还给全局页堆, 和其他空闲页一起归还
+    DrainSpanCaches(idle_before);
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    size_t released = 0;
+    while(released < max_pages && _free_pages > keep_pages){
+        Span* span = _FindIdleSpan(idle_before);
+        if(span == nullptr)
+            break;
+
+        // 受速率和保留量限制时, 只归还 Span 尾部的一部分
+        size_t pages = std::min(max_pages - released, _free_pages - keep_pages);
+        _EraseFreeSpan(span);
+        if(span -> page_num > pages){
+            Span* tail = _NewSpanObject();
+            tail -> page_num = pages;
+            tail -> page_id = span -> page_id + span -> page_num - pages;
+            _page_map.SetRange(tail -> page_id, tail -> page_num, tail);
+
+            span -> page_num -= pages;
+            _InsertFreeSpan(span);
+            span = tail;
+        }
+
+        // 先从空闲链表摘下并标记为使用中, 这样解锁期间它既不会被分配也不会被合并
+        // madvise 在锁外执行, 不阻塞分配路径
+        span -> is_use = true;
+        pages = span -> page_num;
+        lock.unlock();
+
+        SystemRelease((void*)(span -> page_id << PAGE_SHIFT), pages << PAGE_SHIFT);
+
+        lock.lock();
+        span -> is_use = false;
+        span -> is_returned = true;
+        _InsertFreeSpan(_Coalesce(span));
+        released += pages;
+    }
+
+    // 填充器中闲置的全空 hugepage 整个归还
+    while(released < max_pages && _free_pages + _filler.FreePages() >= keep_pages + HUGEPAGE_PAGES){
+        HugePage* hugepage = _filler.FindIdleEmpty(idle_before);
+        if(hugepage == nullptr)
+            break;
+        _filler.BeginRelease(hugepage);
+        lock.unlock();
+
+        SystemRelease((void*)(hugepage -> first_page << PAGE_SHIFT), (size_t)1 << HUGEPAGE_SHIFT);
+
+        lock.lock();
+        _filler.FinishRelease(hugepage);
+        released += HUGEPAGE_PAGES;
+    }
+    return released;
+}
+
+void PageCache::SetReleaseOnFree(bool enable){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _release_on_free = enable;
+}
+
+void PageCache::SetReleaseOnFreeBytes(size_t bytes){
+    std::lock_guard<std::mutex> lock(_mutex);
+    _release_on_free_pages = SizeClass::_RoundUp(bytes, PAGE_SHIFT) >> PAGE_SHIFT;
+}
+
+size_t PageCache::SystemBytes(){
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _system_bytes;
+}
+
+size_t PageCache::FreeBytes(){
+    std::lock_guard<std::mutex> lock(_mutex);
+    return (_free_pages + _filler.FreePages()) << PAGE_SHIFT;
+}
+
+size_t PageCache::ReturnedBytes(){
+    std::lock_guard<std::mutex> lock(_mutex);
+    return (_returned_pages + _filler.ReturnedPages()) << PAGE_SHIFT;
+}
+
+void PageCache::AddStats(AllocatorStats* stats){
+    for(size_t i = 0; i < SPAN_CACHE_SHARDS; i++){
+        std::lock_guard<std::mutex> lock(_span_cache[i].mutex);
+        stats -> span_cache.hits += _span_cache[i].hits;
+        stats -> span_cache.misses += _span_cache[i].misses;
+        stats -> span_cache_bytes += _span_cache[i].pages << PAGE_SHIFT;
     }
 
-    _span_list[cur -> page_num].PushFront(cur);
-}
\ No newline at end of file
+    std::lock_guard<std::mutex> lock(_mutex);
+    stats -> page_heap.hits += _heap_spans - _heap_grows;
+    stats -> page_heap.misses += _heap_grows;
+    stats -> page_heap_free_bytes += (_free_pages + _filler.FreePages()) << PAGE_SHIFT;
+    stats -> page_heap_returned_bytes += (_returned_pages + _filler.ReturnedPages()) << PAGE_SHIFT;
+    stats -> system_bytes += _system_bytes;
+    for(size_t i = 1; i < NPAGES; i++){
+        for(Span* span = _span_list[i].Begin(); span != _span_list[i].End(); span = span -> next)
+            stats -> free_spans[i]++;
+        for(Span* span = _returned_list[i].Begin(); span != _returned_list[i].End(); span = span -> next)
+            stats -> free_spans[i]++;
+    }
+    stats -> free_spans[NPAGES] += _large_spans.Size() + _large_returned.Size();
+}
+
+size_t PageCache::MetadataBytes(){
+    std::lock_guard<std::mutex> lock(_metadata_mutex);
+    return _metadata_bytes;
+}
@@ -1,43 +1,203 @@
 #ifndef PAGE_CACHE_H
 #define PAGE_CACHE_H
 #include "my_common.h"
-#include<unordered_map>
+#include "my_page_map.h"
+#include "my_object_pool.h"
+#include "my_huge_page_filler.h"
+#include "my_numa.h"
+#include <atomic>
+
+struct AllocatorStats;
+
+// 小 Span 缓存: 1 ~ SPAN_CACHE_MAX_PAGES 页的 Span (CentralCache 申请的基本都是这种) 按 CPU 分片缓存,
+// 分配和释放只加所在分片的锁. 只有分片空了从全局页堆批量切分, 或者分片满了批量归还 (合并) 时才加全局锁
+const size_t SPAN_CACHE_SHARDS = 16;
+const size_t SPAN_CACHE_MAX_PAGES = 8;
+const size_t SPAN_CACHE_SHARD_PAGES = 128;   // 每个分片最多缓存的页数, 超过后归还一半
+const size_t SPAN_CACHE_BATCH_PAGES = 16;    // 分片空了一次从全局页堆切出的页数
+
+// 没有后台回收线程时, 释放后合并出的空闲 Span 达到这个大小才立即归还给系统, 见 SetReleaseOnFreeBytes
+const size_t RELEASE_ON_FREE_BYTES = 64 << 20;
 
 class PageCache{
 public:
     PageCache(const PageCache&) = delete;
     PageCache& operator=(const PageCache&) = delete;
 
-    static PageCache* GetInstance(){
-        std::lock_guard<std::mutex> lock(_mutex);
-        if(_instance == nullptr){
-            _instance = new PageCache();
-        }
-        return _instance;
-    }
+    // 单例在编译期常量初始化, 获取时不需要加锁
+    // NUMA 模式下每个节点一个分区 (各自的空闲链表, 锁和 hugepage), 基数树和元数据区是共享的
+    // 没有参数时返回节点 0 的分区, 也是没有开启 NUMA 时唯一的分区
+    static PageCache* GetInstance();
+    static PageCache* GetInstance(size_t node);
+    size_t Node();
 
-    Span* AllocBigPageObj(size_t size);
-	void FreeBigPageObj(void* ptr, Span* span);
+    // 不超过 NPAGES - 1 页的对象和小对象共用按页数分桶的空闲链表, 更大的从大 Span 层最佳适配
+    // 超过一页的对齐要求直接向系统映射对齐的内存, 释放后同样进入页堆
+    Span* AllocBigPageObj(size_t size, size_t align = (size_t)1 << PAGE_SHIFT);
+	void FreeBigPageObj(Span* span);
+
+    // 大对象的 realloc, 都要在 span 所属的分区上调用, 新的大小 size 也必须是大对象
+    // 原地把 span 调整到 size 字节: 缩小时尾部的页还回页堆, 增大时吞并紧跟在后面的空闲 Span
+    // 后面的页不空闲 (或者 span 在 hugepage 填充器中) 时返回 false
+    bool ResizeBigPageObj(Span* span, size_t size);
+    // 映射 size 字节的新地址, 用 mremap 把 span 的物理页移过去, 不拷贝数据, 返回新的 Span
+    // 原来的地址保留映射但没有物理页, 作为已经归还的空闲 Span 进入页堆. 不支持时返回 nullptr
+    Span* RemapBigPageObj(Span* span, size_t size);
 
 	Span* _NewSpan(size_t n);
 	Span* NewSpan(size_t n);//获取的是以页为单位
 
-	//获取从对象到span的映射
-	Span* MapObjectToSpan(void* obj);
+	//获取从对象到span的映射, 不加锁
+	Span* MapObjectToSpan(void* obj){
+        Span* span = FindSpan(obj);
+        assert(span != nullptr);
+        return span;
+    }
+
+    // 同上, 但 obj 不属于内存池时返回 nullptr
+    Span* FindSpan(void* obj){
+        return _page_map.Get((Page_ID)obj >> PAGE_SHIFT);
+    }
 
 	//释放空间span回到PageCache，并合并相邻的span
+	// 可以在任意分区上调用, Span 总是回到它所属的分区
 	void ReleaseSpanToPageCache(Span* span);
 
+    // 把最多 num_pages 个空闲页的物理内存还给系统, 返回实际归还的页数
+    size_t ReleaseToSystem(size_t num_pages);
+
+    // 归还闲置时间早于 idle_before 的空闲页, 最多 max_pages 页,
+    // 且至少保留 keep_pages 个仍占用物理内存的空闲页. 系统调用在锁外执行
+    size_t ReleaseIdleSpans(uint64_t idle_before, size_t max_pages, size_t keep_pages);
+
+    // 释放时是否立即把物理页还给系统, 后台回收线程运行时关闭
+    void SetReleaseOnFree(bool enable);
+    // 立即归还的门槛: 合并出的空闲 Span 不小于 bytes 时才归还, 0 表示从不立即归还
+    // 更小的空闲 Span 保留物理内存, 再次分配时不用重新缺页, 由 ReleaseToSystem 或后台回收线程归还
+    void SetReleaseOnFreeBytes(size_t bytes);
+
+    // 把小 Span 缓存中闲置时间早于 idle_before 的 Span 还给全局页堆, 返回页数
+    size_t DrainSpanCaches(uint64_t idle_before);
+    // 关闭时清空小 Span 缓存, 所有请求都走全局页堆
+    void SetSpanCacheEnabled(bool enable);
+    size_t SpanCacheBytes();   // 小 Span 缓存中的字节数, 不计入 FreeBytes
+
+    // 开启后小 Span (不超过 NPAGES - 1 页) 从 2M 对齐的 hugepage 中紧凑地分配, 见 my_huge_page_filler.h
+    // 关闭只影响之后的分配, 已经放在 hugepage 中的 Span 释放时仍然回到填充器
+    void SetHugePageFiller(bool enable);
+    // 每个 hugepage 的占用写进 out (最多 max 个, 从最满的开始), 返回 hugepage 的总数
+    size_t HugePageOccupancy(HugePageInfo* out, size_t max);
+
+    // 分配器内部元数据 (Span, ThreadCache, 基数树节点, 每 CPU 缓存的数组) 使用的内存
+    // 从单独的元数据区按块切分, 返回清零的内存, 不能释放. 不加 PageCache 的锁, 持锁时也可以调用
+    static void* MetadataAlloc(size_t bytes);
+
+    size_t SystemBytes();    // 从系统映射的字节数 (不含元数据)
+    size_t MetadataBytes();  // 元数据区从系统映射的字节数
+    size_t FreeBytes();      // 全局页堆中空闲且仍占用物理内存的字节数, 不含小 Span 缓存
+    size_t ReturnedBytes();  // 空闲且已经还给系统的字节数
+
+    // 把本分区的命中次数, 各级空闲页和按页数的空闲 Span 个数加到 stats 中
+    void AddStats(AllocatorStats* stats);
+
+private:
+    // 以下函数调用时必须持有 _mutex
+    Span* _Carve(Span* span, size_t n);      // 从空闲的 span 上切下 n 页分配出去
+    void _InsertFreeSpan(Span* span);
+    void _EraseFreeSpan(Span* span);
+    Span* _Coalesce(Span* span);             // 和相邻的空闲 Span 合并
+    void _ReleaseSpan(Span* span);           // 把空闲 span 的物理页还给系统
+    size_t _ReleaseFreeSpans(size_t num_pages);   // 从大到小归还仍有物理内存的空闲 Span, 返回页数
+    bool _ReleaseRunFor(size_t n);           // 归还一段相邻空闲页中仍有物理内存的部分, 使它们合并出至少 n 页
+    Span* _FindIdleSpan(uint64_t idle_before);        // 找一个闲置足够久的空闲 Span, 大 Span 层优先
+    Span* _BestFitLargeSpan(size_t n);       // 大 Span 层中不少于 n 页的最小空闲 Span
+    void _Grow(size_t n);                    // 向系统申请至少 n 页放进页堆
+    void* _SystemAlloc(size_t bytes, size_t align);   // 映射内存, 绑定到本分区的节点, 并为其分配基数树节点
+    Span* _NewSpanObject();                  // 从对象池中取出属于本分区的 Span
+    Span* _FillerNewSpan(size_t n);          // 从 hugepage 填充器中分配
+    void _FillerReleaseSpan(Span* span);
+    void _ReleaseSpanToHeap(Span* span);     // 归还到全局页堆并合并
+    static void _ResetSpan(Span* span);      // 清掉对象相关的字段 (不需要持锁)
+
+    struct alignas(64) SpanCacheShard{
+        std::mutex mutex;
+        // 按页数分桶, 其中的 Span 保持 is_use, 不参与合并, 其余字段已经清空
+        // 后台回收线程把闲置的 Span 还给全局页堆, ReleaseToSystem 先清空所有分片, 它们最终都能还给系统
+        SpanList lists[SPAN_CACHE_MAX_PAGES + 1];
+        size_t pages = 0;
+        uint64_t hits = 0;      // 分片中有 / 没有合适的 Span 的次数
+        uint64_t misses = 0;
+    };
+
+    // 以下函数调用时必须持有 shard.mutex, 不能持有 _mutex (加锁顺序: 分片 -> 全局)
+    void _RefillSpanCache(SpanCacheShard& shard, size_t n);
+    // 从最久没用的开始归还, 直到归还了至少 pages 页或者满足 idle_before 的都还完了
+    size_t _FlushSpanCache(SpanCacheShard& shard, size_t pages, uint64_t idle_before);
+    static size_t CurrentShard();
+
 private:
-    // 将页面映射到相应的Span
-    std::unordered_map<Page_ID, Span*> _map_id_to_span;
+    // 将页面映射到相应的Span, 48 位地址空间. 所有分区共享, Ensure 由 _page_map_mutex 保护
+    static PageMap3<48 - PAGE_SHIFT>   _page_map;
+    static std::mutex                  _page_map_mutex;
+    // 按页数分桶的空闲 Span, 仍占用物理内存
     SpanList                           _span_list[NPAGES];
+    // 按页数分桶的空闲 Span, 物理页已经通过 madvise 还给系统
+    SpanList                           _returned_list[NPAGES];
+    // NPAGES 页及以上的空闲 Span, 按 (页数, 地址) 排序, 同样按是否已经归还分开
+    SpanTree                           _large_spans;
+    SpanTree                           _large_returned;
+    // _large_spans 中的 Span 按 idle_since 从新到旧串成链表 (借用 prev / next), 回收时从尾部取闲置最久的
+    SpanList                           _large_idle;
+    std::mutex                         _mutex;
+    // Span 本身也从对象池中分配, 不走 new / delete
+    ObjectPool<Span>                   _span_pool;
+
+    // 元数据区, 由 _metadata_mutex 保护
+    std::mutex                         _metadata_mutex;
+    char*                              _metadata_free = nullptr;
+    size_t                             _metadata_remain = 0;
+    size_t                             _metadata_bytes = 0;
+
+    HugePageFiller                     _filler;
+    bool                               _filler_enabled = false;
+
+    SpanCacheShard                     _span_cache[SPAN_CACHE_SHARDS];
+    std::atomic<bool>                  _span_cache_enabled{true};
+
+    size_t _free_pages = 0;
+    size_t _returned_pages = 0;
+    size_t _system_bytes = 0;
+    bool _release_on_free = true;
+    size_t _release_on_free_pages = RELEASE_ON_FREE_BYTES >> PAGE_SHIFT;
+    uint64_t _heap_spans = 0;     // 从页堆分配出去的 Span 数
+    uint64_t _heap_grows = 0;     // 其中需要向系统映射内存的次数
+    uint64_t _coalesce_grows = 0; // 上一次为了合并碎片而归还空闲页时的 _heap_grows
 
 private:
-    PageCache(){}
-    static PageCache* _instance;
-    static std::mutex _mutex;
+    constexpr PageCache() : _span_pool(MetadataAlloc), _filler(MetadataAlloc) {}
+
+    // 直接定义 PageCache 的数组时 GCC 不做常量初始化, 包一层带 constexpr 构造函数的结构体
+    struct Partitions;
+    static Partitions _partitions;
+};
+
+struct PageCache::Partitions{
+    PageCache nodes[MAX_NUMA_NODES];
+    constexpr Partitions() {}
 };
 
+inline PageCache* PageCache::GetInstance(){
+    return &_partitions.nodes[0];
+}
+
+inline PageCache* PageCache::GetInstance(size_t node){
+    assert(node < MAX_NUMA_NODES);
+    return &_partitions.nodes[node];
+}
+
+inline size_t PageCache::Node(){
+    return this - _partitions.nodes;
+}
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,107 @@
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+#include "my_common.h"
+#include <atomic>
+
+// 三层基数树, 负责 页号 -> Span* 的映射 (T 也可以是其他元数据, 如 hugepage 的占用记录)
+// 48 位地址空间, 页大小 4K, 页号共 36 位, 每层 12 位
+//
+// 写操作 (Ensure / Set) 由 PageCache 在持锁状态下完成
+// 读操作 (Get) 不加锁: 中间节点一旦分配就不再释放, 用 acquire/release 发布
+// 调用者只会查询自己持有的对象所在的页, 该页的映射在对象分配出去之前就已写好
+template <int BITS, class T = Span>
+class PageMap3 {
+private:
+    static const int INTERIOR_BITS = (BITS + 2) / 3;
+    static const size_t INTERIOR_LENGTH = (size_t)1 << INTERIOR_BITS;
+    static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
+    static const size_t LEAF_LENGTH = (size_t)1 << LEAF_BITS;
+
+    struct Leaf {
+        T* values[LEAF_LENGTH];
+    };
+
+    struct Node {
+        std::atomic<void*> ptrs[INTERIOR_LENGTH];
+    };
+
+    // 根节点常驻, 中间节点和叶子节点按需分配
+    Node _root;
+    // 分配清零的内存, 用于中间节点和叶子节点
+    void* (*_allocator)(size_t);
+
+    Node* NewNode(){
+        return (Node*)_allocator(sizeof(Node));
+    }
+
+    Leaf* NewLeaf(){
+        return (Leaf*)_allocator(sizeof(Leaf));
+    }
+
+public:
+    constexpr explicit PageMap3(void* (*allocator)(size_t)) : _root(), _allocator(allocator) {}
+
+    // 返回页号 k 对应的 Span, 未被管理的页返回 nullptr
+    T* Get(Page_ID k) const {
+        const size_t i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+        const size_t i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        const size_t i3 = k & (LEAF_LENGTH - 1);
+        if((k >> BITS) != 0)
+            return nullptr;
+
+        Node* n = (Node*)_root.ptrs[i1].load(std::memory_order_acquire);
+        if(n == nullptr)
+            return nullptr;
+        Leaf* leaf = (Leaf*)n -> ptrs[i2].load(std::memory_order_acquire);
+        if(leaf == nullptr)
+            return nullptr;
+        return leaf -> values[i3];
+    }
+
+    // 调用前必须保证 Ensure(k, 1) 成功
+    void Set(Page_ID k, T* v){
+        const size_t i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+        const size_t i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        const size_t i3 = k & (LEAF_LENGTH - 1);
+        Node* n = (Node*)_root.ptrs[i1].load(std::memory_order_relaxed);
+        Leaf* leaf = (Leaf*)n -> ptrs[i2].load(std::memory_order_relaxed);
+        leaf -> values[i3] = v;
+    }
+
+    // 将 [start, start + n) 这些页全部映射到 v
+    void SetRange(Page_ID start, size_t n, T* v){
+        for(Page_ID k = start; k != start + n; k++)
+            Set(k, v);
+    }
+
+    // 为 [start, start + n) 分配所需的中间节点和叶子节点
+    bool Ensure(Page_ID start, size_t n){
+        for(Page_ID key = start; key <= start + n - 1;){
+            const size_t i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+            const size_t i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+            if((key >> BITS) != 0)
+                return false;
+
+            Node* n1 = (Node*)_root.ptrs[i1].load(std::memory_order_relaxed);
+            if(n1 == nullptr){
+                n1 = NewNode();
+                if(n1 == nullptr)
+                    return false;
+                _root.ptrs[i1].store(n1, std::memory_order_release);
+            }
+
+            if(n1 -> ptrs[i2].load(std::memory_order_relaxed) == nullptr){
+                Leaf* leaf = NewLeaf();
+                if(leaf == nullptr)
+                    return false;
+                n1 -> ptrs[i2].store(leaf, std::memory_order_release);
+            }
+
+            // 跳到下一个叶子节点覆盖的范围
+            key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+        }
+        return true;
+    }
+};
+
+#endif
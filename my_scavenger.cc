@@ -0,0 +1,89 @@
+#include "my_scavenger.h"
+
+#include <algorithm>
+
+#include "my_page_cache.h"
+#include "my_thread_cache.h"
+
+Scavenger Scavenger::_instance;
+
+void Scavenger::Start(const ScavengerOptions& options) {
+    SetOptions(options);
+
+    std::lock_guard<std::mutex> lock(_thread_mutex);
+    if (_thread != nullptr) return;
+
+    for (size_t node = 0; node < NumaTopology::GetInstance()->NumNodes(); node++) {
+        PageCache::GetInstance(node)->SetReleaseOnFree(false);
+    }
+    _stop.store(false, std::memory_order_relaxed);
+    _thread = new std::thread(&Scavenger::Run, this);
+}
+
+void Scavenger::Stop() {
+    std::lock_guard<std::mutex> lock(_thread_mutex);
+    if (_thread == nullptr) return;
+
+    _stop.store(true, std::memory_order_relaxed);
+    _thread->join();
+    delete _thread;
+    _thread = nullptr;
+    for (size_t node = 0; node < NumaTopology::GetInstance()->NumNodes(); node++) {
+        PageCache::GetInstance(node)->SetReleaseOnFree(true);
+    }
+}
+
+bool Scavenger::Running() {
+    std::lock_guard<std::mutex> lock(_thread_mutex);
+    return _thread != nullptr;
+}
+
+void Scavenger::SetOptions(const ScavengerOptions& options) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _options = options;
+    if (_options.wakeup_interval_ms == 0) _options.wakeup_interval_ms = 1;
+}
+
+ScavengerOptions Scavenger::GetOptions() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _options;
+}
+
+size_t Scavenger::ScavengeOnce() {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    uint64_t now = NowNanos();
+    if (_last_scavenge == 0) _last_scavenge = now;
+
+    // 按流逝的时间累积额度, 最多攒下一秒的量 (至少能还一整块 chunk), 避免长时间空闲后突发大量 madvise
+    double elapsed = (now - _last_scavenge) / 1e9;
+    _last_scavenge = now;
+    size_t cap = std::max(_options.release_rate, (NPAGES - 1) << PAGE_SHIFT);
+    _budget = std::min(cap, _budget + (size_t)(_options.release_rate * elapsed));
+
+    uint64_t idle = (uint64_t)_options.idle_interval_ms * 1000000;
+    uint64_t idle_before = now > idle ? now - idle : 0;
+    // 闲置的线程不会自己取走远程释放栈中的对象, 先还给 CentralCache, 空出的 Span 才能在下面归还
+    ThreadCache::DrainIdleRemote(idle_before);
+    // 各个节点依次扫描, 共用归还额度, 保留量按节点计算
+    size_t released = 0;
+    for (size_t node = 0; node < NumaTopology::GetInstance()->NumNodes(); node++) {
+        released += PageCache::GetInstance(node)->ReleaseIdleSpans(
+            idle_before, (_budget >> PAGE_SHIFT) - std::min(released, _budget >> PAGE_SHIFT),
+            _options.keep_at_least >> PAGE_SHIFT);
+    }
+
+    size_t bytes = released << PAGE_SHIFT;
+    // 整个 hugepage 归还时可能略微超出额度
+    _budget -= std::min(_budget, bytes);
+    _released_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    return bytes;
+}
+
+void Scavenger::Run() {
+    while (!_stop.load(std::memory_order_relaxed)) {
+        size_t interval = GetOptions().wakeup_interval_ms;
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        ScavengeOnce();
+    }
+}
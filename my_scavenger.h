@@ -0,0 +1,61 @@
+#ifndef SCAVENGER_H
+#define SCAVENGER_H
+#include "my_common.h"
+#include <atomic>
+#include <thread>
+
+// 后台回收线程的参数
+struct ScavengerOptions{
+    size_t release_rate = 8 << 20;       // 每秒最多归还给系统的字节数
+    size_t keep_at_least = 0;            // 至少保留这么多字节仍占用物理内存的空闲页
+    size_t idle_interval_ms = 1000;      // Span 空闲超过这么久才会被归还
+    size_t wakeup_interval_ms = 100;     // 扫描周期
+};
+
+// 可选的后台回收线程
+// 周期性地收回闲置线程的远程释放栈, 扫描 PageCache 的空闲 Span, 把闲置足够久的物理页按限定的速率还给系统,
+// 使 madvise 不出现在 ConcurrentDealloc 的路径上
+class Scavenger{
+public:
+    Scavenger(const Scavenger&) = delete;
+    Scavenger& operator=(const Scavenger&) = delete;
+
+    static Scavenger* GetInstance(){
+        return &_instance;
+    }
+
+    // 启动后台线程, 已经在运行时只更新参数
+    void Start(const ScavengerOptions& options);
+    void Stop();
+    bool Running();
+
+    void SetOptions(const ScavengerOptions& options);
+    ScavengerOptions GetOptions();
+
+    // 执行一轮扫描, 返回本轮归还的字节数. 后台线程周期性调用, 也可以手动调用
+    size_t ScavengeOnce();
+
+    // 累计归还给系统的字节数
+    size_t ReleasedBytes(){
+        return _released_bytes.load(std::memory_order_relaxed);
+    }
+
+private:
+    constexpr Scavenger() {}
+
+    void Run();
+
+    std::mutex _mutex;                  // 保护 _options 和速率控制的状态
+    ScavengerOptions _options;
+    uint64_t _last_scavenge = 0;        // 上一轮扫描的时间
+    size_t _budget = 0;                 // 尚未用完的归还额度 (字节)
+
+    std::mutex _thread_mutex;           // 保护 _thread 的启动和停止
+    std::thread* _thread = nullptr;
+    std::atomic<bool> _stop{false};
+    std::atomic<size_t> _released_bytes{0};
+
+    static Scavenger _instance;
+};
+
+#endif
@@ -0,0 +1,142 @@
+// 根据实际的分配大小分布生成尺寸类别表
+//
+// 用法: ./size_class_gen [类别个数] < histogram.txt > my_size_classes_tuned.h
+// 输入每行一条记录 "大小 次数" (次数省略时为 1), 大于 MAX_BYTES 的请求不经过尺寸类别, 直接忽略
+// 类别个数默认与当前的表相同, 最多 255 个
+//
+// 在候选大小中选出给定个数的类别, 使 sum(次数 * (类别大小 - 请求大小)) 最小 (动态规划求精确解)
+// 候选大小: 8, 然后是 16 的倍数直到 1024 (作为 malloc 使用时要保证 16 字节对齐), 之后是 128 的倍数直到 MAX_BYTES
+// 只考虑对象内部的碎片, 不考虑 Span 尾部切不出一个对象的部分
+#include "my_common.h"
+
+#include <cstdio>
+#include <vector>
+
+static std::vector<size_t> Candidates()
+{
+	std::vector<size_t> candidates;
+	candidates.push_back(8);
+	for (size_t size = 16; size <= SIZE_CLASS_SMALL_MAX; size += 16)
+	{
+		candidates.push_back(size);
+	}
+	for (size_t size = SIZE_CLASS_SMALL_MAX + 128; size <= MAX_BYTES; size += 128)
+	{
+		candidates.push_back(size);
+	}
+	return candidates;
+}
+
+// 按 classes 分配时浪费的字节数
+static double Waste(const std::vector<double>& count, const std::vector<size_t>& classes)
+{
+	double waste = 0;
+	size_t cls = 0;
+	for (size_t size = 1; size <= MAX_BYTES; ++size)
+	{
+		while (classes[cls] < size)
+			cls++;
+		waste += count[size] * (classes[cls] - size);
+	}
+	return waste;
+}
+
+int main(int argc, char** argv)
+{
+	size_t num_classes = argc > 1 ? (size_t)atoi(argv[1]) : NLIST;
+	if (num_classes < 1 || num_classes > 255)
+	{
+		fprintf(stderr, "class count must be in [1, 255]\n");
+		return 1;
+	}
+
+	// count[s]: 大小为 s 的请求次数
+	std::vector<double> count(MAX_BYTES + 1, 0);
+	double requested = 0;
+	unsigned long long size, num;
+	char line[256];
+	while (fgets(line, sizeof(line), stdin) != nullptr)
+	{
+		int fields = sscanf(line, "%llu %llu", &size, &num);
+		if (fields < 1 || size == 0 || size > MAX_BYTES)
+			continue;
+		if (fields == 1)
+			num = 1;
+		count[size] += num;
+		requested += (double)size * num;
+	}
+	if (requested == 0)
+	{
+		fprintf(stderr, "empty histogram\n");
+		return 1;
+	}
+
+	// 前缀和, 区间 (a, b] 内的请求全部放进大小为 b 的类别时浪费 (C[b] - C[a]) * b - (S[b] - S[a])
+	std::vector<double> prefix_count(MAX_BYTES + 1, 0), prefix_bytes(MAX_BYTES + 1, 0);
+	for (size_t s = 1; s <= MAX_BYTES; ++s)
+	{
+		prefix_count[s] = prefix_count[s - 1] + count[s];
+		prefix_bytes[s] = prefix_bytes[s - 1] + count[s] * s;
+	}
+	auto cost = [&](size_t a, size_t b) {
+		return (prefix_count[b] - prefix_count[a]) * b - (prefix_bytes[b] - prefix_bytes[a]);
+	};
+
+	// dp[k][j]: 用 k + 1 个类别覆盖 (0, candidates[j]] 且最大的类别是 candidates[j] 时的最小浪费
+	std::vector<size_t> candidates = Candidates();
+	const size_t n = candidates.size();
+	if (num_classes > n)
+		num_classes = n;
+	const double inf = 1e300;
+	std::vector<std::vector<double>> dp(num_classes, std::vector<double>(n, inf));
+	std::vector<std::vector<size_t>> from(num_classes, std::vector<size_t>(n, 0));
+	for (size_t j = 0; j < n; ++j)
+	{
+		dp[0][j] = cost(0, candidates[j]);
+	}
+	for (size_t k = 1; k < num_classes; ++k)
+	{
+		for (size_t j = k; j < n; ++j)
+		{
+			for (size_t i = k - 1; i < j; ++i)
+			{
+				double value = dp[k - 1][i] + cost(candidates[i], candidates[j]);
+				if (value < dp[k][j])
+				{
+					dp[k][j] = value;
+					from[k][j] = i;
+				}
+			}
+		}
+	}
+
+	// 最后一个类别必须是 MAX_BYTES
+	std::vector<size_t> classes(num_classes);
+	size_t j = n - 1;
+	for (size_t k = num_classes; k-- > 0;)
+	{
+		classes[k] = candidates[j];
+		j = from[k][j];
+	}
+
+	std::vector<size_t> current(SIZE_CLASS_TABLE, SIZE_CLASS_TABLE + NLIST);
+	fprintf(stderr, "current table : %zu classes, internal fragmentation %.2f%%\n",
+		current.size(), 100 * Waste(count, current) / requested);
+	fprintf(stderr, "tuned table   : %zu classes, internal fragmentation %.2f%%\n",
+		classes.size(), 100 * Waste(count, classes) / requested);
+
+	printf("#ifndef SIZE_CLASSES_H\n#define SIZE_CLASSES_H\n#include <cstddef>\n\n");
+	printf("// 由 size_class_gen 根据分配大小分布生成\n");
+	printf("constexpr size_t SIZE_CLASS_TABLE[] = {\n");
+	for (size_t i = 0; i < classes.size(); i += 8)
+	{
+		printf("   ");
+		for (size_t k = i; k < classes.size() && k < i + 8; ++k)
+		{
+			printf(" %zu,", classes[k]);
+		}
+		printf("\n");
+	}
+	printf("};\n\n#endif\n");
+	return 0;
+}
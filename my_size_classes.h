@@ -0,0 +1,41 @@
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+#include <cstddef>
+
+// 默认的尺寸类别表, 内碎片控制在 12% 左右
+// [1,128]              8byte对齐
+// [129,1024]           16byte对齐
+// [1025,8*1024]        128byte对齐
+// [8*1024+1,64*1024]   1024byte对齐
+//
+// 可以用 size_class_gen 根据实际的分配大小分布生成新的表, 编译时通过
+// -DCONCURRENT_ALLOC_SIZE_CLASSES='"my_size_classes_tuned.h"' 替换这个文件
+// 要求: 升序, 8 的倍数, 大于 1024 的是 128 的倍数, 最后一个是 MAX_BYTES, 最多 255 个
+// 编译 libconcurrentalloc.so 时还要求 malloc 能用到的类别 (16 的倍数的请求落到的类别) 是 16 的倍数
+constexpr size_t SIZE_CLASS_TABLE[] = {
+    8, 16, 24, 32, 40, 48, 56, 64,
+    72, 80, 88, 96, 104, 112, 120, 128,
+    144, 160, 176, 192, 208, 224, 240, 256,
+    272, 288, 304, 320, 336, 352, 368, 384,
+    400, 416, 432, 448, 464, 480, 496, 512,
+    528, 544, 560, 576, 592, 608, 624, 640,
+    656, 672, 688, 704, 720, 736, 752, 768,
+    784, 800, 816, 832, 848, 864, 880, 896,
+    912, 928, 944, 960, 976, 992, 1008, 1024,
+    1152, 1280, 1408, 1536, 1664, 1792, 1920, 2048,
+    2176, 2304, 2432, 2560, 2688, 2816, 2944, 3072,
+    3200, 3328, 3456, 3584, 3712, 3840, 3968, 4096,
+    4224, 4352, 4480, 4608, 4736, 4864, 4992, 5120,
+    5248, 5376, 5504, 5632, 5760, 5888, 6016, 6144,
+    6272, 6400, 6528, 6656, 6784, 6912, 7040, 7168,
+    7296, 7424, 7552, 7680, 7808, 7936, 8064, 8192,
+    9216, 10240, 11264, 12288, 13312, 14336, 15360, 16384,
+    17408, 18432, 19456, 20480, 21504, 22528, 23552, 24576,
+    25600, 26624, 27648, 28672, 29696, 30720, 31744, 32768,
+    33792, 34816, 35840, 36864, 37888, 38912, 39936, 40960,
+    41984, 43008, 44032, 45056, 46080, 47104, 48128, 49152,
+    50176, 51200, 52224, 53248, 54272, 55296, 56320, 57344,
+    58368, 59392, 60416, 61440, 62464, 63488, 64512, 65536,
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "my_stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "my_central_cache.h"
+#include "my_cpu_cache.h"
+#include "my_heap.h"
+#include "my_page_cache.h"
+#include "my_thread_cache.h"
+#include "my_transfer_cache.h"
+
+void GetAllocatorStats(AllocatorStats* stats) {
+    *stats = AllocatorStats();
+    for (size_t i = 0; i < NLIST; i++) stats->size_classes[i].obj_size = SizeClass::Size(i);
+
+    ThreadCache::AddStats(stats);
+    CpuCache::GetInstance()->AddStats(stats);
+    Heap::AddStats(stats);
+    // 没有开启 NUMA 时其他分区都是空的, 一起统计也不影响结果
+    for (size_t node = 0; node < MAX_NUMA_NODES; node++) {
+        TransferCache::GetInstance(node)->AddStats(stats);
+        CentralCache::GetInstance(node)->AddStats(stats);
+        PageCache::GetInstance(node)->AddStats(stats);
+    }
+    stats->metadata_bytes = PageCache::GetInstance()->MetadataBytes();
+
+    // CentralCache 记下的是分出去的对象, 减去还在各级缓存中的才是使用者手里的
+    size_t small_span_bytes = 0;
+    size_t small_live_bytes = 0;
+    for (size_t i = 0; i < NLIST; i++) {
+        SizeClassStats& cls = stats->size_classes[i];
+        small_span_bytes += cls.live_bytes + cls.fragmented_bytes;
+        cls.live_bytes -= std::min(cls.live_bytes, cls.cached_bytes);
+        small_live_bytes += cls.live_bytes;
+    }
+
+    // 页堆分配出去的页中, 不属于小对象 Span 和堆的就是大对象
+    size_t idle = stats->page_heap_free_bytes + stats->page_heap_returned_bytes + stats->span_cache_bytes;
+    size_t in_use = stats->system_bytes - std::min(stats->system_bytes, idle);
+    stats->large_bytes = in_use - std::min(in_use, small_span_bytes + stats->heap_bytes);
+    stats->live_bytes = small_live_bytes + stats->large_bytes + stats->heap_bytes;
+}
+
+void FdPrint(int fd, const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len <= 0) return;
+    len = std::min<int>(len, sizeof(buf) - 1);
+    for (int done = 0; done < len;) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n <= 0) return;
+        done += n;
+    }
+}
+
+static double MiB(size_t bytes) {
+    return bytes / 1048576.0;
+}
+
+static void PrintBytes(int fd, const char* op, size_t bytes, const char* what) {
+    FdPrint(fd, "MALLOC: %s %15zu (%10.1f MiB) %s\n", op, bytes, MiB(bytes), what);
+}
+
+static void PrintTier(int fd, const char* name, const TierStats& tier) {
+    uint64_t total = tier.hits + tier.misses;
+    FdPrint(fd, "%-16s %15llu %15llu %9.2f%%\n", name, (unsigned long long)tier.hits,
+            (unsigned long long)tier.misses, total == 0 ? 0.0 : 100.0 * tier.hits / total);
+}
+
+void DumpStats(int fd) {
+    // 统计结构体约 10K, 放在栈上, 不分配内存
+    AllocatorStats stats;
+    GetAllocatorStats(&stats);
+
+    FdPrint(fd, "------------------------------------------------\n");
+    PrintBytes(fd, " ", stats.live_bytes, "Bytes in use by application");
+    PrintBytes(fd, "+", stats.thread_cache_bytes, "Bytes in thread cache freelists");
+    PrintBytes(fd, "+", stats.cpu_cache_bytes, "Bytes in per-CPU cache freelists");
+    PrintBytes(fd, "+", stats.transfer_cache_bytes, "Bytes in transfer cache freelists");
+    PrintBytes(fd, "+", stats.central_cache_bytes, "Bytes free in central cache spans");
+    PrintBytes(fd, "+", stats.span_cache_bytes, "Bytes in span cache");
+    PrintBytes(fd, "+", stats.page_heap_free_bytes, "Bytes in page heap freelist");
+    PrintBytes(fd, "+", stats.page_heap_returned_bytes, "Bytes released to OS");
+    FdPrint(fd, "MALLOC:   ------------\n");
+    PrintBytes(fd, "=", stats.system_bytes, "Bytes mapped from OS");
+    PrintBytes(fd, " ", stats.metadata_bytes, "Bytes in allocator metadata");
+    PrintBytes(fd, " ", stats.large_bytes, "Bytes in large objects (included above)");
+    PrintBytes(fd, " ", stats.heap_bytes, "Bytes in explicit heaps (included above)");
+
+    FdPrint(fd, "------------------------------------------------\n");
+    FdPrint(fd, "%-16s %15s %15s %10s\n", "tier", "hits", "misses", "hit rate");
+    PrintTier(fd, "front end", stats.front_end);
+    PrintTier(fd, "transfer cache", stats.transfer_cache);
+    PrintTier(fd, "central cache", stats.central_cache);
+    PrintTier(fd, "span cache", stats.span_cache);
+    PrintTier(fd, "page heap", stats.page_heap);
+
+    FdPrint(fd, "------------------------------------------------\n");
+    FdPrint(fd, "%5s %7s %8s %12s %12s %12s %15s\n", "class", "size", "spans", "live", "cached", "fragmented",
+            "allocs");
+    for (size_t i = 0; i < NLIST; i++) {
+        const SizeClassStats& cls = stats.size_classes[i];
+        if (cls.spans == 0 && cls.allocs == 0) continue;
+        FdPrint(fd, "%5zu %7zu %8zu %12zu %12zu %12zu %15llu\n", i, cls.obj_size, cls.spans, cls.live_bytes,
+                cls.cached_bytes, cls.fragmented_bytes, (unsigned long long)cls.allocs);
+    }
+
+    FdPrint(fd, "------------------------------------------------\n");
+    FdPrint(fd, "page heap free spans:\n");
+    for (size_t i = 1; i < NPAGES; i++) {
+        if (stats.free_spans[i] != 0) FdPrint(fd, "%6zu pages : %zu\n", i, stats.free_spans[i]);
+    }
+    if (stats.free_spans[NPAGES] != 0) FdPrint(fd, ">=%4zu pages : %zu\n", NPAGES, stats.free_spans[NPAGES]);
+    FdPrint(fd, "------------------------------------------------\n");
+}
@@ -0,0 +1,61 @@
+#ifndef STATS_H
+#define STATS_H
+#include "my_common.h"
+
+// 一个尺寸类别的统计, 单位为字节
+struct SizeClassStats{
+    size_t obj_size = 0;
+    size_t live_bytes = 0;         // 在使用者手里的对象
+    size_t cached_bytes = 0;       // 缓存在 ThreadCache / CpuCache / TransferCache 中的对象
+    size_t fragmented_bytes = 0;   // 类别持有的 Span 中没有分出去的部分 (空闲对象和尾部不足一个对象的零头)
+    size_t spans = 0;              // 类别持有的 Span 个数
+    uint64_t allocs = 0;           // 前端 (ThreadCache / CpuCache) 的分配次数
+};
+
+// 一层缓存的命中次数, 未命中时去下一层
+struct TierStats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// 整个分配器的统计, 由 GetAllocatorStats 汇总
+// 计数由各线程 / 各 CPU 各自累加, 汇总时才读取, 快速路径上没有原子操作.
+// 各部分不是在同一时刻读取的, 分配活跃时只是近似值
+struct AllocatorStats{
+    SizeClassStats size_classes[NLIST];
+
+    // 小对象依次经过 前端 -> TransferCache -> CentralCache (未命中时切分新 Span),
+    // Span 依次经过 小 Span 缓存 -> 全局页堆 (未命中时向系统映射)
+    TierStats front_end;
+    TierStats transfer_cache;
+    TierStats central_cache;
+    TierStats span_cache;
+    TierStats page_heap;
+
+    size_t live_bytes = 0;                 // 使用者手里的小对象和大对象
+    size_t large_bytes = 0;                // 其中的大对象 (按页计)
+    size_t heap_bytes = 0;                 // 其中显式的堆持有的 Span (整个 Span 都算作在使用)
+    size_t thread_cache_bytes = 0;
+    size_t cpu_cache_bytes = 0;
+    size_t transfer_cache_bytes = 0;
+    size_t central_cache_bytes = 0;        // 各类别的 fragmented_bytes 之和
+    size_t span_cache_bytes = 0;
+    size_t page_heap_free_bytes = 0;       // 空闲且仍占用物理内存
+    size_t page_heap_returned_bytes = 0;   // 空闲且已经还给系统
+    size_t system_bytes = 0;               // 从系统映射的字节数 (不含元数据)
+    size_t metadata_bytes = 0;
+
+    // 页堆中按页数统计的空闲 Span 个数 (含已经归还的), 最后一项是 NPAGES 页及以上的大 Span
+    size_t free_spans[NPAGES + 1] = {};
+};
+
+// 汇总所有分区和所有线程的统计. 会依次加各层的锁, 不要在快速路径上调用
+void GetAllocatorStats(AllocatorStats* stats);
+
+// 把统计以文本形式写到 fd, 类似 malloc_stats. 不分配内存, 替换 malloc 时也可以调用
+void DumpStats(int fd = 2);
+
+// 格式化到栈上的缓冲区 (一次最多 255 字节) 再 write 到 fd, 不经过 stdio 的缓冲区
+void FdPrint(int fd, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
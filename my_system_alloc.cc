@@ -0,0 +1,65 @@
+#include "my_system_alloc.h"
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <cstdint>
+
+void* SystemAlloc(size_t bytes, size_t align) {
+    assert(bytes % ((size_t)1 << PAGE_SHIFT) == 0);
+    assert(align % ((size_t)1 << PAGE_SHIFT) == 0);
+
+    // 多申请 align - 1 页, 再把首尾多余的部分解除映射, 得到对齐的地址
+    size_t extra = align - ((size_t)1 << PAGE_SHIFT);
+    void* ptr = mmap(nullptr, bytes + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return nullptr;
+
+    uintptr_t begin = (uintptr_t)ptr;
+    uintptr_t aligned = (begin + align - 1) & ~(uintptr_t)(align - 1);
+    if (aligned != begin) {
+        munmap(ptr, aligned - begin);
+    }
+    if (aligned + bytes != begin + bytes + extra) {
+        munmap((void*)(aligned + bytes), begin + extra - aligned);
+    }
+    return (void*)aligned;
+}
+
+void SystemFree(void* ptr, size_t bytes) {
+    munmap(ptr, bytes);
+}
+
+bool SystemRelease(void* ptr, size_t bytes) {
+#if defined(CONCURRENT_ALLOC_MADV_FREE) && defined(MADV_FREE)
+    // MADV_FREE 更便宜, 但物理页只在内存紧张时才会被内核回收, RSS 不会立刻下降
+    int advice = MADV_FREE;
+#else
+    int advice = MADV_DONTNEED;
+#endif
+    int ret;
+    do {
+        ret = madvise(ptr, bytes, advice);
+    } while (ret == -1 && errno == EAGAIN);
+    return ret == 0;
+}
+
+bool SystemRemap(void* old_ptr, size_t bytes, void* new_ptr) {
+#ifdef MREMAP_DONTUNMAP
+    // 旧地址不解除映射, 页堆中不会出现空洞; 新地址上原有的映射被替换
+    void* ret = mremap(old_ptr, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, new_ptr);
+    return ret != MAP_FAILED;
+#else
+    (void)old_ptr;
+    (void)bytes;
+    (void)new_ptr;
+    return false;
+#endif
+}
+
+void SystemHugePage(void* ptr, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, bytes, MADV_HUGEPAGE);
+#else
+    (void)ptr;
+    (void)bytes;
+#endif
+}
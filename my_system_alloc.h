@@ -0,0 +1,28 @@
+#ifndef SYSTEM_ALLOC_H
+#define SYSTEM_ALLOC_H
+#include "my_common.h"
+
+// 直接向操作系统申请 / 归还内存, PageCache 的最底层
+// 所有函数都不会调用 malloc, 可以在分配器内部任意位置使用
+
+// 申请 bytes 字节的匿名内存, 起始地址按 align 对齐 (align 必须是页大小的整数倍)
+// 返回的内存已清零, 失败时返回 nullptr
+void* SystemAlloc(size_t bytes, size_t align = (size_t)1 << PAGE_SHIFT);
+
+// 解除映射, 整段地址空间还给系统
+void SystemFree(void* ptr, size_t bytes);
+
+// 保留虚拟地址, 只把物理页还给系统 (madvise)
+// 之后再次访问这段内存会重新缺页, 读到的是全零页. 定义了 CONCURRENT_ALLOC_MADV_FREE 时使用 MADV_FREE,
+// 内核还没回收的页保留原来的内容, 不能假设读到零
+bool SystemRelease(void* ptr, size_t bytes);
+
+// 把 [old_ptr, old_ptr + bytes) 的物理页移到 new_ptr (已经映射, 至少 bytes 字节), 不拷贝数据 (mremap)
+// 原来的地址保留映射, 之后访问读到的是全零页. 内核不支持 MREMAP_DONTUNMAP
+// 或者原来的范围跨越多个映射时返回 false, 两段内存都不变
+bool SystemRemap(void* old_ptr, size_t bytes, void* new_ptr);
+
+// 建议内核用透明大页 (THP) 映射这段内存, 内核不支持时什么也不做
+void SystemHugePage(void* ptr, size_t bytes);
+
+#endif
@@ -3,57 +3,540 @@
 #include <algorithm>
 
 #include "my_central_cache.h"
+#include "my_object_pool.h"
+#include "my_page_cache.h"
+#include "my_stats.h"
+#include "my_transfer_cache.h"
+
+__thread ThreadCache* thread_local_cache __attribute__((tls_model("initial-exec"))) = nullptr;
+
+// ThreadCache 对象本身也从对象池中分配和回收, 不走 new / delete
+static ObjectPool<ThreadCache> thread_cache_pool(PageCache::MetadataAlloc);
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+// 以下变量由 thread_cache_mutex 保护
+static std::mutex thread_cache_mutex;
+static ThreadCache* thread_cache_list = nullptr;     // 所有存活的 ThreadCache
+static ThreadCache* next_memory_steal = nullptr;    // 轮流偷取额度的下一个候选
+static size_t thread_cache_count = 0;
+static size_t overall_thread_cache_size = OVERALL_THREAD_CACHE_SIZE;
+// 全局预算中还没有分给任何线程的部分, 线程多时可能为负
+static long long unclaimed_cache_space = OVERALL_THREAD_CACHE_SIZE;
+// 已经退出的线程的分配计数
+static uint64_t retired_allocs[NLIST];
+static uint64_t retired_misses[NLIST];
+static uint64_t retired_remote_pushed[NLIST];
+static uint64_t retired_remote_taken[NLIST];
+// 其他线程从闲置线程的远程释放栈中收回的对象数
+static uint64_t drained_remote[NLIST];
+// 已经退出的线程留下的 ThreadCache, 不还给对象池: 其他线程可能还拿着过期的 span->owner
+// 对它的远程释放栈做 CAS, 重新构造会用非原子的写覆盖这些字段. 复用时由 Reset 逐个原子地重新打开
+static ThreadCache* retired_caches = nullptr;
+
+// 线程退出后远程释放栈的栈顶, 之后的压入都会失败
+static void* const REMOTE_FREE_CLOSED = (void*)1;
+
+void ThreadCache::InitKey() {
+    pthread_key_create(&thread_cache_key, DestroyCache);
+}
+
+ThreadCache* ThreadCache::CreateCache() {
+    pthread_once(&thread_cache_key_once, InitKey);
+
+    ThreadCache* cache = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(thread_cache_mutex);
+        if (retired_caches != nullptr) {
+            cache = retired_caches;
+            retired_caches = cache->_next;
+        }
+    }
+    if (cache == nullptr) {
+        cache = thread_cache_pool.New();
+    } else {
+        cache->Reset();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(thread_cache_mutex);
+        // 新线程先拿最小额度, 之后靠 IncreaseCacheLimit 从别处拿
+        // 全局预算不够时从额度富余的线程收回, 使总额不超过预算 (除非每个线程都只剩最小额度)
+        cache->_max_size.store(MIN_THREAD_CACHE_SIZE, std::memory_order_relaxed);
+        unclaimed_cache_space -= MIN_THREAD_CACHE_SIZE;
+        for (ThreadCache* other = thread_cache_list; other != nullptr && unclaimed_cache_space < 0;
+             other = other->_next) {
+            size_t other_max = other->_max_size.load(std::memory_order_relaxed);
+            if (other_max <= MIN_THREAD_CACHE_SIZE) continue;
+            size_t amount = std::min<size_t>(other_max - MIN_THREAD_CACHE_SIZE, -unclaimed_cache_space);
+            other->_max_size.fetch_sub(amount, std::memory_order_relaxed);
+            unclaimed_cache_space += amount;
+        }
+
+        cache->_next = thread_cache_list;
+        if (thread_cache_list != nullptr) thread_cache_list->_prev = cache;
+        thread_cache_list = cache;
+        thread_cache_count++;
+    }
+
+    // 先设置 TLS 再注册析构, 这样 pthread_setspecific 内部即使分配内存也能找到 cache
+    thread_local_cache = cache;
+    pthread_setspecific(thread_cache_key, cache);
+    return cache;
+}
+
+void ThreadCache::DestroyCache(void* ptr) {
+    ThreadCache* cache = (ThreadCache*)ptr;
+    // 之后同一线程中其他 TLS 的析构函数若再分配内存, 会重新创建 ThreadCache
+    // 并再次注册析构, pthread 会在下一轮把它回收
+    thread_local_cache = nullptr;
+    cache->ReleaseAll();
+    {
+        std::lock_guard<std::mutex> lock(thread_cache_mutex);
+        unclaimed_cache_space += cache->_max_size.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < NLIST; i++) {
+            retired_allocs[i] += cache->_allocs[i];
+            retired_misses[i] += cache->_misses[i];
+            retired_remote_pushed[i] += cache->_remote_pushed[i];
+            retired_remote_taken[i] += cache->_remote_taken[i];
+        }
+
+        if (next_memory_steal == cache) next_memory_steal = cache->_next;
+        if (cache->_prev != nullptr) cache->_prev->_next = cache->_next;
+        if (cache->_next != nullptr) cache->_next->_prev = cache->_prev;
+        if (thread_cache_list == cache) thread_cache_list = cache->_next;
+        thread_cache_count--;
+
+        cache->_next = retired_caches;
+        retired_caches = cache;
+    }
+}
+
+void ThreadCache::Reset() {
+    for (size_t i = 0; i < NLIST; i++) {
+        _free_list[i] = FreeList();
+        _allocs[i] = _misses[i] = 0;
+        _remote_pushed[i] = _remote_taken[i] = 0;
+    }
+    _size.store(0, std::memory_order_relaxed);
+    _max_size.store(0, std::memory_order_relaxed);
+    _last_active.store(0, std::memory_order_relaxed);
+    _next = _prev = nullptr;
+    // 重新打开远程释放栈, 之后拿着过期 owner 的线程会把对象压给新的线程
+    // _remote_bytes 不清零: 关闭时已经全部取走, 压入失败的线程会把自己加上的减回去
+    for (size_t i = 0; i < NLIST; i++) {
+        _remote_free[i].store(nullptr, std::memory_order_release);
+    }
+}
+
+void ThreadCache::ReleaseAll() {
+    for (size_t i = 0; i < NLIST; i++) {
+        FreeList& free_list = _free_list[i];
+        // 关闭远程释放栈, 已经压入的对象和自由链表一起还回去
+        void *start = nullptr, *end = nullptr;
+        size_t n = TakeRemote(i, start, end, true);
+        if (n > 0) {
+            free_list.PushRange(start, end, n);
+            AddSize(n * SizeClass::Size(i));
+        }
+        if (free_list.Empty()) continue;
+
+        ReleaseToCentralCache(&free_list, free_list.Size());
+    }
+}
+
+void ThreadCache::ReleaseToCentralCache(FreeList* list, size_t n) {
+    Span* span = PageCache::GetInstance()->MapObjectToSpan(list->Front());
+    SubSize(n * span->obj_size);
+    ReturnToCentralCache(list, n, span->obj_size, span->node);
+}
+
+void ThreadCache::ReturnToCentralCache(FreeList* list, size_t n, size_t obj_size, size_t node) {
+    // 整批的对象先放进 TransferCache, 放不下或者不满一批的才交给 CentralCache
+    // NUMA 模式下每批按第一个对象所属的节点归还 (线程换过节点时链表中会混有多个节点的对象),
+    // 混有其他节点对象的批次 TransferCache 不接受, 由 CentralCache 把它们交给各自的分区
+    bool numa = NumaTopology::GetInstance()->Enabled();
+    size_t batch_size = SizeClass::NumMoveObjs(obj_size);
+    void *start = nullptr, *end = nullptr;
+    while (n > 0) {
+        size_t num = std::min(n, batch_size);
+        list->PopRange(start, end, num);
+        n -= num;
+        if (numa) node = PageCache::GetInstance()->MapObjectToSpan(start)->node;
+        if (num == batch_size && TransferCache::GetInstance(node)->InsertRange(obj_size, start, end, num)) continue;
+        CentralCache::GetInstance(node)->ReleaseListToSpans(start, obj_size);
+    }
+}
+
+void ThreadCache::ReturnDrained(FreeList* lists) {
+    for (size_t i = 0; i < NLIST; i++) {
+        if (lists[i].Empty()) continue;
+        size_t node = PageCache::GetInstance()->MapObjectToSpan(lists[i].Front())->node;
+        ReturnToCentralCache(&lists[i], lists[i].Size(), SizeClass::Size(i), node);
+    }
+}
+
+void ThreadCache::Scavenge() {
+    for (size_t i = 0; i < NLIST; i++) {
+        FreeList& free_list = _free_list[i];
+        // 远程释放的对象也算作本线程的缓存, 一起收缩
+        void *start = nullptr, *end = nullptr;
+        size_t n = TakeRemote(i, start, end);
+        if (n > 0) {
+            free_list.PushRange(start, end, n);
+            AddSize(n * SizeClass::Size(i));
+        }
+        if (free_list.Empty()) continue;
+
+        ReleaseToCentralCache(&free_list, (free_list.Size() + 1) / 2);
+        free_list.SetMaxSize(std::max<size_t>(1, free_list.MaxSize() / 2));
+    }
+    FreeList drained[NLIST];
+    IncreaseCacheLimit(drained);
+    ReturnDrained(drained);
+
+    // 没拿到足够的额度时继续收缩, 保证本线程返回时不超过上限, 闲置之后也不会占着多余的对象
+    // 上限可能被调小到远程释放栈已有的对象之下, 栈也一起收回; 一整轮都没有可还的对象时停止
+    for (bool progress = true; progress && OverLimit();) {
+        progress = false;
+        for (size_t i = 0; i < NLIST && OverLimit(); i++) {
+            FreeList& free_list = _free_list[i];
+            void *start = nullptr, *end = nullptr;
+            size_t n = TakeRemote(i, start, end);
+            if (n > 0) {
+                free_list.PushRange(start, end, n);
+                AddSize(n * SizeClass::Size(i));
+            }
+            if (free_list.Empty()) continue;
+            ReleaseToCentralCache(&free_list, (free_list.Size() + 1) / 2);
+            progress = true;
+        }
+    }
+}
+
+void ThreadCache::IncreaseCacheLimit(FreeList* drained) {
+    std::lock_guard<std::mutex> lock(thread_cache_mutex);
+    if (_max_size.load(std::memory_order_relaxed) >= MAX_THREAD_CACHE_SIZE) return;
+
+    if (unclaimed_cache_space > 0) {
+        size_t amount = std::min<size_t>(THREAD_CACHE_STEAL_AMOUNT, unclaimed_cache_space);
+        unclaimed_cache_space -= amount;
+        _max_size.fetch_add(amount, std::memory_order_relaxed);
+        return;
+    }
+
+    // 全局预算已经分完, 从其他线程那里偷
+    // 轮流检查若干个候选, 挑最久没有向 CentralCache 取过对象的, 即最闲的线程
+    // 只偷上限中没有用到的部分: 缓存只能由所属线程收缩, 闲置的线程被偷走已经缓存的部分后
+    // 要等它下一次操作才会归还, 这期间所有线程实际缓存的字节数就会超出全局预算
+    // 闲置线程的远程释放栈例外, 其他线程也能取走, 先收回到 drained 中, 让出它占着的额度
+    uint64_t now = NowNanos();
+    ThreadCache* victim = nullptr;
+    for (size_t i = 0; i < 10 && i < thread_cache_count; i++) {
+        if (next_memory_steal == nullptr) next_memory_steal = thread_cache_list;
+        ThreadCache* cache = next_memory_steal;
+        next_memory_steal = cache->_next;
+        if (cache == this) continue;
+        if (cache->_last_active.load(std::memory_order_relaxed) + THREAD_CACHE_IDLE_NANOS < now)
+            cache->DrainRemote(drained);
+
+        size_t max_size = cache->_max_size.load(std::memory_order_relaxed);
+        size_t size = cache->_size.load(std::memory_order_relaxed) + cache->_remote_bytes.load(std::memory_order_relaxed);
+        if (max_size < MIN_THREAD_CACHE_SIZE + THREAD_CACHE_STEAL_AMOUNT || max_size < size + THREAD_CACHE_STEAL_AMOUNT)
+            continue;
+        if (victim == nullptr || cache->_last_active.load(std::memory_order_relaxed) < victim->_last_active.load(std::memory_order_relaxed))
+            victim = cache;
+    }
+
+    if (victim != nullptr) {
+        victim->_max_size.fetch_sub(THREAD_CACHE_STEAL_AMOUNT, std::memory_order_relaxed);
+        _max_size.fetch_add(THREAD_CACHE_STEAL_AMOUNT, std::memory_order_relaxed);
+    }
+}
+
+void ThreadCache::SetOverallThreadCacheSize(size_t bytes) {
+    std::lock_guard<std::mutex> lock(thread_cache_mutex);
+    overall_thread_cache_size = bytes;
+
+    // 平均分给现有的线程, 各线程在下一次操作时按新的上限收缩
+    size_t space = bytes / std::max<size_t>(1, thread_cache_count);
+    space = std::min(MAX_THREAD_CACHE_SIZE, std::max(MIN_THREAD_CACHE_SIZE, space));
+
+    long long claimed = 0;
+    for (ThreadCache* cache = thread_cache_list; cache != nullptr; cache = cache->_next) {
+        cache->_max_size.store(space, std::memory_order_relaxed);
+        claimed += space;
+    }
+    unclaimed_cache_space = (long long)bytes - claimed;
+}
+
+size_t ThreadCache::GetOverallThreadCacheSize() {
+    std::lock_guard<std::mutex> lock(thread_cache_mutex);
+    return overall_thread_cache_size;
+}
+
+size_t ThreadCache::TotalCachedBytes() {
+    std::lock_guard<std::mutex> lock(thread_cache_mutex);
+    size_t total = 0;
+    for (ThreadCache* cache = thread_cache_list; cache != nullptr; cache = cache->_next) {
+        total += cache->_size.load(std::memory_order_relaxed) + cache->_remote_bytes.load(std::memory_order_relaxed);
+    }
+    return total;
+}
 
 // Allocate 负责小对象的内存分配
 void* ThreadCache::Allocate(size_t bytes) {
     assert(bytes <= 64 * 1024);
 
     size_t index = SizeClass::Index(bytes);
+    StatAdd(_allocs[index]);
     FreeList& free_list = _free_list[index];
     if (free_list.Empty() == false) {
+        SubSize(SizeClass::Size(index));
         return free_list.Pop();
     } else {
         // std::cout << "Now is entering FetchFrom CentralCache " << std::endl;
-        return FetchFromCentralCache(index, SizeClass::RoundUp(bytes));
+        return FetchFromCentralCache(index, SizeClass::Size(index));
     }
 }
 
-// Deallocate 负责回收小对象
-void ThreadCache::Deallocate(size_t bytes, void* ptr) {
-    assert(bytes <= 64 * 1024);
+// Deallocate 负责回收小对象, index 为对象所在 Span 记录的尺寸类别
+void ThreadCache::Deallocate(void* ptr, size_t index) {
+    assert(index < NLIST);
 
-    size_t index = SizeClass::Index(bytes);
+    size_t obj_size = SizeClass::Size(index);
     FreeList& free_list = _free_list[index];
     free_list.Push(ptr);
+    AddSize(obj_size);
 
     if (free_list.Size() >= free_list.MaxSize()) {
-        ListTooLong(&free_list, SizeClass::RoundUp(bytes));
+        ListTooLong(&free_list, obj_size);
+    }
+
+    // 整个线程缓存超出上限 (可能是额度被其他线程偷走了)
+    if (OverLimit()) {
+        Scavenge();
+    }
+}
+
+void ThreadCache::DeallocateRange(void** ptrs, size_t n, size_t index) {
+    assert(index < NLIST && n > 0);
+
+    size_t obj_size = SizeClass::Size(index);
+    FreeList& free_list = _free_list[index];
+    for (size_t i = 1; i < n; i++) NextObj(ptrs[i - 1]) = ptrs[i];
+    free_list.PushRange(ptrs[0], ptrs[n - 1], n);
+    AddSize(n * obj_size);
+
+    while (free_list.Size() >= free_list.MaxSize()) {
+        ListTooLong(&free_list, obj_size);
+    }
+    if (OverLimit()) {
+        Scavenge();
     }
 }
 
 // 当自由链表很长时, 让 Central Cache 回收
 void ThreadCache::ListTooLong(FreeList* list, size_t obj_size) {
-    void* start = list->PopRange();
-    return CentralCache::GetInstance()->ReleaseListToSpans(start, obj_size);
+    // 每次最多还一批, 让自由链表的上限倍增到一批的大小,
+    // 这样只释放不分配的线程 (如生产者-消费者中的消费者) 也能整批地交给 TransferCache
+    size_t batch_size = SizeClass::NumMoveObjs(obj_size);
+    ReleaseToCentralCache(list, std::min(list->Size(), batch_size));
+
+    if (list->MaxSize() < batch_size) {
+        list->SetMaxSize(std::min(batch_size, 2 * list->MaxSize()));
+    }
+}
+
+bool ThreadCache::PushRemote(void* ptr, size_t index) {
+    // 所属线程的缓存已满时不压入, 由释放的线程放进自己的缓存
+    size_t obj_size = SizeClass::Size(index);
+    if (_size.load(std::memory_order_relaxed) + _remote_bytes.load(std::memory_order_relaxed) + obj_size >
+        _max_size.load(std::memory_order_relaxed))
+        return false;
+    // 先计数再压入, 取走对象的线程减去计数时一定能看到这里加上的
+    _remote_bytes.fetch_add(obj_size, std::memory_order_relaxed);
+
+    std::atomic<void*>& head = _remote_free[index];
+    void* old = head.load(std::memory_order_relaxed);
+    do {
+        if (old == REMOTE_FREE_CLOSED) {
+            _remote_bytes.fetch_sub(obj_size, std::memory_order_relaxed);
+            return false;
+        }
+        NextObj(ptr) = old;
+    } while (!head.compare_exchange_weak(old, ptr, std::memory_order_release, std::memory_order_relaxed));
+    return true;
+}
+
+size_t ThreadCache::PopRemote(size_t index, void*& start, void*& end, bool close) {
+    std::atomic<void*>& head = _remote_free[index];
+    void* replace = close ? REMOTE_FREE_CLOSED : nullptr;
+    // 没有对象时不写共享的缓存行; 收回闲置线程的栈时它可能正在退出, 已经关闭的栈不能重新打开
+    start = head.load(std::memory_order_relaxed);
+    do {
+        if (start == REMOTE_FREE_CLOSED || start == replace) return 0;
+    } while (!head.compare_exchange_weak(start, replace, std::memory_order_acquire, std::memory_order_relaxed));
+    if (start == nullptr) return 0;
+
+    size_t n = 1;
+    end = start;
+    while (NextObj(end) != nullptr) {
+        end = NextObj(end);
+        n++;
+    }
+    _remote_bytes.fetch_sub(n * SizeClass::Size(index), std::memory_order_relaxed);
+    return n;
+}
+
+size_t ThreadCache::TakeRemote(size_t index, void*& start, void*& end, bool close) {
+    size_t n = PopRemote(index, start, end, close);
+    if (n > 0) StatAdd(_remote_taken[index], n);
+    return n;
+}
+
+size_t ThreadCache::DrainRemote(FreeList* lists) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < NLIST; i++) {
+        void *start = nullptr, *end = nullptr;
+        size_t n = PopRemote(i, start, end);
+        if (n == 0) continue;
+        lists[i].PushRange(start, end, n);
+        drained_remote[i] += n;
+        bytes += n * SizeClass::Size(i);
+    }
+    return bytes;
+}
+
+size_t ThreadCache::DrainIdleRemote(uint64_t idle_before) {
+    FreeList drained[NLIST];
+    size_t bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(thread_cache_mutex);
+        for (ThreadCache* cache = thread_cache_list; cache != nullptr; cache = cache->_next) {
+            if (cache->_last_active.load(std::memory_order_relaxed) < idle_before) bytes += cache->DrainRemote(drained);
+        }
+    }
+    ReturnDrained(drained);
+    return bytes;
 }
 
 void* ThreadCache::FetchFromCentralCache(size_t index, size_t obj_size) {
     FreeList& free_list = _free_list[index];
+    StatAdd(_misses[index]);
+
+    // 先收回其他线程释放的本线程的对象, 不加任何锁
+    void *remote = nullptr, *remote_end = nullptr;
+    size_t remote_num = TakeRemote(index, remote, remote_end);
+    if (remote_num > 0) {
+        if (remote_num > 1) free_list.PushRange(NextObj(remote), remote_end, remote_num - 1);
+        AddSize((remote_num - 1) * obj_size);
+        if (OverLimit()) Scavenge();
+        return remote;
+    }
 
     size_t obj_num = std::min(SizeClass::NumMoveObjs(obj_size), 2 * free_list.MaxSize());
 
     void *begin = nullptr, *end = nullptr;
-    // std::cout << "Now is entering FetchRangeObj" << std::endl;
-    size_t batch_size = CentralCache::GetInstance()->FetchRangeObj(begin, end, obj_num, obj_size);
-
+    size_t batch_size = FetchRange(obj_size, obj_num, begin, end);
     if (batch_size > 1) {
         free_list.PushRange(NextObj(begin), end, batch_size - 1);
     }
+    AddSize((batch_size - 1) * obj_size);
 
     if (batch_size > free_list.MaxSize()) {
         free_list.SetMaxSize(batch_size);
     }
 
+    // 闲置的线程被偷走额度后, 在这里把多余的对象还回去
+    if (OverLimit()) {
+        Scavenge();
+    }
+
     // std::cout << "Now is quitting FetchFromCentralCache! " << std::endl;
     return begin;
-}
\ No newline at end of file
+}
+
+size_t ThreadCache::FetchRange(size_t obj_size, size_t n, void*& begin, void*& end) {
+    // 先从 TransferCache 拿其他线程归还的整批对象, 没有再去 CentralCache, 都在当前线程所在节点的分区
+    size_t node = NumaTopology::GetInstance()->CurrentNode();
+    size_t batch_size = TransferCache::GetInstance(node)->RemoveRange(obj_size, begin, end, n);
+    if (batch_size == 0) {
+        // std::cout << "Now is entering FetchRangeObj" << std::endl;
+        batch_size = CentralCache::GetInstance(node)->FetchRangeObj(begin, end, n, obj_size);
+    }
+    _last_active.store(NowNanos(), std::memory_order_relaxed);
+    // 之后其他线程释放这个 Span 的对象时还给当前线程
+    __atomic_store_n(&PageCache::GetInstance()->MapObjectToSpan(begin)->owner, this, __ATOMIC_RELAXED);
+    return batch_size;
+}
+
+void ThreadCache::AllocateBatch(size_t index, size_t n, void** out) {
+    size_t obj_size = SizeClass::Size(index);
+    FreeList& free_list = _free_list[index];
+    StatAdd(_allocs[index], n);
+
+    // 整段摘下自由链表的头部, 写 out 时不用再读写链表
+    size_t i = 0;
+    void *cur = nullptr, *end = nullptr;
+    size_t local_num = std::min(n, free_list.Size());
+    if (local_num > 0) {
+        free_list.PopRange(cur, end, local_num);
+        for (; i < local_num; i++, cur = NextObj(cur)) out[i] = cur;
+        SubSize(local_num * obj_size);
+    }
+    if (i == n) return;
+    StatAdd(_misses[index]);
+
+    // 先用其他线程释放的本线程的对象, 用不完的放进自由链表
+    size_t remote_num = TakeRemote(index, cur, end);
+    for (; remote_num > 0 && i < n; remote_num--, cur = NextObj(cur)) out[i++] = cur;
+    if (remote_num > 0) {
+        free_list.PushRange(cur, end, remote_num);
+        AddSize(remote_num * obj_size);
+        if (OverLimit()) Scavenge();
+    }
+
+    // 剩下的整批从 TransferCache / CentralCache 取, 直接写进 out, 不经过自由链表
+    while (i < n) {
+        size_t batch_size = FetchRange(obj_size, std::min(n - i, SizeClass::NumMoveObjs(obj_size)), cur, end);
+        for (; batch_size > 0; batch_size--, cur = NextObj(cur)) out[i++] = cur;
+    }
+}
+
+size_t ThreadCache::TotalCacheLimit() {
+    std::lock_guard<std::mutex> lock(thread_cache_mutex);
+    size_t total = 0;
+    for (ThreadCache* cache = thread_cache_list; cache != nullptr; cache = cache->_next) {
+        total += cache->_max_size.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void ThreadCache::AddStats(AllocatorStats* stats) {
+    std::lock_guard<std::mutex> lock(thread_cache_mutex);
+    for (size_t i = 0; i < NLIST; i++) {
+        uint64_t allocs = retired_allocs[i];
+        uint64_t misses = retired_misses[i];
+        uint64_t pushed = retired_remote_pushed[i];
+        uint64_t taken = retired_remote_taken[i] + drained_remote[i];
+        size_t cached = 0;
+        // 不加锁读取其他线程的计数和链表长度, 只是近似值
+        for (ThreadCache* cache = thread_cache_list; cache != nullptr; cache = cache->_next) {
+            allocs += StatRead(cache->_allocs[i]);
+            misses += StatRead(cache->_misses[i]);
+            pushed += StatRead(cache->_remote_pushed[i]);
+            taken += StatRead(cache->_remote_taken[i]);
+            cached += cache->_free_list[i].Size() * SizeClass::Size(i);
+        }
+        // 两个计数读取的时刻不同, 未命中次数可能比分配次数多读到一些
+        misses = std::min(misses, allocs);
+        // 还在远程释放栈中的对象也算作线程缓存
+        if (pushed > taken) cached += (pushed - taken) * SizeClass::Size(i);
+        stats->size_classes[i].allocs += allocs;
+        stats->size_classes[i].cached_bytes += cached;
+        stats->front_end.hits += allocs - misses;
+        stats->front_end.misses += misses;
+        stats->thread_cache_bytes += cached;
+    }
+}
@@ -3,18 +3,143 @@
 #include "my_common.h"
 #include <unistd.h>
 #include<pthread.h>
-// TLS
-// __thread ThreadCache memory_allocator;
+#include <atomic>
+
+class ThreadCache;
+struct AllocatorStats;
+
+// TLS, 每个线程独有的 ThreadCache
+// 使用 initial-exec 模型: 编译成共享库时, 默认的 global-dynamic 模型第一次访问会调用 __tls_get_addr,
+// 它可能调用 malloc, 替换 malloc 时就会递归
+extern __thread ThreadCache* thread_local_cache __attribute__((tls_model("initial-exec")));
+
+// 所有线程缓存的总大小默认上限
+const size_t OVERALL_THREAD_CACHE_SIZE = 32 << 20;
+// 单个线程缓存大小的上下限
+const size_t MIN_THREAD_CACHE_SIZE = 2 * MAX_BYTES;
+const size_t MAX_THREAD_CACHE_SIZE = 4 << 20;
+// 线程缓存不够用时, 每次从全局预算或其他线程那里拿走的大小
+const size_t THREAD_CACHE_STEAL_AMOUNT = 64 << 10;
+// 超过这么久没有向 CentralCache 取对象的线程视为闲置, 偷取额度时顺便收回它远程释放栈中的对象
+const uint64_t THREAD_CACHE_IDLE_NANOS = 1000000000;
+
 class ThreadCache{
 public:
     FreeList _free_list[NLIST];
 
     void* Allocate(size_t bytes);
-    void Deallocate(size_t bytes, void* ptr);
+    // 分配 n 个第 index 类的对象写进 out, 自由链表不够时整批地从中心缓存取
+    void AllocateBatch(size_t index, size_t n, void** out);
+    void Deallocate(void* ptr, size_t index);
+    // 回收 ptrs 中的 n 个第 index 类的对象, 只在最后检查一次链表和缓存的上限
+    void DeallocateRange(void** ptrs, size_t n, size_t index);
     void* FetchFromCentralCache(size_t index, size_t obj_size);
     void ListTooLong(FreeList* list, size_t obj_size);
-};
 
-static __thread  ThreadCache* thread_local_cache = nullptr;
+    // 释放其他线程的对象: span 属于其他存活的线程且它的缓存没有超出上限时, 压入它的远程释放栈, 返回 true;
+    // 否则返回 false, 调用者放进自己的缓存, 计入自己的上限
+    bool FreeToOwner(void* ptr, size_t index, Span* span){
+        ThreadCache* owner = __atomic_load_n(&span -> owner, __ATOMIC_RELAXED);
+        if(owner == this || owner == nullptr || !owner -> PushRemote(ptr, index))
+            return false;
+        StatAdd(_remote_pushed[index]);
+        return true;
+    }
+    // span 是否记为属于其他线程 (该线程可能已经退出)
+    bool OwnedByOther(Span* span){
+        ThreadCache* owner = __atomic_load_n(&span -> owner, __ATOMIC_RELAXED);
+        return owner != this && owner != nullptr;
+    }
+
+    // 所有线程缓存加起来最多缓存多少字节, 运行时可调
+    // 调小能减少闲置在线程缓存中的内存, 调大能减少访问 CentralCache 的次数
+    static void SetOverallThreadCacheSize(size_t bytes);
+    static size_t GetOverallThreadCacheSize();
+    // 当前所有线程缓存中的对象总字节数, 含远程释放栈 (持锁遍历线程, 各线程的计数在变化, 只是近似值)
+    static size_t TotalCachedBytes();
+    // 收回 idle_before 之后没有向 CentralCache 取过对象的线程的远程释放栈, 还给 CentralCache
+    // 返回收回的字节数. 由后台回收线程调用
+    static size_t DrainIdleRemote(uint64_t idle_before);
+    // 当前所有线程缓存的上限之和
+    static size_t TotalCacheLimit();
+    // 把所有线程 (含已经退出的) 的分配计数和缓存的对象加到 stats 中
+    static void AddStats(AllocatorStats* stats);
+
+    // 返回当前线程的 ThreadCache, 第一次调用时创建
+    static ThreadCache* GetCache(){
+        ThreadCache* cache = thread_local_cache;
+        if(cache == nullptr)
+            cache = CreateCache();
+        return cache;
+    }
+
+private:
+    // 以下三个字段其他线程也会访问 (持有 thread_cache_mutex), 都用 relaxed 的原子读写
+    std::atomic<size_t> _size{0};        // 当前缓存的字节数, 只由本线程修改
+    std::atomic<size_t> _max_size{0};    // 当前线程允许缓存的字节数, 只在持锁时修改, 可以被其他线程偷走一部分
+    std::atomic<uint64_t> _last_active{0};   // 上一次向 CentralCache 取对象的时间, 用于挑选闲置的线程
+    // 其他线程释放的属于本线程的对象, 每个尺寸一个无锁栈 (只压入, 整个取走, 没有 ABA 问题)
+    // 自由链表为空时先整批收回, 再去 TransferCache / CentralCache; 闲置时由其他线程收回. 线程退出时关闭
+    std::atomic<void*> _remote_free[NLIST] = {};
+    // 远程释放栈中对象的字节数, 和 _size 一起计入本线程的上限. 压入前增加, 取走后减少
+    std::atomic<size_t> _remote_bytes{0};
+
+    // 每个尺寸的分配次数 和 其中自由链表为空的次数, 只由本线程增加, 见 StatAdd
+    uint64_t _allocs[NLIST] = {};
+    uint64_t _misses[NLIST] = {};
+    // 本线程压入其他线程远程释放栈的对象数 和 从自己的栈中取走的对象数
+    // 相减再减去被其他线程收回的 (drained_remote), 就是还在栈中的对象数
+    uint64_t _remote_pushed[NLIST] = {};
+    uint64_t _remote_taken[NLIST] = {};
+
+    // 所有存活的 ThreadCache 串成双向链表, 由 thread_cache_mutex 保护
+    // 线程退出后 ThreadCache 挂在 retired_caches 上 (只用 _next), 留给之后的线程复用
+    ThreadCache* _next = nullptr;
+    ThreadCache* _prev = nullptr;
+
+    // 修改 _size, 只由本线程调用. 和 StatAdd 一样分成两次 relaxed 访问, 没有 lock 前缀
+    void AddSize(size_t bytes){
+        _size.store(_size.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+    }
+    void SubSize(size_t bytes){
+        _size.store(_size.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+    }
+    // 缓存 (含远程释放栈) 是否超出上限 (可能是额度被其他线程偷走了)
+    bool OverLimit(){
+        return _size.load(std::memory_order_relaxed) + _remote_bytes.load(std::memory_order_relaxed) >
+               _max_size.load(std::memory_order_relaxed);
+    }
+
+    // 从 TransferCache / CentralCache 取最多 n 个对象, 返回个数; 对象所在的 Span 记为属于本线程
+    size_t FetchRange(size_t obj_size, size_t n, void*& begin, void*& end);
+
+    bool PushRemote(void* ptr, size_t index);
+    // 取走第 index 个远程释放栈中的对象, 返回个数. close 时关闭, 之后的压入都会失败
+    // 栈已经关闭时返回 0, 不会重新打开. 其他线程也可以调用
+    size_t PopRemote(size_t index, void*& start, void*& end, bool close = false);
+    // 本线程取走自己的远程释放栈, 同时计数
+    size_t TakeRemote(size_t index, void*& start, void*& end, bool close = false);
+    // 其他线程持有 thread_cache_mutex 时收回本线程所有的远程释放栈, 对象按尺寸挂到 lists 上
+    size_t DrainRemote(FreeList* lists);
+    // 复用已经退出的线程留下的 ThreadCache, 不再构造, 见 CreateCache
+    void Reset();
+
+    // 把所有自由链表中的对象还给 CentralCache
+    void ReleaseAll();
+    // 缓存超过上限, 每个自由链表各还一半给 CentralCache, 然后尝试扩大上限
+    void Scavenge();
+    // 从全局预算或其他线程那里拿一些额度, 顺便收回的闲置线程的远程释放栈挂到 drained 上
+    void IncreaseCacheLimit(FreeList* drained);
+    void ReleaseToCentralCache(FreeList* list, size_t n);
+    // 把 list 的前 n 个 obj_size 大小的对象还给 TransferCache / CentralCache, 不修改任何线程的计数
+    static void ReturnToCentralCache(FreeList* list, size_t n, size_t obj_size, size_t node);
+    // 把 DrainRemote 收回的对象还给 CentralCache, 调用时不能持有 thread_cache_mutex
+    static void ReturnDrained(FreeList* lists);
+
+    static ThreadCache* CreateCache();
+    // 线程退出时由 pthread 调用, 回收该线程的 ThreadCache
+    static void DestroyCache(void* ptr);
+    static void InitKey();
+};
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,87 @@
+#include "my_transfer_cache.h"
+
+#include <algorithm>
+
+#include "my_page_cache.h"
+#include "my_stats.h"
+
+TransferCache::Partitions TransferCache::_partitions;
+
+size_t TransferCache::Capacity(size_t byte_size) {
+    size_t batch_bytes = SizeClass::NumMoveObjs(byte_size) * byte_size;
+    return std::max<size_t>(2, std::min(TRANSFER_CACHE_SLOTS, TRANSFER_CACHE_BYTES / batch_bytes));
+}
+
+bool TransferCache::SameNode(void* start, size_t n) {
+    size_t node = this - _partitions.nodes;
+    void* cur = start;
+    for (size_t i = 0; i < n; i++, cur = NextObj(cur)) {
+        if (PageCache::GetInstance()->MapObjectToSpan(cur)->node != node) return false;
+    }
+    return true;
+}
+
+bool TransferCache::InsertRange(size_t byte_size, void* start, void* end, size_t n) {
+    // 取出时不再检查, 其他节点的对象一旦放进来就会分给本节点的线程
+    if (NumaTopology::GetInstance()->Enabled() && !SameNode(start, n)) return false;
+
+    Slots& slots = _slots[SizeClass::Index(byte_size)];
+
+    std::lock_guard<std::mutex> lock(slots.mutex);
+    if (slots.used >= Capacity(byte_size)) return false;
+
+    Batch& batch = slots.batches[slots.used++];
+    batch.head = start;
+    batch.tail = end;
+    batch.num = n;
+    return true;
+}
+
+size_t TransferCache::RemoveRange(size_t byte_size, void*& start, void*& end, size_t n) {
+    Slots& slots = _slots[SizeClass::Index(byte_size)];
+
+    std::lock_guard<std::mutex> lock(slots.mutex);
+    if (slots.used == 0) {
+        slots.misses++;
+        return 0;
+    }
+    slots.hits++;
+
+    Batch& batch = slots.batches[slots.used - 1];
+    if (batch.num <= n) {
+        // 整批拿走
+        start = batch.head;
+        end = batch.tail;
+        n = batch.num;
+        slots.used--;
+        return n;
+    }
+
+    // 只要一部分, 从这一批的头部截下 n 个, 剩下的留在槽位里
+    start = batch.head;
+    end = start;
+    for (size_t i = 1; i < n; i++) end = NextObj(end);
+    batch.head = NextObj(end);
+    batch.num -= n;
+    NextObj(end) = nullptr;
+    return n;
+}
+
+size_t TransferCache::NumBatches(size_t byte_size) {
+    Slots& slots = _slots[SizeClass::Index(byte_size)];
+    std::lock_guard<std::mutex> lock(slots.mutex);
+    return slots.used;
+}
+
+void TransferCache::AddStats(AllocatorStats* stats) {
+    for (size_t i = 0; i < NLIST; i++) {
+        Slots& slots = _slots[i];
+        std::lock_guard<std::mutex> lock(slots.mutex);
+        size_t cached = 0;
+        for (size_t k = 0; k < slots.used; k++) cached += slots.batches[k].num * SizeClass::Size(i);
+        stats->size_classes[i].cached_bytes += cached;
+        stats->transfer_cache.hits += slots.hits;
+        stats->transfer_cache.misses += slots.misses;
+        stats->transfer_cache_bytes += cached;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef TRANSFER_CACHE_H
+#define TRANSFER_CACHE_H
+#include "my_common.h"
+#include "my_numa.h"
+
+struct AllocatorStats;
+
+// 每个尺寸最多缓存的批数
+const size_t TRANSFER_CACHE_SLOTS = 64;
+// 每个尺寸缓存的对象总字节数上限, 大对象的批数按它缩减
+const size_t TRANSFER_CACHE_BYTES = 1 << 20;
+
+// 位于 ThreadCache 和 CentralCache 之间的一层
+// 按尺寸保存整批的对象 (每批即 ThreadCache 一次归还的 NumMoveObjs 个对象, 以链表首尾表示),
+// 一个线程归还的一批对象可以原封不动地交给另一个线程, 不需要逐个找回所属的 Span.
+// 只有槽位满了或者空了才会去访问 CentralCache 的 Span
+class TransferCache{
+public:
+    TransferCache(const TransferCache&) = delete;
+    TransferCache& operator=(const TransferCache&) = delete;
+
+    // NUMA 模式下每个节点一个分区, 批次放进其中对象所属节点的分区
+    static TransferCache* GetInstance();
+    static TransferCache* GetInstance(size_t node);
+
+    // 放入一批 [start, end] 共 n 个对象, 槽位已满时返回 false, 由调用者交给 CentralCache
+    // NUMA 模式下批次中有不属于本节点的对象时同样返回 false
+    bool InsertRange(size_t byte_size, void* start, void* end, size_t n);
+
+    // 取出最多 n 个对象, 返回实际取出的个数, 为 0 表示没有缓存的对象
+    size_t RemoveRange(size_t byte_size, void*& start, void*& end, size_t n);
+
+    // 当前缓存的批数
+    size_t NumBatches(size_t byte_size);
+
+    // 把命中次数和缓存的对象加到 stats 中
+    void AddStats(AllocatorStats* stats);
+
+private:
+    constexpr TransferCache() {}
+
+    struct Batch{
+        void* head = nullptr;
+        void* tail = nullptr;
+        size_t num = 0;
+    };
+
+    struct Slots{
+        std::mutex mutex;
+        size_t used = 0;
+        uint64_t hits = 0;      // RemoveRange 取到 / 没有取到对象的次数
+        uint64_t misses = 0;
+        Batch batches[TRANSFER_CACHE_SLOTS];
+    };
+
+    static size_t Capacity(size_t byte_size);
+    // [start, ...) 的 n 个对象是否都属于本分区的节点, 逐个查找所属的 Span
+    bool SameNode(void* start, size_t n);
+
+    Slots _slots[NLIST];
+
+    struct Partitions;
+    static Partitions _partitions;
+};
+
+// 直接定义数组时 GCC 不做常量初始化, 见 PageCache::Partitions
+struct TransferCache::Partitions{
+    TransferCache nodes[MAX_NUMA_NODES];
+    constexpr Partitions() {}
+};
+
+inline TransferCache* TransferCache::GetInstance(){
+    return &_partitions.nodes[0];
+}
+
+inline TransferCache* TransferCache::GetInstance(size_t node){
+    assert(node < MAX_NUMA_NODES);
+    return &_partitions.nodes[node];
+}
+
+#endif
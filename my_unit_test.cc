@@ -1,8 +1,20 @@
 #include "my_common.h"
 #include "my_page_cache.h"
 #include "my_concurrent_alloc.h"
+#include "my_transfer_cache.h"
+#include "my_central_cache.h"
 #include<iostream>
 #include<vector>
+#include<set>
+#include<cstring>
+#include<sys/mman.h>
+#include<unistd.h>
+#include<atomic>
+#include<malloc.h>
+#include<dlfcn.h>
+#include<string>
+#include<map>
+#include<algorithm>
 
 using std::endl;
 using std::cout;
@@ -139,11 +151,1516 @@ void AllocBig()
 	ConcurrentDealloc(ptr2);
 }
 
+void TestPageMap()
+{
+	// 每个对象都必须能通过基数树映射回包含它的 Span
+	size_t sizes[] = { 1, 8, 10, 128, 129, 1000, 1025, 8 * 1024, 8 * 1024 + 1, 64 * 1024,
+		65 << PAGE_SHIFT, 129 << PAGE_SHIFT };
+	std::vector<void*> v;
+	std::set<void*> distinct;
+	for (size_t size : sizes)
+	{
+		for (size_t i = 0; i < 100; ++i)
+		{
+			void* ptr = ConcurrentAlloc(size);
+			Page_ID id = (Page_ID)ptr >> PAGE_SHIFT;
+			Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+			assert(span->page_id <= id && id < span->page_id + span->page_num);
+			v.push_back(ptr);
+			distinct.insert(ptr);
+		}
+	}
+	assert(distinct.size() == v.size());
+
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		ConcurrentDealloc(v[i]);
+	}
+	cout << "TestPageMap passed" << endl;
+}
+
+void TestReleaseToSystem()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+	// 大于 MAX_BYTES, 直接从 PageCache 分配
+	const size_t bytes = 20 << PAGE_SHIFT;
+
+	// 页级对象写满后释放, 物理页应当能还给系统
+	std::vector<void*> v;
+	for (size_t i = 0; i < 16; ++i)
+	{
+		void* ptr = ConcurrentAlloc(bytes);
+		memset(ptr, 1, bytes);
+		v.push_back(ptr);
+	}
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		ConcurrentDealloc(v[i]);
+	}
+
+	page_cache->ReleaseToSystem((size_t)-1);
+	assert(page_cache->FreeBytes() == 0);
+	assert(page_cache->ReturnedBytes() >= 16 * bytes);
+
+	unsigned char resident[20];
+	assert(mincore(v[0], bytes, resident) == 0);
+	for (size_t i = 0; i < 20; ++i)
+	{
+		assert((resident[i] & 1) == 0);
+	}
+
+	// 再次使用已经归还的页, 内核重新给出清零的物理页
+	void* ptr = ConcurrentAlloc(bytes);
+	assert(((char*)ptr)[0] == 0);
+	memset(ptr, 2, bytes);
+	ConcurrentDealloc(ptr);
+
+	// 超大对象释放后留在页堆中, 物理页还给系统, 再次申请时复用同一段地址空间
+	void* big = ConcurrentAlloc(129 << PAGE_SHIFT);
+	memset(big, 3, 129 << PAGE_SHIFT);
+	ConcurrentDealloc(big);
+	size_t system_bytes = page_cache->SystemBytes();
+	big = ConcurrentAlloc(129 << PAGE_SHIFT);
+	assert(page_cache->SystemBytes() == system_bytes);
+	ConcurrentDealloc(big);
+
+	cout << "TestReleaseToSystem passed" << endl;
+}
+
+// [ptr, ptr + bytes) 中仍占用物理内存的页数
+size_t ResidentPages(void* ptr, size_t bytes)
+{
+	std::vector<unsigned char> resident(bytes >> PAGE_SHIFT);
+	assert(mincore(ptr, bytes, resident.data()) == 0);
+	size_t pages = 0;
+	for (size_t i = 0; i < resident.size(); ++i)
+		pages += resident[i] & 1;
+	return pages;
+}
+
+void TestLargeSpan()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+
+	// SpanTree: 按页数最佳适配, 页数相同时取地址最低的
+	Span spans[5];
+	size_t layout[5][2] = { { 200, 5000 }, { 150, 9000 }, { 150, 3000 }, { 300, 1000 }, { 150, 7000 } };
+	SpanTree tree;
+	for (size_t i = 0; i < 5; ++i)
+	{
+		spans[i].page_num = layout[i][0];
+		spans[i].page_id = layout[i][1];
+		tree.Insert(&spans[i]);
+	}
+	assert(tree.BestFit(140) == &spans[2]);
+	assert(tree.BestFit(151) == &spans[0]);
+	assert(tree.BestFit(300) == &spans[3]);
+	assert(tree.BestFit(301) == nullptr);
+	tree.Erase(&spans[2]);
+	assert(tree.BestFit(140) == &spans[4]);
+	assert(tree.FindLast([](Span* s) { return s->page_num < 300; }) == &spans[0]);
+	for (size_t i = 0; i < 5; ++i)
+	{
+		if (i != 2)
+			tree.Erase(&spans[i]);
+	}
+	assert(tree.Empty());
+
+	// 大对象的每一页都映射到它的 Span
+	const size_t mb = 1 << 20;
+	for (size_t size = mb; size <= 64 * mb; size *= 2)
+	{
+		char* ptr = (char*)ConcurrentAlloc(size);
+		Span* span = page_cache->MapObjectToSpan(ptr);
+		assert(span->page_id << PAGE_SHIFT == (Page_ID)ptr);
+		assert(span->page_num == size >> PAGE_SHIFT);
+		for (size_t offset = 0; offset < size; offset += (size_t)1 << PAGE_SHIFT)
+		{
+			assert(page_cache->MapObjectToSpan(ptr + offset) == span);
+		}
+		ptr[0] = ptr[size - 1] = 1;
+		ConcurrentDealloc(ptr);
+	}
+
+	// 释放后复用: 反复申请释放不同大小的缓冲区, 已归还和仍有物理内存的空闲页交错形成的碎片
+	// 在两次向系统申请之间最多合并一次, 所以最多再申请一次最大的缓冲区
+	size_t system_bytes = page_cache->SystemBytes();
+	for (size_t i = 0; i < 100; ++i)
+	{
+		void* ptr = ConcurrentAlloc((1 + i % 64) * mb);
+		ConcurrentDealloc(ptr);
+	}
+	assert(page_cache->SystemBytes() <= system_bytes + 64 * mb);
+
+	// 切开的大 Span 释放后重新合并: 256M 切成 4 个 64M, 全部释放后又能整块分配
+	void* whole = ConcurrentAlloc(256 * mb);
+	ConcurrentDealloc(whole);
+	system_bytes = page_cache->SystemBytes();
+	void* parts[4];
+	for (size_t i = 0; i < 4; ++i)
+	{
+		parts[i] = ConcurrentAlloc(64 * mb);
+	}
+	for (size_t i = 0; i < 4; ++i)
+	{
+		ConcurrentDealloc(parts[i]);
+	}
+	whole = ConcurrentAlloc(256 * mb);
+	assert(page_cache->SystemBytes() == system_bytes);
+	memset(whole, 1, 256 * mb);
+	ConcurrentDealloc(whole);
+
+	// 没有后台回收线程时, 合并出的空闲 Span 达到 RELEASE_ON_FREE_BYTES 才立即归还
+	assert(ResidentPages(whole, 256 * mb) == 0);
+
+	// 更小的空闲 Span 保留物理内存, 由 ReleaseIdleSpans 从闲置最久的开始归还
+	// 用一个没人使用的分区, 三段依次从同一个空闲 Span 切出: a 和 b 之间隔着 guard, 不会合并
+	PageCache* idle_cache = PageCache::GetInstance(MAX_NUMA_NODES - 2);
+	const size_t span_bytes = 4 * mb;
+	idle_cache->FreeBigPageObj(idle_cache->AllocBigPageObj(4 * span_bytes));
+	Span* a = idle_cache->AllocBigPageObj(span_bytes);
+	Span* guard = idle_cache->AllocBigPageObj(span_bytes);
+	Span* b = idle_cache->AllocBigPageObj(span_bytes);
+	assert(guard->page_id == a->page_id + a->page_num && b->page_id == guard->page_id + guard->page_num);
+	char* a_ptr = (char*)(a->page_id << PAGE_SHIFT);
+	char* b_ptr = (char*)(b->page_id << PAGE_SHIFT);
+	memset(a_ptr, 1, span_bytes);
+	memset(b_ptr, 1, span_bytes);
+
+	idle_cache->FreeBigPageObj(a);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	uint64_t idle_before = NowNanos();
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	idle_cache->FreeBigPageObj(b);
+	assert(ResidentPages(a_ptr, span_bytes) == span_bytes >> PAGE_SHIFT);
+	assert(idle_cache->FreeBytes() >= 2 * span_bytes);
+
+	assert(idle_cache->ReleaseIdleSpans(idle_before, (size_t)-1, 0) == span_bytes >> PAGE_SHIFT);
+	assert(ResidentPages(a_ptr, span_bytes) == 0);
+	assert(ResidentPages(b_ptr, span_bytes) == span_bytes >> PAGE_SHIFT);
+
+	// 调低门槛后, guard 和 b 合并出的 Span 在释放时立即归还
+	idle_cache->SetReleaseOnFreeBytes(2 * span_bytes);
+	idle_cache->FreeBigPageObj(guard);
+	assert(ResidentPages(b_ptr, span_bytes) == 0);
+	idle_cache->SetReleaseOnFreeBytes(RELEASE_ON_FREE_BYTES);
+
+	// 已归还的 x 和仍有物理内存的 y 相邻却不合并, 各自都放不下 2 * span_bytes
+	// 分配时只归还 y 使两者合并, 被 z 隔开的 w 保留物理内存, 也不向系统申请新的内存
+	PageCache* frag_cache = PageCache::GetInstance(MAX_NUMA_NODES - 3);
+	frag_cache->FreeBigPageObj(frag_cache->AllocBigPageObj(4 * span_bytes));
+	size_t frag_system_bytes = frag_cache->SystemBytes();
+	Span* x = frag_cache->AllocBigPageObj(span_bytes);
+	Span* y = frag_cache->AllocBigPageObj(span_bytes);
+	Span* z = frag_cache->AllocBigPageObj(span_bytes);
+	Span* w = frag_cache->AllocBigPageObj(span_bytes);
+	char* x_ptr = (char*)(x->page_id << PAGE_SHIFT);
+	char* w_ptr = (char*)(w->page_id << PAGE_SHIFT);
+	memset(w_ptr, 1, span_bytes);
+	frag_cache->SetReleaseOnFreeBytes(span_bytes);
+	frag_cache->FreeBigPageObj(x);
+	frag_cache->SetReleaseOnFreeBytes(RELEASE_ON_FREE_BYTES);
+	frag_cache->FreeBigPageObj(y);
+	frag_cache->FreeBigPageObj(w);
+	assert(frag_cache->ReturnedBytes() == span_bytes);
+
+	Span* xy = frag_cache->AllocBigPageObj(2 * span_bytes);
+	assert((char*)(xy->page_id << PAGE_SHIFT) == x_ptr);
+	assert(frag_cache->SystemBytes() == frag_system_bytes);
+	assert(ResidentPages(w_ptr, span_bytes) == span_bytes >> PAGE_SHIFT);
+	frag_cache->FreeBigPageObj(xy);
+	frag_cache->FreeBigPageObj(z);
+
+	cout << "TestLargeSpan passed" << endl;
+}
+
+void TestScavenger()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+	Scavenger* scavenger = Scavenger::GetInstance();
+
+	ScavengerOptions options;
+	options.release_rate = 64 << 20;
+	options.keep_at_least = 4 << PAGE_SHIFT;
+	options.idle_interval_ms = 20;
+	options.wakeup_interval_ms = 5;
+	// 前面的测试留下的空闲页先全部归还, 后台线程只需要归还这里释放的
+	page_cache->ReleaseToSystem((size_t)-1);
+	scavenger->Start(options);
+	assert(scavenger->Running());
+
+	const size_t bytes = 20 << PAGE_SHIFT;
+	std::vector<void*> v;
+	for (size_t i = 0; i < 16; ++i)
+	{
+		void* ptr = ConcurrentAlloc(bytes);
+		memset(ptr, 1, bytes);
+		v.push_back(ptr);
+	}
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		ConcurrentDealloc(v[i]);
+	}
+
+	// 回收线程运行时释放路径不再立即归还, 由后台线程在空闲一段时间后归还
+	size_t released = scavenger->ReleasedBytes();
+	for (size_t i = 0; i < 200 && page_cache->FreeBytes() > options.keep_at_least; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	assert(scavenger->ReleasedBytes() > released);
+	assert(page_cache->FreeBytes() == options.keep_at_least);
+
+	scavenger->Stop();
+	assert(!scavenger->Running());
+	cout << "TestScavenger passed" << endl;
+}
+
+void ChurnWorker()
+{
+	// 释放后对象留在本线程的 ThreadCache 中, 线程退出时应当还给 CentralCache
+	std::vector<void*> v;
+	for (size_t i = 0; i < 2000; ++i)
+	{
+		v.push_back(ConcurrentAlloc(8 + (i * 24) % 2048));
+	}
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		ConcurrentDealloc(v[i]);
+	}
+}
 
-int main()
+void TestThreadExit()
 {
+	PageCache* page_cache = PageCache::GetInstance();
+
+	std::thread(ChurnWorker).join();
+	size_t in_use = page_cache->SystemBytes() - page_cache->FreeBytes() - page_cache->ReturnedBytes();
+
+	// 不断创建销毁线程, 被 CentralCache 占用的页不应持续增长
+	for (size_t i = 0; i < 50; ++i)
+	{
+		std::thread(ChurnWorker).join();
+	}
+	size_t now_in_use = page_cache->SystemBytes() - page_cache->FreeBytes() - page_cache->ReturnedBytes();
+	assert(now_in_use <= in_use);
+
+	// 从未分配过内存的线程也可以释放其他线程分配的对象
+	void* ptr = ConcurrentAlloc(100);
+	std::thread([ptr]() { ConcurrentDealloc(ptr); }).join();
+
+	cout << "TestThreadExit passed" << endl;
+}
+
+// 各线程反复分配释放, 然后保持存活, 统计此时所有线程缓存的总大小和总上限
+size_t CachedBytesAfterChurn(size_t nthreads, size_t& limit)
+{
+	std::atomic<size_t> done(0);
+	std::atomic<bool> quit(false);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads.emplace_back([&]() {
+			for (size_t round = 0; round < 4; ++round)
+			{
+				std::vector<void*> v;
+				for (size_t i = 0; i < 4000; ++i)
+				{
+					v.push_back(ConcurrentAlloc(16 + (i % 32) * 32));
+				}
+				for (size_t i = 0; i < v.size(); ++i)
+				{
+					ConcurrentDealloc(v[i]);
+				}
+			}
+			done++;
+			while (!quit)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+	}
+	while (done != nthreads)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	size_t cached = ThreadCache::TotalCachedBytes();
+	limit = ThreadCache::TotalCacheLimit();
+	quit = true;
+	for (size_t t = 0; t < nthreads; ++t)
+	{
+		threads[t].join();
+	}
+	return cached;
+}
+
+void TestThreadCacheBudget()
+{
+	size_t overall = ThreadCache::GetOverallThreadCacheSize();
+
+	size_t limit = 0;
+	ThreadCache::SetOverallThreadCacheSize(64 << 20);
+	size_t large = CachedBytesAfterChurn(8, limit);
+
+	// 各线程上限之和不超过全局预算
+	// 每个线程至少 MIN_THREAD_CACHE_SIZE, 算上主线程的缓存
+	const size_t budget = 2 << 20;
+	ThreadCache::SetOverallThreadCacheSize(budget);
+	assert(ThreadCache::GetOverallThreadCacheSize() == budget);
+	size_t small = CachedBytesAfterChurn(8, limit);
+	assert(limit <= budget);
+	assert(small <= budget + MIN_THREAD_CACHE_SIZE);
+	assert(small < large);
+
+	ThreadCache::SetOverallThreadCacheSize(overall);
+	cout << "TestThreadCacheBudget passed" << endl;
+}
+
+void TestTransferCache()
+{
+	const size_t size = 1024;
+	const size_t batch = SizeClass::NumMoveObjs(size);
+	TransferCache* transfer_cache = TransferCache::GetInstance();
+
+	// 生产者分配, 消费者释放: 消费者整批归还的对象进入 TransferCache
+	std::vector<void*> v;
+	std::thread producer([&]() {
+		for (size_t i = 0; i < batch * 20; ++i)
+		{
+			v.push_back(ConcurrentAlloc(size));
+		}
+	});
+	producer.join();
+
+	size_t batches = transfer_cache->NumBatches(size);
+	std::thread consumer([&]() {
+		for (size_t i = 0; i < v.size(); ++i)
+		{
+			ConcurrentDealloc(v[i]);
+		}
+	});
+	consumer.join();
+	assert(transfer_cache->NumBatches(size) > batches);
+
+	// 另一个线程再分配时直接拿走整批的对象
+	batches = transfer_cache->NumBatches(size);
+	std::thread([&]() {
+		std::vector<void*> w;
+		for (size_t i = 0; i < batch * 4; ++i)
+		{
+			w.push_back(ConcurrentAlloc(size));
+		}
+		assert(transfer_cache->NumBatches(size) < batches);
+		for (size_t i = 0; i < w.size(); ++i)
+		{
+			ConcurrentDealloc(w[i]);
+		}
+	}).join();
+
+	cout << "TestTransferCache passed" << endl;
+}
+
+
+void TestSizeClass()
+{
+	// 查找表给出的是能放下 bytes 的最小类别
+	size_t cls = 0;
+	for (size_t bytes = 1; bytes <= MAX_BYTES; ++bytes)
+	{
+		while (SIZE_CLASS_TABLE[cls] < bytes)
+			cls++;
+		assert(SizeClass::Index(bytes) == cls);
+		assert(SizeClass::RoundUp(bytes) == SIZE_CLASS_TABLE[cls]);
+	}
+
+	// Span 记录了自己的尺寸类别
+	size_t sizes[] = { 1, 8, 100, 129, 1025, 8 * 1024 + 1, MAX_BYTES };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		void* p = ConcurrentAlloc(sizes[i]);
+		Span* span = PageCache::GetInstance()->MapObjectToSpan(p);
+		assert(span->size_class == SizeClass::Index(sizes[i]));
+		assert(span->obj_size == SizeClass::Size(span->size_class));
+		ConcurrentDealloc(p);
+	}
+
+	cout << "TestSizeClass passed" << endl;
+}
+
+struct SizedBase : public ConcurrentAllocated
+{
+	virtual ~SizedBase() {}
+	char data[24];
+};
+
+struct SizedDerived : public SizedBase
+{
+	char more[1000];
+};
+
+void TestSizedDealloc()
+{
+	// 带大小释放的对象回到同一个尺寸类别, 紧接着的分配拿到的就是它
+	size_t sizes[] = { 1, 8, 100, 129, 1025, 8 * 1024 + 1, MAX_BYTES, MAX_BYTES + 1, 300 * 1024 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		void* p = ConcurrentAlloc(sizes[i]);
+		memset(p, 1, sizes[i]);
+		ConcurrentDealloc(p, sizes[i]);
+		if (sizes[i] <= MAX_BYTES)
+		{
+			void* q = ConcurrentAlloc(sizes[i]);
+			assert(q == p);
+			ConcurrentDealloc(q, sizes[i]);
+		}
+	}
+
+	// 通过基类指针删除, 编译器传入的是实际对象的大小
+	SizedBase* base = new SizedDerived;
+	void* addr = base;
+	delete base;
+	void* again = ConcurrentAlloc(sizeof(SizedDerived));
+	assert(again == addr);
+	ConcurrentDealloc(again, sizeof(SizedDerived));
+
+	SizedBase* array = new SizedBase[10];
+	delete[] array;
+
+	// 标准容器
+	std::vector<int, ConcurrentAllocator<int>> v;
+	for (int i = 0; i < 100000; ++i)
+	{
+		v.push_back(i);
+	}
+	for (int i = 0; i < 100000; ++i)
+	{
+		assert(v[i] == i);
+	}
+
+	cout << "TestSizedDealloc passed" << endl;
+}
+
+void TestCpuCache()
+{
+	AllocatorOptions options;
+	options.per_cpu_cache = true;
+	InitAllocator(options);
+	CpuCache* cpu_cache = CpuCache::GetInstance();
+	if (!cpu_cache->Enabled())
+	{
+		cout << "TestCpuCache skipped: rseq is not available" << endl;
+		return;
+	}
+
+	// 线程不再创建 ThreadCache, 对象之间互不重叠
+	std::vector<std::thread> threads;
+	std::atomic<size_t> errors(0);
+	for (size_t t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([&errors, t]() {
+			for (size_t round = 0; round < 20; ++round)
+			{
+				std::vector<std::pair<unsigned char*, size_t>> v;
+				for (size_t i = 0; i < 1000; ++i)
+				{
+					size_t size = 8 + (i * 97 + t * 13) % 2048;
+					unsigned char* p = (unsigned char*)ConcurrentAlloc(size);
+					memset(p, (int)t, size);
+					v.push_back({ p, size });
+				}
+				for (size_t i = 0; i < v.size(); ++i)
+				{
+					for (size_t j = 0; j < v[i].second; ++j)
+					{
+						if (v[i].first[j] != (unsigned char)t)
+						{
+							errors++;
+							break;
+						}
+					}
+					ConcurrentDealloc(v[i].first);
+				}
+			}
+			if (thread_local_cache != nullptr)
+				errors++;
+		});
+	}
+	for (size_t t = 0; t < threads.size(); ++t)
+	{
+		threads[t].join();
+	}
+	assert(errors == 0);
+
+	// 一个线程分配, 另一个线程释放
+	std::vector<void*> v;
+	std::thread([&]() {
+		for (size_t i = 0; i < 10000; ++i)
+		{
+			v.push_back(ConcurrentAlloc(64));
+		}
+	}).join();
+	std::thread([&]() {
+		for (size_t i = 0; i < v.size(); ++i)
+		{
+			ConcurrentDealloc(v[i]);
+		}
+	}).join();
+
+	// 缓存的字节数只和 CPU 个数有关, 与线程数无关
+	size_t num_cpus = (size_t)sysconf(_SC_NPROCESSORS_CONF);
+	assert(cpu_cache->TotalCachedBytes() > 0);
+	assert(cpu_cache->TotalCachedBytes() <= num_cpus * NLIST * CPU_CACHE_CLASS_BYTES);
+
+	cout << "TestCpuCache passed" << endl;
+}
+
+void TestMetadataPool()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+
+	// 大量单页的 Span, 元数据只占很小的比例
+	std::vector<Span*> spans;
+	for (size_t i = 0; i < 20000; ++i)
+	{
+		spans.push_back(page_cache->NewSpan(1));
+	}
+	size_t metadata = page_cache->MetadataBytes();
+	assert(metadata > 0);
+	assert(metadata < page_cache->SystemBytes() / 20);
+
+	// 释放之后 Span 回到对象池, 再分配同样多的 Span 不需要新的元数据
+	for (size_t i = 0; i < spans.size(); ++i)
+	{
+		page_cache->ReleaseSpanToPageCache(spans[i]);
+	}
+	for (size_t i = 0; i < spans.size(); ++i)
+	{
+		spans[i] = page_cache->NewSpan(1);
+	}
+	assert(page_cache->MetadataBytes() == metadata);
+	for (size_t i = 0; i < spans.size(); ++i)
+	{
+		page_cache->ReleaseSpanToPageCache(spans[i]);
+	}
+
+	cout << "TestMetadataPool passed" << endl;
+}
+
+void TestSpanCache()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+
+	// 刚还回去的小 Span 留在分片缓存里, 下一次同样大小的请求直接拿到它
+	// 上一次作为小对象 Span 使用时的信息在归还时清空
+	Span* span = page_cache->NewSpan(3);
+	span->obj_size = 64;
+	span->size_class = SizeClass::Index(64);
+	span->list_ptr = (void*)(span->page_id << PAGE_SHIFT);
+	page_cache->ReleaseSpanToPageCache(span);
+	assert(page_cache->SpanCacheBytes() >= (3 << PAGE_SHIFT));
+	assert(span->obj_size == 0 && span->size_class == 0 && span->list_ptr == nullptr);
+	assert(page_cache->NewSpan(3) == span);
+	page_cache->ReleaseSpanToPageCache(span);
+
+	// 多线程并发申请和归还, 每个 Span 的所有页都映射到它自己, 互不重叠
+	std::atomic<size_t> errors(0);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([&errors, page_cache, t]() {
+			std::vector<Span*> spans;
+			for (size_t i = 0; i < 20000; ++i)
+			{
+				if (spans.size() < 16)
+				{
+					Span* s = page_cache->NewSpan(1 + (i + t) % SPAN_CACHE_MAX_PAGES);
+					memset((void*)(s->page_id << PAGE_SHIFT), (int)t, s->page_num << PAGE_SHIFT);
+					spans.push_back(s);
+				}
+				else
+				{
+					Span* s = spans[i % spans.size()];
+					spans[i % spans.size()] = spans.back();
+					spans.pop_back();
+					unsigned char* p = (unsigned char*)(s->page_id << PAGE_SHIFT);
+					for (size_t k = 0; k < s->page_num; ++k)
+					{
+						if (page_cache->MapObjectToSpan(p + (k << PAGE_SHIFT)) != s || p[k << PAGE_SHIFT] != t)
+							errors++;
+					}
+					page_cache->ReleaseSpanToPageCache(s);
+				}
+			}
+			for (size_t i = 0; i < spans.size(); ++i)
+				page_cache->ReleaseSpanToPageCache(spans[i]);
+		});
+	}
+	for (size_t t = 0; t < threads.size(); ++t)
+		threads[t].join();
+	assert(errors == 0);
+	assert(page_cache->SpanCacheBytes() <= SPAN_CACHE_SHARDS * (SPAN_CACHE_SHARD_PAGES << PAGE_SHIFT));
+
+	// 关闭后缓存清空, 页面回到全局页堆
+	page_cache->SetSpanCacheEnabled(false);
+	assert(page_cache->SpanCacheBytes() == 0);
+	page_cache->SetSpanCacheEnabled(true);
+
+	// 归还给系统时分片中的 Span 也一起归还
+	span = page_cache->NewSpan(2);
+	page_cache->ReleaseSpanToPageCache(span);
+	assert(page_cache->SpanCacheBytes() >= (2 << PAGE_SHIFT));
+	page_cache->ReleaseToSystem((size_t)-1);
+	assert(page_cache->SpanCacheBytes() == 0);
+
+	cout << "TestSpanCache passed" << endl;
+}
+
+void TestCentralCacheBuckets()
+{
+	// 用一个没人使用的分区, Span 的使用情况完全由这里决定
+	CentralCache* central = CentralCache::GetInstance(MAX_NUMA_NODES - 1);
+	PageCache* page_cache = PageCache::GetInstance(MAX_NUMA_NODES - 1);
+	const size_t size = 1024;
+	const size_t capacity = SizeClass::SpanObjs(SizeClass::Index(size));
+
+	// 取两个整 Span 的对象, 两个 Span 都已满
+	std::vector<void*> objs[2];
+	Span* spans[2];
+	for (size_t k = 0; k < 2; ++k)
+	{
+		void* start = nullptr;
+		void* end = nullptr;
+		assert(central->FetchRangeObj(start, end, capacity, size) == capacity);
+		for (void* cur = start; cur != nullptr; cur = (cur == end ? nullptr : NextObj(cur)))
+			objs[k].push_back(cur);
+		spans[k] = page_cache->MapObjectToSpan(start);
+		assert(spans[k]->use_count == capacity);
+	}
+	assert(spans[0] != spans[1]);
+
+	// A 还回 1/4, B 还回 1/2, 之后的分配应该来自更满的 A
+	auto release = [&](size_t k, size_t n) {
+		void* head = nullptr;
+		for (size_t i = 0; i < n; ++i)
+		{
+			NextObj(objs[k].back()) = head;
+			head = objs[k].back();
+			objs[k].pop_back();
+		}
+		central->ReleaseListToSpans(head, size);
+	};
+	release(0, capacity / 4);
+	release(1, capacity / 2);
+	for (size_t i = 0; i < capacity / 4; ++i)
+	{
+		void* start = nullptr;
+		void* end = nullptr;
+		assert(central->FetchRangeObj(start, end, 1, size) == 1);
+		assert(page_cache->MapObjectToSpan(start) == spans[0]);
+		objs[0].push_back(start);
+	}
+
+	// A 又满了, 下一个来自 B
+	void* start = nullptr;
+	void* end = nullptr;
+	assert(central->FetchRangeObj(start, end, 1, size) == 1);
+	assert(page_cache->MapObjectToSpan(start) == spans[1]);
+	objs[1].push_back(start);
+
+	// 全部还回后 Span 立即回到 PageCache (合并后可能已经还给系统)
+	auto idle_bytes = [page_cache]() {
+		return page_cache->FreeBytes() + page_cache->ReturnedBytes() + page_cache->SpanCacheBytes();
+	};
+	size_t span_bytes = spans[1]->page_num << PAGE_SHIFT;
+	size_t idle_before = idle_bytes();
+	release(1, objs[1].size());
+	assert(idle_bytes() == idle_before + span_bytes);
+	release(0, objs[0].size());
+	assert(idle_bytes() == idle_before + 2 * span_bytes);
+
+	cout << "TestCentralCacheBuckets passed" << endl;
+}
+
+void TestSpanBumpCarving()
+{
+	CentralCache* central = CentralCache::GetInstance(MAX_NUMA_NODES - 1);
+	PageCache* page_cache = PageCache::GetInstance(MAX_NUMA_NODES - 1);
+	const size_t size = 8;
+	auto fetch = [&](size_t n, std::vector<void*>& objs) {
+		void* start = nullptr;
+		void* end = nullptr;
+		size_t got = central->FetchRangeObj(start, end, n, size);
+		for (void* cur = start; cur != nullptr; cur = NextObj(cur))
+			objs.push_back(cur);
+		assert(objs.size() == got && objs.back() == end);
+	};
+
+	// 新 Span 只切出这一批, 从 Span 的起点开始依次排列
+	std::vector<void*> first;
+	fetch(4, first);
+	Span* span = page_cache->MapObjectToSpan(first[0]);
+	assert(first[0] == (void*)(span->page_id << PAGE_SHIFT));
+	for (size_t i = 1; i < first.size(); ++i)
+		assert((char*)first[i] == (char*)first[0] + i * size);
+	assert(span->bump == (char*)first[0] + 4 * size);
+	assert(span->list_ptr == nullptr && span->use_count == 4);
+
+	// 还回来的对象先分配, 不够时再接着切
+	NextObj(first[1]) = nullptr;
+	NextObj(first[0]) = first[1];
+	central->ReleaseListToSpans(first[0], size);
+	std::vector<void*> second;
+	fetch(3, second);
+	assert(std::set<void*>(second.begin(), second.begin() + 2) == std::set<void*>(first.begin(), first.begin() + 2));
+	assert(second[2] == (char*)first[0] + 4 * size);
+	assert(span->bump == (char*)first[0] + 5 * size && span->use_count == 5);
+
+	// 全部还回后 Span 回到 PageCache
+	second.push_back(first[2]);
+	second.push_back(first[3]);
+	for (size_t i = 0; i + 1 < second.size(); ++i)
+		NextObj(second[i]) = second[i + 1];
+	NextObj(second.back()) = nullptr;
+	size_t span_bytes = span->page_num << PAGE_SHIFT;
+	size_t idle_before = page_cache->FreeBytes() + page_cache->ReturnedBytes() + page_cache->SpanCacheBytes();
+	central->ReleaseListToSpans(second[0], size);
+	assert(page_cache->FreeBytes() + page_cache->ReturnedBytes() + page_cache->SpanCacheBytes() == idle_before + span_bytes);
+
+	cout << "TestSpanBumpCarving passed" << endl;
+}
+
+void TestAllocatorStats()
+{
+	const size_t size = 100;
+	const size_t index = SizeClass::Index(size);
+	const size_t big = 1 << 20;
+	AllocatorStats* before = new AllocatorStats;
+	AllocatorStats* after = new AllocatorStats;
+	GetAllocatorStats(before);
+
+	std::vector<void*> v;
+	for (size_t i = 0; i < 1000; ++i)
+		v.push_back(ConcurrentAlloc(size));
+	void* large = ConcurrentAlloc(big);
+	GetAllocatorStats(after);
+
+	// 新分配的对象都在使用者手里, 分配次数逐个计入前端
+	assert(after->size_classes[index].live_bytes - before->size_classes[index].live_bytes == 1000 * SizeClass::Size(index));
+	assert(after->size_classes[index].allocs - before->size_classes[index].allocs == 1000);
+	assert(after->front_end.hits + after->front_end.misses - before->front_end.hits - before->front_end.misses >= 1000);
+	assert(after->large_bytes - before->large_bytes == big);
+	assert(after->live_bytes >= after->size_classes[index].live_bytes + after->large_bytes);
+	assert(after->system_bytes >= after->live_bytes);
+
+	// 释放后回到原来的水平, 对象留在缓存里
+	for (size_t i = 0; i < v.size(); ++i)
+		ConcurrentDealloc(v[i]);
+	ConcurrentDealloc(large);
+	GetAllocatorStats(after);
+	assert(after->size_classes[index].live_bytes == before->size_classes[index].live_bytes);
+	assert(after->large_bytes == before->large_bytes);
+	assert(after->size_classes[index].cached_bytes + after->size_classes[index].fragmented_bytes > 0);
+
+	// 文本输出
+	FILE* file = tmpfile();
+	DumpStats(fileno(file));
+	char buf[1 << 16] = {};
+	rewind(file);
+	fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	assert(strstr(buf, "Bytes in use by application") != nullptr);
+	assert(strstr(buf, "central cache") != nullptr);
+
+	delete before;
+	delete after;
+	cout << "TestAllocatorStats passed" << endl;
+}
+
+void TestHeapProfiler()
+{
+	HeapProfiler* profiler = HeapProfiler::GetInstance();
+	assert(profiler->NumSamples() == 0);
+
+	// 平均每 4K 采样一次, 1000 个 100 字节的对象 (实际约 100K) 期望采样 25 个左右
+	const size_t rate = 4096;
+	profiler->SetSampleRate(rate);
+	std::vector<void*> v;
+	for (size_t i = 0; i < 1000; ++i)
+		v.push_back(ConcurrentAlloc(100));
+	size_t small_samples = profiler->NumSamples();
+	assert(small_samples >= 5 && small_samples <= 60);
+
+	// 远大于采样间隔的大对象几乎一定被采样
+	void* large = ConcurrentAlloc(1 << 20);
+	assert(profiler->NumSamples() > small_samples);
+
+	FILE* file = tmpfile();
+	profiler->DumpProfile(fileno(file));
+	static char buf[1 << 20];
+	rewind(file);
+	size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+	buf[len] = '\0';
+	fclose(file);
+	char header[128];
+	snprintf(header, sizeof(header), "heap profile: %6zu:", profiler->NumSamples());
+	assert(strncmp(buf, header, strlen(header)) == 0);
+	assert(strstr(buf, "@ heap_v2/4096") != nullptr);
+	assert(strstr(buf, "MAPPED_LIBRARIES:") != nullptr);
+	// 大对象的调用栈只有一条, 大小是请求的字节数
+	assert(strstr(buf, "     1:  1048576 [     1:  1048576] @ 0x") != nullptr);
+
+	// 带大小和不带大小的释放都会删除记录
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		if (i % 2 == 0)
+			ConcurrentDealloc(v[i], 100);
+		else
+			ConcurrentDealloc(v[i]);
+	}
+	ConcurrentDealloc(large);
+	assert(profiler->NumSamples() == 0);
+
+	profiler->SetSampleRate(0);
+	for (size_t i = 0; i < 1000; ++i)
+		ConcurrentDealloc(ConcurrentAlloc(1 << 20));
+	assert(profiler->NumSamples() == 0);
+
+	cout << "TestHeapProfiler passed" << endl;
+}
+
+void TestRemoteFree()
+{
+	const size_t size = 3000, count = 16;
+	size_t index = SizeClass::Index(size);
+	std::vector<void*> objs;
+	std::atomic<int> step(0);
+
+	std::thread owner([&]() {
+		for (size_t i = 0; i < count; ++i)
+			objs.push_back(ConcurrentAlloc(size));
+		// 把本地缓存的对象都分配掉, 之后的分配先看远程释放栈
+		FreeList& list = ThreadCache::GetCache()->_free_list[index];
+		std::vector<void*> drained;
+		while (!list.Empty())
+			drained.push_back(ConcurrentAlloc(size));
+
+		step = 1;
+		while (step != 2)
+			std::this_thread::yield();
+		// 第一个对象所在的 Span 一定属于本线程, 至少它被压回了远程释放栈
+		void* ptr = ConcurrentAlloc(size);
+		assert(std::find(objs.begin(), objs.end(), ptr) != objs.end());
+		assert(list.Size() < count);
+		ConcurrentDealloc(ptr);
+		for (void* p : drained)
+			ConcurrentDealloc(p);
+	});
+	std::thread([&]() {
+		while (step != 1)
+			std::this_thread::yield();
+		for (void* p : objs)
+			ConcurrentDealloc(p);
+		step = 2;
+	}).join();
+	owner.join();
+
+	// 所属线程不再分配时, 远程释放栈中的对象计入它的上限, 超出的留在释放线程自己的缓存
+	std::vector<void*> many;
+	std::thread idle([&]() {
+		for (size_t i = 0; i < 1600; ++i)
+			many.push_back(ConcurrentAlloc(size));
+		step = 3;
+		while (step != 4)
+			std::this_thread::yield();
+	});
+	while (step != 3)
+		std::this_thread::yield();
+	std::thread([&]() {
+		for (void* p : many)
+			ConcurrentDealloc(p);
+	}).join();
+	AllocatorStats* stats = new AllocatorStats;
+	GetAllocatorStats(stats);
+	assert(stats->thread_cache_bytes <= ThreadCache::TotalCacheLimit());
+	// 闲置线程的远程释放栈由其他线程收回
+	assert(ThreadCache::DrainIdleRemote(NowNanos()) > 0);
+	assert(ThreadCache::DrainIdleRemote(NowNanos()) == 0);
+	step = 4;
+	idle.join();
+
+	// 所属线程退出后远程释放栈关闭, 对象留在释放线程自己的缓存
+	void* ptr = nullptr;
+	std::thread([&]() { ptr = ConcurrentAlloc(size); }).join();
+	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+	assert(span->owner != nullptr && span->owner != ThreadCache::GetCache());
+	assert(!ThreadCache::GetCache()->FreeToOwner(ptr, index, span));
+
+	// 退出的线程留下的 ThreadCache 由下一个线程复用, 远程释放栈重新打开
+	std::thread reuse([&]() {
+		assert(ThreadCache::GetCache() == span->owner);
+		step = 5;
+		while (step != 6)
+			std::this_thread::yield();
+	});
+	while (step != 5)
+		std::this_thread::yield();
+	assert(ThreadCache::GetCache()->FreeToOwner(ptr, index, span));
+	step = 6;
+	reuse.join();
+
+	cout << "TestRemoteFree passed" << endl;
+}
+
+void TestBatchAlloc()
+{
+	// 跨越多次从中心缓存取对象
+	const size_t size = 48, n = 3000;
+	std::vector<void*> v(n);
+	ConcurrentAllocBatch(size, n, v.data());
+	std::set<void*> distinct(v.begin(), v.end());
+	assert(distinct.size() == n && distinct.count(nullptr) == 0);
+	for (size_t i = 0; i < n; ++i)
+	{
+		assert(ConcurrentUsableSize(v[i]) == SizeClass::Size(SizeClass::Index(size)));
+		memset(v[i], 0x5a, size);
+	}
+
+	// 释放时可以混合不同大小的对象, 空指针和不属于内存池的指针
+	int on_stack = 0;
+	std::vector<void*> mixed(v.begin(), v.begin() + n / 2);
+	mixed.push_back(ConcurrentAlloc(1 << 20));
+	mixed.push_back(nullptr);
+	mixed.push_back(&on_stack);
+	mixed.push_back(ConcurrentAlloc(100));
+	ConcurrentDeallocBatch(mixed.data(), mixed.size());
+	// 批量分配的对象也可以逐个释放
+	for (size_t i = n / 2; i < n; ++i)
+		ConcurrentDealloc(v[i], size);
+
+	// 释放的对象再次批量分配时从线程缓存取
+	ConcurrentAllocBatch(size, 16, v.data());
+	for (size_t i = 0; i < 16; ++i)
+		assert(distinct.count(v[i]) == 1);
+	ConcurrentDeallocBatch(v.data(), 16);
+
+	// 大对象逐个分配
+	ConcurrentAllocBatch(MAX_BYTES + 1, 4, v.data());
+	for (size_t i = 0; i < 4; ++i)
+		assert(ConcurrentUsableSize(v[i]) >= MAX_BYTES + 1);
+	ConcurrentDeallocBatch(v.data(), 4);
+
+	cout << "TestBatchAlloc passed" << endl;
+}
+
+void TestHeap()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+	AllocatorStats* stats = new AllocatorStats;
+	GetAllocatorStats(stats);
+	size_t heap_bytes_before = stats->heap_bytes;
+
+	Heap* heap = HeapCreate();
+	std::set<void*> objs;
+	void* large = HeapAlloc(heap, 1 << 20);
+	objs.insert(large);
+	for (size_t i = 0; i < 5000; ++i)
+	{
+		size_t size = 8 + (i * 40) % 2048;
+		void* ptr = HeapAlloc(heap, size);
+		assert(ConcurrentUsableSize(ptr) >= size);
+		memset(ptr, 0x5a, size);
+		objs.insert(ptr);
+	}
+	assert(objs.size() == 5001);
+	assert(page_cache->MapObjectToSpan(large)->heap == heap);
+	assert(heap->SpanBytes() >= (1 << 20) + 5000 * 8);
+
+	// 堆持有的 Span 整个算作在使用
+	GetAllocatorStats(stats);
+	assert(stats->heap_bytes == heap_bytes_before + heap->SpanBytes());
+
+	// 单独释放堆中的对象被忽略, 对象不会进入全局的缓存
+	void* ptr = *objs.rbegin();
+	size_t usable = ConcurrentUsableSize(ptr);
+	ConcurrentDealloc(ptr);
+	void* global = ConcurrentAlloc(usable);
+	assert(objs.count(global) == 0);
+	ConcurrentDealloc(global);
+	// 带 size 的释放同样被忽略 (不依赖 assert, NDEBUG 下也一样)
+	void* sized = HeapAlloc(heap, 64);
+	ConcurrentDealloc(sized, 64);
+	global = ConcurrentAlloc(64);
+	assert(global != sized);
+	ConcurrentDealloc(global, 64);
+
+	// 销毁时所有 Span 回到 PageCache
+	auto idle_bytes = [page_cache]() {
+		return page_cache->FreeBytes() + page_cache->ReturnedBytes() + page_cache->SpanCacheBytes();
+	};
+	size_t span_bytes = heap->SpanBytes();
+	size_t idle_before = idle_bytes();
+	HeapDestroy(heap);
+	assert(idle_bytes() == idle_before + span_bytes);
+	GetAllocatorStats(stats);
+	assert(stats->heap_bytes == heap_bytes_before);
+
+	// 重新创建的堆从空的状态开始
+	heap = HeapCreate();
+	assert(heap->SpanBytes() == 0);
+	assert(HeapAlloc(heap, 100) != nullptr);
+	HeapDestroy(heap);
+
+	delete stats;
+	cout << "TestHeap passed" << endl;
+}
+
+static void FillPattern(void* ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i += 512)
+		((unsigned char*)ptr)[i] = (unsigned char)(i / 512 * 7 + 1);
+}
+
+static bool CheckPattern(void* ptr, size_t size)
+{
+	for (size_t i = 0; i < size; i += 512)
+		if (((unsigned char*)ptr)[i] != (unsigned char)(i / 512 * 7 + 1))
+			return false;
+	return true;
+}
+
+void TestRealloc()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+
+	// 小对象放得下时原地返回, 否则拷贝到更大的类别
+	void* small = ConcurrentRealloc(nullptr, 100);
+	FillPattern(small, 100);
+	assert(ConcurrentRealloc(small, ConcurrentUsableSize(small)) == small);
+	void* bigger = ConcurrentRealloc(small, 5000);
+	assert(bigger != small && CheckPattern(bigger, 100));
+
+	// 大对象缩小时尾部还回页堆, 再增大时吞并这些页, 地址都不变
+	const size_t page = (size_t)1 << PAGE_SHIFT;
+	void* large = ConcurrentRealloc(bigger, 150 * page);
+	assert(large != bigger && CheckPattern(large, 100));
+	FillPattern(large, 150 * page);
+	assert(ConcurrentRealloc(large, 50 * page) == large);
+	assert(ConcurrentUsableSize(large) == 50 * page);
+	Span* tail = page_cache->FindSpan((char*)large + 50 * page);
+	assert(tail != nullptr && !tail->is_use);
+	assert(ConcurrentRealloc(large, 125 * page) == large);
+	assert(ConcurrentUsableSize(large) == 125 * page);
+	assert(CheckPattern(large, 50 * page));
+	FillPattern(large, 125 * page);
+
+	// 后面没有足够的空闲页时, 超过 1M 的对象用 mremap 移走物理页 (内核不支持时拷贝)
+	void* moved = ConcurrentRealloc(large, 64 << 20);
+	assert(moved != large && CheckPattern(moved, 125 * page));
+	assert(ConcurrentUsableSize(moved) == (64 << 20));
+	memset((char*)moved + 125 * page, 1, (64 << 20) - 125 * page);
+	Span* old_span = page_cache->FindSpan(large);
+	assert(old_span != nullptr && !old_span->is_use);
+	void* again = ConcurrentRealloc(moved, 256 << 20);
+	assert(CheckPattern(again, 125 * page));
+	assert(((char*)again)[(64 << 20) - 1] == 1);
+	// 缩成小对象时拷贝
+	void* shrunk = ConcurrentRealloc(again, 1000);
+	assert(CheckPattern(shrunk, 1000));
+	ConcurrentDealloc(shrunk);
+
+	// 对齐超过一页的小对象同样是一个 Span 一个对象, 释放时不能进入小对象的自由链表
+	void* aligned = ConcurrentAllocAligned(100, 2 * page);
+	assert((uintptr_t)aligned % (2 * page) == 0);
+	assert(page_cache->FindSpan(aligned)->obj_size > MAX_BYTES);
+	assert(ConcurrentUsableSize(aligned) == page);
+	FillPattern(aligned, 100);
+	void* unaligned = ConcurrentRealloc(aligned, 300);
+	assert(unaligned != aligned && CheckPattern(unaligned, 100));
+	ConcurrentDealloc(unaligned);
+	FreeList& tiny = ThreadCache::GetCache()->_free_list[0];
+	size_t tiny_size = tiny.Size();
+	aligned = ConcurrentAllocAligned(8, 2 * page);
+	ConcurrentDealloc(aligned);
+	assert(tiny.Size() == tiny_size);
+
+	// 堆中的对象从同一个堆重新分配
+	Heap* heap = HeapCreate();
+	void* in_heap = HeapAlloc(heap, 64);
+	FillPattern(in_heap, 64);
+	void* in_heap2 = ConcurrentRealloc(in_heap, 200 * page);
+	assert(page_cache->FindSpan(in_heap2)->heap == heap && CheckPattern(in_heap2, 64));
+	HeapDestroy(heap);
+
+	// 被采样的对象拷贝后记录随原来的对象删除
+	HeapProfiler* profiler = HeapProfiler::GetInstance();
+	profiler->SetSampleRate(1);
+	void* sampled = ConcurrentAlloc(300 * page);
+	profiler->SetSampleRate(0);
+	assert(profiler->NumSamples() == 1);
+	void* resized = ConcurrentRealloc(sampled, 500 * page);
+	assert(resized != sampled && profiler->NumSamples() == 0);
+	ConcurrentDealloc(resized);
+
+	cout << "TestRealloc passed" << endl;
+}
+
+struct alignas(64) Aligned64
+{
+	char data[100];
+};
+
+// 在 LD_PRELOAD=./libconcurrentalloc.so 的子进程中运行
+int MallocOverrideChild()
+{
+	// malloc 确实来自内存池
+	Dl_info info;
+	assert(dladdr((void*)&malloc, &info) != 0);
+	assert(strstr(info.dli_fname, "libconcurrentalloc.so") != nullptr);
+
+	for (size_t size = 0; size < 300 * 1024; size = size * 2 + 1)
+	{
+		char* p = (char*)malloc(size);
+		assert(p != nullptr && ((uintptr_t)p % 16 == 0 || size <= 8));
+		assert(malloc_usable_size(p) >= size);
+		memset(p, 0x5a, size);
+
+		char* q = (char*)calloc(size + 1, 1);
+		for (size_t i = 0; i <= size; ++i)
+			assert(q[i] == 0);
+
+		q = (char*)realloc(q, size * 2 + 10);
+		p = (char*)realloc(p, size * 3 + 1);
+		for (size_t i = 0; i < size; ++i)
+			assert((unsigned char)p[i] == 0x5a);
+		free(p);
+		free(q);
+	}
+	assert(realloc(malloc(10), 0) == nullptr);
+	free(nullptr);
+	// 用 volatile 避免编译器在编译期就报出超大的请求
+	volatile size_t huge = (size_t)1 << 40;
+	volatile size_t max_size = (size_t)-1;
+	assert(calloc(huge, huge) == nullptr);
+	assert(malloc(max_size) == nullptr);
+
+	size_t aligns[] = { 8, 32, 64, 256, 4096, 8192, 2 << 20 };
+	size_t sizes[] = { 1, 100, 5000, 70000, 3 << 20 };
+	for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); ++i)
+	{
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j)
+		{
+			void* p = nullptr;
+			int ret = posix_memalign(&p, aligns[i], sizes[j]);
+			assert(ret == 0);
+			assert((uintptr_t)p % aligns[i] == 0);
+			assert(malloc_usable_size(p) >= sizes[j]);
+			memset(p, 1, sizes[j]);
+			free(p);
+
+			p = aligned_alloc(aligns[i], sizes[j]);
+			assert((uintptr_t)p % aligns[i] == 0);
+			memset(p, 2, sizes[j]);
+			p = realloc(p, sizes[j] + 100);
+			assert(((unsigned char*)p)[sizes[j] - 1] == 2);
+			free(p);
+		}
+	}
+	void* p = nullptr;
+	int ret = posix_memalign(&p, 24, 100);
+	assert(ret == EINVAL);
+
+	// 不属于内存池的指针 (这里直接用 glibc 的 malloc 分配) 交还给下一个分配器
+	void* libc = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+	assert(libc != nullptr);
+	void* (*libc_malloc)(size_t) = (void* (*)(size_t))dlsym(libc, "malloc");
+	assert(libc_malloc != nullptr && (void*)libc_malloc != (void*)&malloc);
+	char* foreign = (char*)libc_malloc(100);
+	memset(foreign, 0x3c, 100);
+	assert(malloc_usable_size(foreign) >= 100);
+	foreign = (char*)realloc(foreign, 5000);
+	assert(foreign != nullptr);
+	for (size_t i = 0; i < 100; ++i)
+		assert((unsigned char)foreign[i] == 0x3c);
+	free(foreign);
+	::operator delete(libc_malloc(32), (size_t)32);
+	dlclose(libc);
+
+	// operator new / delete 的各个版本
+	int* x = new int(5);
+	delete x;
+	std::string* strs = new std::string[100];
+	delete[] strs;
+	Aligned64* a = new Aligned64;
+	assert((uintptr_t)a % 64 == 0);
+	delete a;
+	Aligned64* as = new Aligned64[7];
+	assert((uintptr_t)as % 64 == 0);
+	delete[] as;
+	char* n = new (std::nothrow) char[1000];
+	delete[] n;
+
+	// 多线程下的标准库容器
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([t]() {
+			std::map<int, std::string> m;
+			for (int i = 0; i < 20000; ++i)
+			{
+				m[i % 3000] = std::string(i % 200, (char)('a' + t));
+			}
+			for (auto& kv : m)
+				assert(kv.second.empty() || kv.second[0] == (char)('a' + t));
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+
+	cout << "MallocOverrideChild passed" << endl;
+	return 0;
+}
+
+void TestMallocOverride()
+{
+	// 子进程通过 LD_PRELOAD 加载共享库, 也拿未修改的程序试一下
+	int ret = system("LD_PRELOAD=./libconcurrentalloc.so ./main malloc_override");
+	assert(ret == 0);
+	ret = system("CONCURRENT_ALLOC_PER_CPU=1 LD_PRELOAD=./libconcurrentalloc.so ./main malloc_override");
+	assert(ret == 0);
+	ret = system("CONCURRENT_ALLOC_HUGEPAGE=1 LD_PRELOAD=./libconcurrentalloc.so ./main malloc_override");
+	assert(ret == 0);
+	ret = system("LD_PRELOAD=./libconcurrentalloc.so sort -r my_unit_test.cc > /dev/null");
+	assert(ret == 0);
+
+	cout << "TestMallocOverride passed" << endl;
+}
+
+void TestHugePageFiller()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+	// 关掉小 Span 缓存, 每次申请和释放都直接到达填充器
+	page_cache->SetSpanCacheEnabled(false);
+	page_cache->SetHugePageFiller(true);
+	std::vector<HugePageInfo> info(64);
+
+	// 两个 hugepage 各放 512 个单页 Span, 正好放满, 每个 Span 都不跨越 hugepage
+	std::vector<Span*> spans;
+	for (size_t i = 0; i < 2 * HUGEPAGE_PAGES; ++i)
+	{
+		Span* span = page_cache->NewSpan(1);
+		assert((span->page_id << PAGE_SHIFT) % ((size_t)1 << HUGEPAGE_SHIFT) == i % HUGEPAGE_PAGES << PAGE_SHIFT);
+		spans.push_back(span);
+	}
+	assert(page_cache->HugePageOccupancy(info.data(), info.size()) == 2);
+	assert(info[0].used_pages == HUGEPAGE_PAGES && info[1].used_pages == HUGEPAGE_PAGES);
+
+	// 第一个释放 100 页, 第二个释放 300 页, 新的 Span 放进更满的第一个
+	Page_ID fuller = spans[0]->page_id / HUGEPAGE_PAGES;
+	Page_ID emptier = spans[HUGEPAGE_PAGES]->page_id / HUGEPAGE_PAGES;
+	for (size_t i = 0; i < 100; ++i)
+		page_cache->ReleaseSpanToPageCache(spans[2 * i]);
+	for (size_t i = 0; i < 300; ++i)
+		page_cache->ReleaseSpanToPageCache(spans[HUGEPAGE_PAGES + i]);
+	Span* span = page_cache->NewSpan(1);
+	assert(span->page_id / HUGEPAGE_PAGES == fuller);
+	page_cache->ReleaseSpanToPageCache(span);
+	// 释放的页不再映射到任何 Span
+	assert(page_cache->FindSpan((void*)(emptier * HUGEPAGE_PAGES << PAGE_SHIFT)) == nullptr);
+
+	// 多页的 Span 也放进已有的 hugepage 的空洞中, 不映射新的 hugepage
+	size_t system_bytes = page_cache->SystemBytes();
+	Span* hole = page_cache->NewSpan(NPAGES - 1);
+	assert(hole->page_id / HUGEPAGE_PAGES == emptier);
+	page_cache->ReleaseSpanToPageCache(hole);
+	assert(page_cache->SystemBytes() == system_bytes);
+
+	// 全部释放后两个 hugepage 都变空, 没有后台回收线程时全空的超过门槛才从闲置最久的开始还给系统
+	page_cache->SetReleaseOnFreeBytes((size_t)1 << HUGEPAGE_SHIFT);
+	for (size_t i = 0; i < 100; ++i)
+		page_cache->ReleaseSpanToPageCache(spans[2 * i + 1]);
+	for (size_t i = 200; i < HUGEPAGE_PAGES; ++i)
+		page_cache->ReleaseSpanToPageCache(spans[i]);
+	for (size_t i = HUGEPAGE_PAGES + 300; i < 2 * HUGEPAGE_PAGES; ++i)
+		page_cache->ReleaseSpanToPageCache(spans[i]);
+	page_cache->SetReleaseOnFreeBytes(RELEASE_ON_FREE_BYTES);
+	size_t count = page_cache->HugePageOccupancy(info.data(), info.size());
+	assert(count == 2);
+	assert(info[0].used_pages == 0 && !info[0].released);
+	assert(info[1].used_pages == 0 && info[1].released);
+	assert((Page_ID)info[1].address >> PAGE_SHIFT == fuller * HUGEPAGE_PAGES);
+
+	// 反复申请释放一个小 Span 时一直使用仍有物理内存的 hugepage, 释放时不 madvise
+	size_t returned_bytes = page_cache->ReturnedBytes();
+	for (size_t i = 0; i < 100; ++i)
+	{
+		span = page_cache->NewSpan(1);
+		assert(span->page_id / HUGEPAGE_PAGES == emptier);
+		memset((void*)(span->page_id << PAGE_SHIFT), 1, (size_t)1 << PAGE_SHIFT);
+		page_cache->ReleaseSpanToPageCache(span);
+		assert(page_cache->ReturnedBytes() == returned_bytes);
+		assert(ResidentPages((void*)(emptier * HUGEPAGE_PAGES << PAGE_SHIFT), (size_t)1 << PAGE_SHIFT) == 1);
+	}
+	page_cache->ReleaseToSystem((size_t)-1);
+	count = page_cache->HugePageOccupancy(info.data(), info.size());
+	for (size_t i = 0; i < count; ++i)
+		assert(info[i].used_pages == 0 && info[i].released);
+
+	// 小对象照常分配, 页面集中在少数几个 hugepage 中, 平均占用率在 90% 以上
+	page_cache->SetSpanCacheEnabled(true);
+	std::vector<void*> v;
+	size_t bytes = 0;
+	for (size_t i = 0; i < 20000; ++i)
+	{
+		size_t size = 1 + (i * 7919) % 4096;
+		v.push_back(ConcurrentAlloc(size));
+		memset(v.back(), 1, size);
+		bytes += size;
+	}
+	count = page_cache->HugePageOccupancy(info.data(), info.size());
+	assert(count <= info.size());
+	size_t used = 0;
+	for (size_t i = 0; i < count; ++i)
+		used += info[i].used_pages;
+	assert(used << PAGE_SHIFT >= bytes / 2);
+	assert(used * 10 >= count * HUGEPAGE_PAGES * 9);
+	for (size_t i = 0; i < v.size(); ++i)
+		ConcurrentDealloc(v[i]);
+
+	page_cache->SetHugePageFiller(false);
+	cout << "TestHugePageFiller passed" << endl;
+}
+
+// 在子进程中伪造两个节点的拓扑: 所有 CPU 属于节点 0, 节点 1 只有内存, 线程通过 SetThreadNode 固定到节点 1
+int NumaChild()
+{
+	char root[] = "/tmp/numa_topology_XXXXXX";
+	assert(mkdtemp(root) != nullptr);
+	std::string dir(root);
+	assert(system(("mkdir -p " + dir + "/node0 " + dir + "/node1").c_str()) == 0);
+	assert(system(("echo 0-1 > " + dir + "/online; echo 0-1023 > " + dir + "/node0/cpulist; "
+		"echo > " + dir + "/node1/cpulist").c_str()) == 0);
+
+	NumaTopology* numa = NumaTopology::GetInstance();
+	bool ok = numa->Init(root);
+	assert(system(("rm -rf " + dir).c_str()) == 0);
+	assert(ok && numa->Enabled() && numa->NumNodes() == 2);
+	assert(numa->CurrentNode() == 0);
+
+	PageCache* node1 = PageCache::GetInstance(1);
+	const size_t big = 300 << PAGE_SHIFT;
+	std::vector<void*> remote;
+	std::thread producer([&remote]() {
+		NumaTopology::SetThreadNode(1);
+		assert(NumaTopology::GetInstance()->CurrentNode() == 1);
+		for (size_t i = 0; i < 100; ++i)
+			remote.push_back(ConcurrentAlloc(64));
+		remote.push_back(ConcurrentAlloc(big));
+		for (size_t i = 0; i < remote.size(); ++i)
+		{
+			memset(remote[i], 1, i < 100 ? 64 : big);
+			assert(PageCache::GetInstance()->MapObjectToSpan(remote[i])->node == 1);
+		}
+	});
+	producer.join();
+	assert(node1->SystemBytes() > 0);
+
+	// 节点 0 上的线程分配的内存来自节点 0, 释放节点 1 的对象后它们回到节点 1 的分区
+	std::thread consumer([&remote]() {
+		std::vector<void*> local;
+		for (size_t i = 0; i < 100; ++i)
+		{
+			local.push_back(ConcurrentAlloc(64));
+			assert(PageCache::GetInstance()->MapObjectToSpan(local.back())->node == 0);
+		}
+		for (size_t i = 0; i < remote.size(); ++i)
+			ConcurrentDealloc(remote[i]);
+		for (size_t i = 0; i < local.size(); ++i)
+			ConcurrentDealloc(local[i]);
+	});
+	consumer.join();
+
+	// 在节点 0 上交替释放两个节点的对象, 自由链表中混有两个节点的对象:
+	// 归还时混合的批次不能进入 TransferCache, 每个节点的 TransferCache 中只有本节点的对象
+	const size_t batch = SizeClass::NumMoveObjs(64);
+	remote.clear();
+	std::thread producer2([&remote, batch]() {
+		NumaTopology::SetThreadNode(1);
+		for (size_t i = 0; i < 2 * batch; ++i)
+			remote.push_back(ConcurrentAlloc(64));
+	});
+	producer2.join();
+	std::thread mixer([&remote, batch]() {
+		std::vector<void*> local;
+		for (size_t i = 0; i < 2 * batch; ++i)
+			local.push_back(ConcurrentAlloc(64));
+		for (size_t i = 0; i < 2 * batch; ++i)
+		{
+			ConcurrentDealloc(remote[i]);
+			ConcurrentDealloc(local[i]);
+		}
+	});
+	mixer.join();
+	for (size_t node = 0; node < 2; ++node)
+	{
+		void *start, *end;
+		while (TransferCache::GetInstance(node)->RemoveRange(64, start, end, batch) > 0)
+		{
+			for (void* cur = start; cur != nullptr; cur = NextObj(cur))
+				assert(PageCache::GetInstance()->MapObjectToSpan(cur)->node == node);
+			CentralCache::GetInstance(node)->ReleaseListToSpans(start, 64);
+		}
+	}
+
+	// 两个线程都已退出, 节点 1 的内存全部回到了节点 1 的页堆
+	node1->ReleaseToSystem((size_t)-1);
+	assert(node1->FreeBytes() == 0);
+	assert(node1->ReturnedBytes() == node1->SystemBytes());
+
+	cout << "NumaChild passed" << endl;
+	return 0;
+}
+
+void TestNuma()
+{
+	int ret = system("./main numa");
+	assert(ret == 0);
+	cout << "TestNuma passed" << endl;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "malloc_override") == 0)
+		return MallocOverrideChild();
+	if (argc > 1 && strcmp(argv[1], "numa") == 0)
+		return NumaChild();
+
+	InitAllocator();
 	// TestSize();
+	TestSizeClass();
 	TestThreadCache();
+	TestPageMap();
+	TestReleaseToSystem();
+	TestLargeSpan();
+	TestScavenger();
+	TestThreadExit();
+	TestThreadCacheBudget();
+	TestTransferCache();
+	TestSizedDealloc();
+	TestMetadataPool();
+	TestSpanCache();
+	TestCentralCacheBuckets();
+	TestSpanBumpCarving();
+	TestAllocatorStats();
+	TestHeapProfiler();
+	TestRemoteFree();
+	TestBatchAlloc();
+	TestHeap();
+	TestRealloc();
+	TestMallocOverride();
+	TestHugePageFiller();
+	TestNuma();
+	// 开启后不能关闭, 放在最后
+	TestCpuCache();
 	// TestCentralCache();
 	// TestPageCache();
 	// TestConcurrentAllocFree();
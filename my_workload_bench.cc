@@ -0,0 +1,497 @@
+// 多线程工作负载测试
+// 只通过 malloc / free 调用分配器, 不链接内存池的源文件, 用 LD_PRELOAD 切换被测的分配器:
+//   ./workload_bench --label=glibc
+//   LD_PRELOAD=$PWD/libconcurrentalloc.so ./workload_bench --label=concurrent
+// make -f MakeFile compare 依次在 glibc, 本内存池和已安装的 jemalloc / tcmalloc 下运行
+//
+// 参数:
+//   --threads=N    最大线程数, 默认为核数
+//   --ops=N        每个线程的操作次数, 默认 200000
+//   --sizes=DIST   小对象大小的分布: fixed:N, uniform:MIN:MAX, loguniform:MIN:MAX (默认 loguniform:8:4096)
+//   --label=NAME   输出中的分配器名字
+//   其余参数为要运行的工作负载: churn producer larson large scaling, 默认全部
+//
+// 每个工作负载输出 吞吐 (malloc + free 次数 / 秒), malloc 和 free 的 p50 / p99 / p999 延迟 (纳秒)
+// 和峰值 RSS. 延迟每 8 次操作取样一次, 计时本身约占 20ns
+#include<iostream>
+#include<vector>
+#include<thread>
+#include<atomic>
+#include<string>
+#include<cmath>
+#include<cstring>
+#include<cstdlib>
+#include<cstdio>
+#include<time.h>
+#include<unistd.h>
+#include<sys/resource.h>
+
+using std::cout;
+using std::endl;
+
+static uint64_t NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 每个线程独立的随机数, xorshift64*
+struct Random
+{
+	uint64_t state;
+
+	explicit Random(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15 + 1) {}
+
+	uint64_t Next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1D;
+	}
+
+	// [0, 1)
+	double Uniform()
+	{
+		return (Next() >> 11) / (double)(1ULL << 53);
+	}
+};
+
+// 对象大小的分布
+struct SizeDist
+{
+	enum Kind { FIXED, UNIFORM, LOGUNIFORM } kind = LOGUNIFORM;
+	size_t min = 8;
+	size_t max = 4096;
+
+	size_t Sample(Random& rng) const
+	{
+		switch (kind)
+		{
+		case FIXED:
+			return min;
+		case UNIFORM:
+			return min + rng.Next() % (max - min + 1);
+		default:
+			return (size_t)std::exp(std::log((double)min) + rng.Uniform() * (std::log((double)max + 1) - std::log((double)min)));
+		}
+	}
+
+	bool Parse(const char* s)
+	{
+		unsigned long long a = 0, b = 0;
+		if (sscanf(s, "fixed:%llu", &a) == 1 && a > 0)
+		{
+			kind = FIXED;
+			min = max = a;
+			return true;
+		}
+		if (sscanf(s, "uniform:%llu:%llu", &a, &b) == 2 && a > 0 && a <= b)
+		{
+			kind = UNIFORM;
+			min = a;
+			max = b;
+			return true;
+		}
+		if (sscanf(s, "loguniform:%llu:%llu", &a, &b) == 2 && a > 0 && a <= b)
+		{
+			kind = LOGUNIFORM;
+			min = a;
+			max = b;
+			return true;
+		}
+		return false;
+	}
+};
+
+// 对数分桶的延迟直方图, 每个 2 的幂区间分 16 个桶, 误差约 6%
+struct Histogram
+{
+	static const size_t SUB_BITS = 4;
+	static const size_t BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+	uint64_t counts[BUCKETS] = {};
+	uint64_t total = 0;
+
+	static size_t Bucket(uint64_t v)
+	{
+		if (v < (1u << SUB_BITS))
+			return v;
+		size_t e = 63 - __builtin_clzll(v);
+		return ((e - SUB_BITS + 1) << SUB_BITS) + ((v >> (e - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+	}
+
+	// 桶的下界
+	static uint64_t Value(size_t bucket)
+	{
+		if (bucket < (1u << SUB_BITS))
+			return bucket;
+		size_t e = (bucket >> SUB_BITS) + SUB_BITS - 1;
+		return ((1ULL << SUB_BITS) + (bucket & ((1u << SUB_BITS) - 1))) << (e - SUB_BITS);
+	}
+
+	void Add(uint64_t v)
+	{
+		counts[Bucket(v)]++;
+		total++;
+	}
+
+	void Merge(const Histogram& other)
+	{
+		for (size_t i = 0; i < BUCKETS; ++i)
+			counts[i] += other.counts[i];
+		total += other.total;
+	}
+
+	uint64_t Percentile(double p) const
+	{
+		uint64_t rank = (uint64_t)std::ceil(p * total);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank && seen > 0)
+				return Value(i);
+		}
+		return 0;
+	}
+};
+
+// 每个线程的统计, 按缓存行对齐避免伪共享
+struct alignas(64) ThreadStats
+{
+	Histogram malloc_ns;
+	Histogram free_ns;
+	uint64_t ops = 0;
+};
+
+struct Config
+{
+	size_t threads = 1;
+	size_t ops = 200000;
+	SizeDist sizes;
+	std::string label = "default";
+};
+
+static const size_t SAMPLE_MASK = 7;
+
+// 计时的 malloc / free, 每 SAMPLE_MASK + 1 次操作取样一次延迟
+static inline void* TimedMalloc(ThreadStats& stats, size_t size)
+{
+	if ((stats.ops++ & SAMPLE_MASK) != 0)
+		return malloc(size);
+	uint64_t begin = NowNs();
+	void* ptr = malloc(size);
+	stats.malloc_ns.Add(NowNs() - begin);
+	return ptr;
+}
+
+static inline void TimedFree(ThreadStats& stats, void* ptr)
+{
+	if ((stats.ops++ & SAMPLE_MASK) != 0)
+	{
+		free(ptr);
+		return;
+	}
+	uint64_t begin = NowNs();
+	free(ptr);
+	stats.free_ns.Add(NowNs() - begin);
+}
+
+// 写第一个字节, 使对象真正被使用, 也防止编译器消除 malloc / free
+static inline void Touch(void* ptr, size_t size)
+{
+	((volatile char*)ptr)[0] = (char)size;
+}
+
+// 重置峰值 RSS (Linux 4.0 起写 5 到 clear_refs), 失败时峰值是整个进程的
+static void ResetPeakRss()
+{
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+	if (file == nullptr)
+		return;
+	fputs("5", file);
+	fclose(file);
+}
+
+static size_t PeakRssKB()
+{
+	FILE* file = fopen("/proc/self/status", "r");
+	size_t kb = 0;
+	if (file != nullptr)
+	{
+		char line[256];
+		while (fgets(line, sizeof(line), file) != nullptr)
+		{
+			if (sscanf(line, "VmHWM: %zu kB", &kb) == 1)
+				break;
+		}
+		fclose(file);
+	}
+	if (kb == 0)
+	{
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		kb = usage.ru_maxrss;
+	}
+	return kb;
+}
+
+// 同时启动 n 个线程执行 fn(t, stats[t]), 返回从全部就绪到全部结束的时间
+template <class F>
+static uint64_t RunThreads(size_t n, std::vector<ThreadStats>& stats, F fn)
+{
+	std::atomic<size_t> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < n; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			ready++;
+			while (!go)
+				std::this_thread::yield();
+			fn(t, stats[t]);
+		});
+	}
+	while (ready != n)
+		std::this_thread::yield();
+	uint64_t begin = NowNs();
+	go = true;
+	for (size_t t = 0; t < n; ++t)
+		threads[t].join();
+	return NowNs() - begin;
+}
+
+static void Report(const Config& config, const char* workload, size_t threads, uint64_t elapsed_ns,
+                   const std::vector<ThreadStats>& stats)
+{
+	Histogram malloc_ns, free_ns;
+	uint64_t ops = 0;
+	for (size_t t = 0; t < stats.size(); ++t)
+	{
+		malloc_ns.Merge(stats[t].malloc_ns);
+		free_ns.Merge(stats[t].free_ns);
+		ops += stats[t].ops;
+	}
+	char line[256];
+	snprintf(line, sizeof(line), "%-12s %-10s %4zu %12.0f %7llu %7llu %7llu %7llu %7llu %7llu %9.1f",
+	         config.label.c_str(), workload, threads, ops / (elapsed_ns / 1e9),
+	         (unsigned long long)malloc_ns.Percentile(0.5), (unsigned long long)malloc_ns.Percentile(0.99),
+	         (unsigned long long)malloc_ns.Percentile(0.999), (unsigned long long)free_ns.Percentile(0.5),
+	         (unsigned long long)free_ns.Percentile(0.99), (unsigned long long)free_ns.Percentile(0.999),
+	         PeakRssKB() / 1024.0);
+	cout << line << endl;
+}
+
+// 随机大小的对象群体: 每个线程维持 4096 个存活对象, 每次随机释放一个再分配一个
+static void Churn(const Config& config, size_t threads, const char* name)
+{
+	ResetPeakRss();
+	std::vector<ThreadStats> stats(threads);
+	uint64_t elapsed = RunThreads(threads, stats, [&](size_t t, ThreadStats& s) {
+		Random rng(t + 1);
+		const size_t live = 4096;
+		std::vector<void*> slots(live);
+		for (size_t i = 0; i < live; ++i)
+		{
+			size_t size = config.sizes.Sample(rng);
+			slots[i] = TimedMalloc(s, size);
+			Touch(slots[i], size);
+		}
+		for (size_t i = 0; i < config.ops; ++i)
+		{
+			size_t k = rng.Next() % live;
+			TimedFree(s, slots[k]);
+			size_t size = config.sizes.Sample(rng);
+			slots[k] = TimedMalloc(s, size);
+			Touch(slots[k], size);
+		}
+		for (size_t i = 0; i < live; ++i)
+			TimedFree(s, slots[i]);
+	});
+	Report(config, name, threads, elapsed, stats);
+}
+
+// 单生产者单消费者的环形队列
+struct alignas(64) Ring
+{
+	static const size_t CAPACITY = 1024;
+	void* items[CAPACITY];
+	alignas(64) std::atomic<size_t> head{0};   // 消费者读取的位置
+	alignas(64) std::atomic<size_t> tail{0};   // 生产者写入的位置
+
+	void Push(void* ptr)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		while (t - head.load(std::memory_order_acquire) == CAPACITY)
+			std::this_thread::yield();
+		items[t % CAPACITY] = ptr;
+		tail.store(t + 1, std::memory_order_release);
+	}
+
+	void* Pop()
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		while (tail.load(std::memory_order_acquire) == h)
+			std::this_thread::yield();
+		void* ptr = items[h % CAPACITY];
+		head.store(h + 1, std::memory_order_release);
+		return ptr;
+	}
+};
+
+// 生产者分配消息交给消费者释放, 所有释放都是跨线程的
+static void ProducerConsumer(const Config& config, size_t threads)
+{
+	size_t pairs = std::max<size_t>(1, threads / 2);
+	ResetPeakRss();
+	std::vector<Ring> rings(pairs);
+	std::vector<ThreadStats> stats(pairs * 2);
+	uint64_t elapsed = RunThreads(pairs * 2, stats, [&](size_t t, ThreadStats& s) {
+		Ring& ring = rings[t / 2];
+		if (t % 2 == 0)
+		{
+			Random rng(t + 1);
+			for (size_t i = 0; i < config.ops; ++i)
+			{
+				size_t size = config.sizes.Sample(rng);
+				void* ptr = TimedMalloc(s, size);
+				Touch(ptr, size);
+				ring.Push(ptr);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < config.ops; ++i)
+				TimedFree(s, ring.Pop());
+		}
+	});
+	Report(config, "producer", pairs * 2, elapsed, stats);
+}
+
+// larson 式的服务器模拟: 每一轮的线程随机替换自己那一份对象, 然后退出,
+// 下一轮新建的线程接手这些对象, 因此对象总是由分配它的线程之后的线程释放
+static void Larson(const Config& config, size_t threads)
+{
+	const size_t rounds = 10;
+	const size_t live = 1000;
+	ResetPeakRss();
+	std::vector<std::vector<void*>> slots(threads, std::vector<void*>(live, nullptr));
+	std::vector<ThreadStats> stats(threads);
+	uint64_t elapsed = 0;
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		elapsed += RunThreads(threads, stats, [&](size_t t, ThreadStats& s) {
+			Random rng(r * threads + t + 1);
+			std::vector<void*>& mine = slots[t];
+			for (size_t i = 0; i < config.ops / rounds; ++i)
+			{
+				size_t k = rng.Next() % live;
+				if (mine[k] != nullptr)
+					TimedFree(s, mine[k]);
+				size_t size = config.sizes.Sample(rng);
+				mine[k] = TimedMalloc(s, size);
+				Touch(mine[k], size);
+			}
+		});
+	}
+	for (size_t t = 0; t < threads; ++t)
+	{
+		for (size_t k = 0; k < live; ++k)
+			free(slots[t][k]);
+	}
+	Report(config, "larson", threads, elapsed, stats);
+}
+
+// 64K ~ 4M 的大对象, 每个线程只保留少量存活对象
+static void Large(const Config& config, size_t threads)
+{
+	SizeDist dist;
+	dist.kind = SizeDist::LOGUNIFORM;
+	dist.min = 64 << 10;
+	dist.max = 4 << 20;
+	ResetPeakRss();
+	std::vector<ThreadStats> stats(threads);
+	uint64_t elapsed = RunThreads(threads, stats, [&](size_t t, ThreadStats& s) {
+		Random rng(t + 1);
+		void* slots[16] = {};
+		for (size_t i = 0; i < config.ops / 64; ++i)
+		{
+			size_t k = rng.Next() % 16;
+			if (slots[k] != nullptr)
+				TimedFree(s, slots[k]);
+			size_t size = dist.Sample(rng);
+			slots[k] = TimedMalloc(s, size);
+			Touch(slots[k], size);
+		}
+		for (size_t k = 0; k < 16; ++k)
+			free(slots[k]);
+	});
+	Report(config, "large", threads, elapsed, stats);
+}
+
+int main(int argc, char** argv)
+{
+	Config config;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	config.threads = cpus > 0 ? (size_t)cpus : 1;
+
+	std::vector<std::string> workloads;
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		if (strncmp(arg, "--threads=", 10) == 0)
+			config.threads = std::max(1L, atol(arg + 10));
+		else if (strncmp(arg, "--ops=", 6) == 0)
+			config.ops = std::max(64L, atol(arg + 6));
+		else if (strncmp(arg, "--label=", 8) == 0)
+			config.label = arg + 8;
+		else if (strncmp(arg, "--sizes=", 8) == 0)
+		{
+			if (!config.sizes.Parse(arg + 8))
+			{
+				std::cerr << "bad size distribution: " << arg + 8 << endl;
+				return 1;
+			}
+		}
+		else
+			workloads.push_back(arg);
+	}
+	if (workloads.empty())
+		workloads = { "churn", "producer", "larson", "large", "scaling" };
+
+	char header[256];
+	snprintf(header, sizeof(header), "%-12s %-10s %4s %12s %7s %7s %7s %7s %7s %7s %9s", "allocator", "workload",
+	         "thr", "ops/s", "m.p50", "m.p99", "m.p999", "f.p50", "f.p99", "f.p999", "peakMB");
+	cout << header << endl;
+
+	for (size_t i = 0; i < workloads.size(); ++i)
+	{
+		const std::string& w = workloads[i];
+		if (w == "churn")
+			Churn(config, config.threads, "churn");
+		else if (w == "producer")
+			ProducerConsumer(config, std::max<size_t>(2, config.threads));
+		else if (w == "larson")
+			Larson(config, config.threads);
+		else if (w == "large")
+			Large(config, config.threads);
+		else if (w == "scaling")
+		{
+			// 1, 2, 4 ... 直到最大线程数
+			for (size_t n = 1; ; n *= 2)
+			{
+				size_t threads = std::min(n, config.threads);
+				Churn(config, threads, "scaling");
+				if (threads == config.threads)
+					break;
+			}
+		}
+		else
+		{
+			std::cerr << "unknown workload: " << w << endl;
+			return 1;
+		}
+	}
+	return 0;
+}